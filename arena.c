@@ -0,0 +1,162 @@
+// This file implements a bump-pointer allocator.
+//
+// The compiler creates a huge number of small objects (tokens, AST
+// nodes, types, etc.) and never frees them individually. Allocating
+// each of them with calloc() is wasteful, so we carve them out of
+// large chunks instead. An arena is released as a whole.
+//
+// There are two kinds of lifetimes. Objects that may be referenced
+// until the end of compilation are allocated from `perm_arena`.
+// AST nodes and local variables of a function definition are
+// allocated from the function's own arena, which can be released
+// as soon as the code for the function has been emitted. Chunks of
+// released arenas are kept in a free list and reused by the next
+// function.
+
+#include "chibicc.h"
+#include <sys/resource.h>
+
+// Default chunk size. Larger objects get their own chunk.
+#define CHUNK_SIZE (256 * 1024)
+
+struct ArenaChunk {
+  ArenaChunk *next;
+  size_t size;
+  char data[];
+};
+
+Arena *perm_arena = &(Arena){};
+
+// Chunks of released arenas
+static ArenaChunk *free_chunks;
+
+// Statistics for -fmem-report
+bool opt_mem_report;
+
+static char *mem_kind_names[] = {
+  [MEM_TOKEN] = "tokens",
+  [MEM_NODE] = "nodes",
+  [MEM_TYPE] = "types",
+  [MEM_OBJ] = "objs",
+  [MEM_SCOPE] = "scopes",
+  [MEM_INIT] = "initializers",
+  [MEM_STRING] = "strings",
+  [MEM_FILE] = "files",
+};
+
+static int64_t mem_count[NUM_MEM_KINDS];
+static int64_t mem_bytes[NUM_MEM_KINDS];
+static int64_t chunk_bytes;
+static int64_t chunk_reuses;
+
+Arena *new_arena(void) {
+  return calloc(1, sizeof(Arena));
+}
+
+static ArenaChunk *alloc_chunk(size_t size) {
+  if (size == CHUNK_SIZE && free_chunks) {
+    ArenaChunk *chunk = free_chunks;
+    free_chunks = chunk->next;
+    chunk_reuses++;
+    return chunk;
+  }
+
+  ArenaChunk *chunk = malloc(sizeof(ArenaChunk) + size);
+  if (!chunk)
+    error("out of memory");
+  chunk->size = size;
+  chunk_bytes += size;
+  return chunk;
+}
+
+static void new_chunk(Arena *arena) {
+  ArenaChunk *chunk = alloc_chunk(CHUNK_SIZE);
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  arena->ptr = chunk->data;
+  arena->end = chunk->data + CHUNK_SIZE;
+}
+
+// Returns a zero-cleared memory block of a given size. Nothing in
+// the compiler needs more than 8-byte alignment.
+void *arena_alloc(Arena *arena, size_t size) {
+  size = (size + 7) / 8 * 8;
+
+  if (arena->end - arena->ptr < size) {
+    // A large object gets a dedicated chunk so that we don't
+    // waste the rest of the current chunk.
+    if (size > CHUNK_SIZE / 4) {
+      ArenaChunk *chunk = alloc_chunk(size);
+      if (arena->chunks) {
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+      } else {
+        chunk->next = NULL;
+        arena->chunks = chunk;
+      }
+      return memset(chunk->data, 0, size);
+    }
+
+    new_chunk(arena);
+  }
+
+  void *p = arena->ptr;
+  arena->ptr += size;
+  return memset(p, 0, size);
+}
+
+char *arena_strndup(Arena *arena, char *p, size_t len) {
+  char *buf = arena_alloc(arena, len + 1);
+  memcpy(buf, p, len);
+  return buf;
+}
+
+// Frees all objects allocated from a given arena at once.
+void arena_release(Arena *arena) {
+  ArenaChunk *chunk = arena->chunks;
+  while (chunk) {
+    ArenaChunk *next = chunk->next;
+    if (chunk->size == CHUNK_SIZE) {
+      chunk->next = free_chunks;
+      free_chunks = chunk;
+    } else {
+      chunk_bytes -= chunk->size;
+      free(chunk);
+    }
+    chunk = next;
+  }
+  *arena = (Arena){};
+}
+
+// Records `count` objects of a given kind taking `size` bytes in
+// total for -fmem-report.
+void count_mem(MemKind kind, int64_t count, int64_t size) {
+  if (opt_mem_report) {
+    mem_count[kind] += count;
+    mem_bytes[kind] += size;
+  }
+}
+
+void print_mem_report(char *input) {
+  if (!opt_mem_report)
+    return;
+
+  fprintf(stderr, "\nMemory allocated for %s\n", input);
+  fprintf(stderr, " %-14s %12s %14s\n", "kind", "objects", "bytes");
+
+  int64_t count = 0, bytes = 0;
+  for (int i = 0; i < NUM_MEM_KINDS; i++) {
+    fprintf(stderr, " %-14s %12ld %14ld\n", mem_kind_names[i],
+            mem_count[i], mem_bytes[i]);
+    count += mem_count[i];
+    bytes += mem_bytes[i];
+  }
+  fprintf(stderr, " %-14s %12ld %14ld\n", "TOTAL", count, bytes);
+
+  fprintf(stderr, " arena chunks: %ld bytes reserved, reused %ld times\n",
+          chunk_bytes, chunk_reuses);
+
+  struct rusage ru;
+  if (!getrusage(RUSAGE_SELF, &ru))
+    fprintf(stderr, " peak RSS: %ld KB\n", ru.ru_maxrss);
+}
@@ -0,0 +1,131 @@
+#!/bin/bash
+#
+# Measures the throughput of the compiler on synthetic inputs made by
+# bench/gen and compares it with chibicc built from a reference commit.
+#
+# Usage: bench/bench.sh [<commit>]
+#
+# The reference defaults to the merge base of HEAD and master, so on a
+# branch the change is compared with the tree it started from, and on
+# master the working tree is compared with HEAD. The reference is built
+# in a temporary directory and timed in the same run, alternating with
+# ./chibicc, so that the result doesn't depend on the machine or on
+# how busy it is.
+#
+# For each shape, the best of $BENCH_RUNS runs (default 3) of each
+# compiler is reported. The benchmark fails if a rate drops or the peak
+# RSS grows by more than $BENCH_TOLERANCE percent (default 25) from the
+# reference. $BENCH_SCALE (default 1) multiplies the size of the inputs.
+
+chibicc=./chibicc
+gen=bench/gen
+runs=${BENCH_RUNS:-3}
+tolerance=${BENCH_TOLERANCE:-25}
+scale=${BENCH_SCALE:-1}
+shapes="funcs exprs inits structs switches globals"
+
+ref=${1:-`git merge-base HEAD master 2> /dev/null || echo HEAD`}
+ref=`git rev-parse --short --verify "$ref^{commit}"` || exit 1
+
+tmp=`mktemp -d /tmp/chibicc-bench-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+echo "building $ref for reference"
+mkdir $tmp/ref
+git archive $ref | tar -x -C $tmp/ref || exit 1
+make -s -C $tmp/ref chibicc > $tmp/build 2>&1 || { cat $tmp/build; exit 1; }
+
+# Reads the output of -ftime-report and -fmem-report and prints the
+# total time, tokens per second of reading, tokenizing and
+# preprocessing, AST nodes per second of parsing, assembly lines per
+# second of code generation, and the peak RSS (in KB) at the end of
+# preprocessing, parsing and code generation and overall.
+measure() {
+    awk -v lines=$1 '
+    function rate(n, t) { return int(n / (t > 0.0001 ? t : 0.0001)) }
+    /^Execution times/ { sect = "time"; next }
+    /^Code generation times/ { sect = ""; next }
+    /^Memory allocated/ { sect = "mem"; next }
+    sect == "time" && /:/ {
+        split($0, a, ":")
+        name = a[1]
+        gsub(/^ +| +$/, "", name)
+        n = split(a[2], f, " ")
+        time[name] = f[1]
+        if (f[n] == "KB")
+            rss[name] = f[n - 1]
+    }
+    sect == "mem" && $1 == "tokens" { tokens = $2 }
+    sect == "mem" && $1 == "nodes" { nodes = $2 }
+    END {
+        front = time["read file"] + time["tokenize"] + time["preprocess"]
+        back = time["assign lvar offsets"] + time["emit data"] + time["emit text"]
+        print time["TOTAL"], rate(tokens, front), rate(nodes, time["parse"]),
+              rate(lines, back), rss["preprocess"], rss["parse"],
+              rss["emit text"], rss["TOTAL"]
+    }'
+}
+
+# Compiles $tmp/$shape.c with a given compiler and appends the
+# measurements to a given file.
+run() {
+    if ! $1 -ftime-report -fmem-report -o $tmp/$shape.s $tmp/$shape.c \
+         2> $tmp/report; then
+        cat $tmp/report
+        exit 1
+    fi
+    measure `wc -l < $tmp/$shape.s` < $tmp/report >> $2
+}
+
+# Prints the best time and rates and the lowest RSS of all runs.
+best() {
+    awk '
+    NR == 1 { for (i = 1; i <= NF; i++) v[i] = $i; next }
+    {
+        v[1] = $1 < v[1] ? $1 : v[1]
+        for (i = 2; i <= 4; i++) v[i] = $i > v[i] ? $i : v[i]
+        for (i = 5; i <= NF; i++) v[i] = $i < v[i] ? $i : v[i]
+    }
+    END { print v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8] }' $1
+}
+
+printf "%-10s %8s %10s %10s %10s %27s\n" shape time tokens/s nodes/s lines/s \
+       "RSS pp/parse/codegen (KB)"
+
+failed=0
+for shape in $shapes; do
+    $gen $shape $scale > $tmp/$shape.c || exit 1
+
+    rm -f $tmp/new $tmp/old
+    for i in `seq $runs`; do
+        run $chibicc $tmp/new
+        run $tmp/ref/chibicc $tmp/old
+    done
+
+    read time tokps nodeps lineps rss_pp rss_parse rss_cg peak < <(best $tmp/new)
+    printf "%-10s %7.3fs %10d %10d %10d %27s\n" $shape $time $tokps $nodeps \
+           $lineps "$rss_pp/$rss_parse/$rss_cg"
+
+    read time tokps nodeps lineps rss_pp rss_parse rss_cg peak < <(best $tmp/old)
+    printf "%-10s %7.3fs %10d %10d %10d %27s\n" "  $ref" $time $tokps $nodeps \
+           $lineps "$rss_pp/$rss_parse/$rss_cg"
+
+    msg=`echo $(best $tmp/old) $(best $tmp/new) | awk -v tol=$tolerance '{
+        split("tokens/s nodes/s lines/s", names)
+        for (i = 2; i <= 4; i++)
+            if ($(i + 8) < $i * (100 - tol) / 100)
+                printf "  %s dropped from %d to %d\n", names[i - 1], $i, $(i + 8)
+        if ($16 > $8 * (100 + tol) / 100)
+            printf "  peak RSS grew from %d KB to %d KB\n", $8, $16
+    }'`
+    if [ -n "$msg" ]; then
+        echo "$msg"
+        failed=1
+    fi
+done
+
+if [ $failed = 1 ]; then
+    echo "FAIL: regressed more than $tolerance% from $ref"
+    exit 1
+fi
+echo OK
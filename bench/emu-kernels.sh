@@ -0,0 +1,71 @@
+#!/bin/bash
+#
+# Counts the instructions the compute kernels in bench/kernels execute
+# when compiled by chibicc, using bench/la64emu.py instead of qemu.
+# This needs nothing but python3, so it works where run-kernels.sh
+# cannot, but the interpreter is slow, so the kernels are built with
+# a small problem size.
+#
+# Usage: bench/emu-kernels.sh [--update] [kernel...]
+#
+# CHIBICC selects the compiler (default: ./chibicc), so the counts of
+# another build, such as one of an older commit, can be compared.
+# KERNEL_FLAGS is passed to chibicc (default: -DN=20).
+#
+# With --update, the counts are recorded in bench/kernels/emu-baseline
+# along with KERNEL_FLAGS. Later runs show the change from a baseline
+# recorded with the same flags.
+
+chibicc=${CHIBICC:-./chibicc}
+emu=bench/la64emu.py
+flags=`echo ${KERNEL_FLAGS--DN=20}`
+baseline=bench/kernels/emu-baseline
+
+update=0
+if [ "$1" = --update ]; then
+    update=1
+    shift
+fi
+
+kernels="$@"
+[ -z "$kernels" ] && kernels=`cd bench/kernels; ls *.c | sed 's/\.c$//'`
+
+tmp=`mktemp -d /tmp/chibicc-emu-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+printf "%-10s %14s %9s  %s\n" kernel insns "vs base" output
+
+for k in $kernels; do
+    $chibicc $flags -o $tmp/$k.s bench/kernels/$k.c || exit 1
+    if ! python3 $emu $tmp/$k.s -v > $tmp/out 2> $tmp/log; then
+        echo "$k failed"
+        cat $tmp/out $tmp/log
+        exit 1
+    fi
+    n=`sed -n 's/^icount=//p' $tmp/log`
+
+    base=-
+    if [ $update = 1 ]; then
+        echo "$k $n $flags" >> $tmp/baseline
+    elif [ -f $baseline ]; then
+        # Lines are "<kernel> <count> <flags>...".
+        b=`awk -v k=$k -v f="$flags" '$1 == k {
+            n = $2; $1 = $2 = ""; sub(/^ +/, "")
+            if ($0 == f) print n
+        }' $baseline`
+        [ -n "$b" ] && base=`awk -v a=$n -v b=$b \
+            'BEGIN { printf "%+.1f%%", (a - b) * 100 / b }'`
+    fi
+
+    printf "%-10s %14d %9s  %s\n" $k $n $base "`head -1 $tmp/out`"
+done
+
+# Keep the counts of the kernels that were not run.
+if [ $update = 1 ]; then
+    [ -f $baseline ] && for k in $kernels; do
+        sed -i "/^$k /d" $baseline
+    done
+    cat $tmp/baseline >> $baseline
+    sort -o $baseline $baseline
+    echo "baseline written to $baseline"
+fi
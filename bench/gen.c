@@ -0,0 +1,168 @@
+// Generator of synthetic C programs for measuring the compiler's
+// throughput. Each shape stresses a different part of the compiler,
+// and the scale multiplies the size of the output.
+//
+// Usage: bench/gen <shape> [scale]
+//
+// Shapes:
+//   funcs     many small functions
+//   exprs     deeply nested expressions
+//   inits     huge initializers of arrays and structs
+//   structs   wide structs and member accesses
+//   switches  large switch statements
+//   globals   many global variables
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int scale = 1;
+
+static char *ops[] = {"+", "-", "*", "^", "|", "&"};
+
+static void gen_funcs(void) {
+  for (int i = 0; i < 5000 * scale; i++) {
+    printf("int f%d(int a, int b) {\n", i);
+    printf("  int x = a + %d;\n", i);
+    printf("  if (x > b)\n    return x * 2 - b;\n");
+    printf("  for (int i = 0; i < b; i++)\n    x += i ^ a;\n");
+    printf("  return x;\n}\n\n");
+  }
+}
+
+// Prints an expression nested `depth` levels deep, alternating
+// parenthesized left-deep and right-deep operands.
+static void gen_expr(int depth) {
+  if (depth == 0) {
+    printf("a");
+    return;
+  }
+
+  char *op = ops[depth % 6];
+  if (depth % 2) {
+    printf("(");
+    gen_expr(depth - 1);
+    printf(" %s %d)", op, depth);
+  } else {
+    printf("b %s (", op);
+    gen_expr(depth - 1);
+    printf(")");
+  }
+}
+
+static void gen_exprs(void) {
+  for (int i = 0; i < 200 * scale; i++) {
+    printf("long e%d(long a, long b) {\n  return ", i);
+    gen_expr(200);
+    printf(";\n}\n\n");
+  }
+}
+
+static void gen_inits(void) {
+  printf("int table[] = {");
+  for (int i = 0; i < 100000 * scale; i++)
+    printf("%s%d,", i % 16 ? " " : "\n  ", i * 7 % 1000);
+  printf("\n};\n\n");
+
+  printf("struct P { int x; char *name; long l; short s[3]; };\n\n");
+  printf("struct P points[] = {\n");
+  for (int i = 0; i < 10000 * scale; i++)
+    printf("  {%d, \"p%d\", %dL, {%d, %d}},\n", i, i, i, i % 100, -i % 100);
+  printf("};\n\n");
+
+  printf("int sum(void) {\n  int n = 0;\n");
+  printf("  for (int i = 0; i < sizeof(table) / sizeof(*table); i++)\n");
+  printf("    n += table[i] + points[i %% 100].x;\n");
+  printf("  return n;\n}\n");
+}
+
+static char *member_types[] = {"char", "short", "int", "long", "unsigned", "char *"};
+
+static void gen_structs(void) {
+  for (int i = 0; i < 100 * scale; i++) {
+    printf("struct S%d {\n", i);
+    for (int j = 0; j < 200; j++)
+      printf("  %s m%d;\n", member_types[j % 6], j);
+    printf("};\n\n");
+
+    printf("long s%d(struct S%d *p) {\n  long n = 0;\n", i, i);
+    for (int j = 0; j < 200; j++) {
+      if (j % 6 == 5)
+        printf("  n += p->m%d != 0;\n", j);
+      else
+        printf("  n += p->m%d;\n", j);
+    }
+    printf("  return n;\n}\n\n");
+  }
+}
+
+static void gen_switches(void) {
+  for (int i = 0; i < 100 * scale; i++) {
+    printf("int sw%d(int x) {\n  switch (x) {\n", i);
+    for (int j = 0; j < 500; j++)
+      printf("  case %d:\n    return x %s %d;\n", j * 3, ops[j % 6], j);
+    printf("  default:\n    return -1;\n  }\n}\n\n");
+  }
+}
+
+static void gen_globals(void) {
+  int n = 50000 * scale;
+  for (int i = 0; i < n; i++) {
+    switch (i % 4) {
+    case 0:
+      printf("int g%d = %d;\n", i, i);
+      break;
+    case 1:
+      printf("static long g%d;\n", i);
+      break;
+    case 2:
+      printf("char *g%d = \"global %d\";\n", i, i);
+      break;
+    case 3:
+      printf("int *g%d = &g%d;\n", i, i - 3);
+      break;
+    }
+  }
+
+  printf("\nlong use_globals(void) {\n  long n = 0;\n");
+  for (int i = 0; i < n; i += 4)
+    printf("  n += g%d + g%d;\n", i, i + 1);
+  printf("  return n;\n}\n");
+}
+
+static struct {
+  char *name;
+  void (*fn)(void);
+} shapes[] = {
+  {"funcs", gen_funcs},
+  {"exprs", gen_exprs},
+  {"inits", gen_inits},
+  {"structs", gen_structs},
+  {"switches", gen_switches},
+  {"globals", gen_globals},
+};
+
+int main(int argc, char **argv) {
+  if (argc < 2 || argc > 3) {
+    fprintf(stderr, "usage: %s <shape> [scale]\n", argv[0]);
+    return 1;
+  }
+
+  if (argc == 3) {
+    scale = atoi(argv[2]);
+    if (scale < 1) {
+      fprintf(stderr, "invalid scale: %s\n", argv[2]);
+      return 1;
+    }
+  }
+
+  for (int i = 0; i < sizeof(shapes) / sizeof(*shapes); i++) {
+    if (!strcmp(argv[1], shapes[i].name)) {
+      shapes[i].fn();
+      return 0;
+    }
+  }
+
+  fprintf(stderr, "unknown shape: %s\n", argv[1]);
+  return 1;
+}
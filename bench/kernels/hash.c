@@ -0,0 +1,77 @@
+// Hashes strings with FNV-1a and inserts them into an open-addressing
+// hash table, then looks them up.
+
+#ifndef N
+#define N 8192
+#endif
+
+#define CAP (N * 2)
+
+int printf(char *fmt, ...);
+
+char keys[N][16];
+char *table[CAP];
+int values[CAP];
+
+static unsigned fnv_hash(char *s) {
+  unsigned h = 2166136261;
+  for (; *s; s++) {
+    h ^= (unsigned char)*s;
+    h *= 16777619;
+  }
+  return h;
+}
+
+static int equal(char *a, char *b) {
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+static void make_key(char *buf, int n) {
+  char *p = buf;
+  *p++ = 'k';
+  do {
+    *p++ = 'a' + n % 26;
+    n /= 26;
+  } while (n);
+  *p = '\0';
+}
+
+static int *find(char *key, int insert) {
+  unsigned i = fnv_hash(key) % CAP;
+  for (;;) {
+    if (!table[i]) {
+      if (!insert)
+        return 0;
+      table[i] = key;
+      return &values[i];
+    }
+    if (equal(table[i], key))
+      return &values[i];
+    i = (i + 1) % CAP;
+  }
+}
+
+int main() {
+  for (int i = 0; i < N; i++) {
+    make_key(keys[i], i * 31);
+    *find(keys[i], 1) = i;
+  }
+
+  long checksum = 0;
+  for (int i = 0; i < N; i++) {
+    char buf[16];
+    make_key(buf, i * 31);
+    int *v = find(buf, 0);
+    if (!v || *v != i) {
+      printf("lookup failed: %s\n", buf);
+      return 1;
+    }
+    checksum += fnv_hash(buf) % 1000 + *v;
+  }
+  printf("checksum: %ld\n", checksum);
+  return 0;
+}
@@ -0,0 +1,54 @@
+// Traverses a linked list whose nodes are scattered over an array,
+// repeatedly.
+
+#ifndef N
+#define N 10000
+#endif
+
+#ifndef ROUNDS
+#define ROUNDS 20
+#endif
+
+int printf(char *fmt, ...);
+
+typedef struct Node Node;
+struct Node {
+  Node *next;
+  int value;
+  int pad[5];
+};
+
+Node pool[N];
+int order[N];
+
+static unsigned seed = 7;
+
+static int next_rand(int n) {
+  seed = seed * 1664525 + 1013904223;
+  return (seed >> 4) % n;
+}
+
+int main() {
+  // Link the nodes in a shuffled order.
+  for (int i = 0; i < N; i++)
+    order[i] = i;
+  for (int i = N - 1; i > 0; i--) {
+    int j = next_rand(i + 1);
+    int t = order[i];
+    order[i] = order[j];
+    order[j] = t;
+  }
+
+  for (int i = 0; i < N; i++) {
+    Node *node = &pool[order[i]];
+    node->value = i % 1000;
+    node->next = (i + 1 < N) ? &pool[order[i + 1]] : 0;
+  }
+
+  long checksum = 0;
+  for (int r = 0; r < ROUNDS; r++)
+    for (Node *node = &pool[order[0]]; node; node = node->next)
+      checksum += node->value ^ r;
+  printf("checksum: %ld\n", checksum);
+  return 0;
+}
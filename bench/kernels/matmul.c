@@ -0,0 +1,36 @@
+// Multiplies two square integer matrices.
+
+#ifndef N
+#define N 64
+#endif
+
+int printf(char *fmt, ...);
+
+int a[N][N];
+int b[N][N];
+int c[N][N];
+
+int main() {
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < N; j++) {
+      a[i][j] = (i * 7 + j * 3) % 17 - 8;
+      b[i][j] = (i * 5 + j * 11) % 13 - 6;
+    }
+  }
+
+  for (int i = 0; i < N; i++) {
+    for (int j = 0; j < N; j++) {
+      int sum = 0;
+      for (int k = 0; k < N; k++)
+        sum += a[i][k] * b[k][j];
+      c[i][j] = sum;
+    }
+  }
+
+  long checksum = 0;
+  for (int i = 0; i < N; i++)
+    for (int j = 0; j < N; j++)
+      checksum += c[i][j] * (i + j + 1);
+  printf("checksum: %ld\n", checksum);
+  return 0;
+}
@@ -0,0 +1,79 @@
+// Sorts pseudo-random integers with quicksort, falling back to
+// insertion sort for short ranges.
+
+#ifndef N
+#define N 20000
+#endif
+
+int printf(char *fmt, ...);
+
+int data[N];
+
+static unsigned seed = 1;
+
+static int next_rand(void) {
+  seed = seed * 1103515245 + 12345;
+  return (seed >> 8) % 100000;
+}
+
+static void insertion_sort(int *p, int n) {
+  for (int i = 1; i < n; i++) {
+    int x = p[i];
+    int j = i - 1;
+    while (j >= 0 && p[j] > x) {
+      p[j + 1] = p[j];
+      j--;
+    }
+    p[j + 1] = x;
+  }
+}
+
+static void quicksort(int *p, int n) {
+  while (n > 16) {
+    int pivot = p[n / 2];
+    int i = 0;
+    int j = n - 1;
+    for (;;) {
+      while (p[i] < pivot)
+        i++;
+      while (p[j] > pivot)
+        j--;
+      if (i >= j)
+        break;
+      int t = p[i];
+      p[i] = p[j];
+      p[j] = t;
+      i++;
+      j--;
+    }
+
+    // Recurse into the smaller half to bound the stack depth.
+    if (j + 1 < n - j - 1) {
+      quicksort(p, j + 1);
+      p += j + 1;
+      n -= j + 1;
+    } else {
+      quicksort(p + j + 1, n - j - 1);
+      n = j + 1;
+    }
+  }
+  insertion_sort(p, n);
+}
+
+int main() {
+  for (int i = 0; i < N; i++)
+    data[i] = next_rand();
+
+  quicksort(data, N);
+
+  long checksum = 0;
+  for (int i = 0; i < N; i++) {
+    if (i > 0 && data[i - 1] > data[i]) {
+      printf("not sorted at %d\n", i);
+      return 1;
+    }
+    checksum += (long)data[i] * (i % 100);
+  }
+  printf("checksum: %ld\n", checksum);
+  return 0;
+}
@@ -0,0 +1,66 @@
+// Builds a text and scans it: counts lines and words, and searches
+// for a substring with a naive algorithm.
+
+#ifndef N
+#define N 200000
+#endif
+
+int printf(char *fmt, ...);
+
+char text[N + 1];
+
+static char *words[] = {
+  "alpha", "beta", "gamma", "delta", "needle", "epsilon", "zeta", "eta",
+};
+
+static int string_length(char *s) {
+  char *p = s;
+  while (*p)
+    p++;
+  return p - s;
+}
+
+static int is_space(char c) {
+  return c == ' ' || c == '\n' || c == '\t';
+}
+
+static int count_matches(char *s, char *pat) {
+  int n = 0;
+  for (; *s; s++) {
+    int i = 0;
+    while (pat[i] && s[i] == pat[i])
+      i++;
+    if (!pat[i])
+      n++;
+  }
+  return n;
+}
+
+int main() {
+  int len = 0;
+  for (int i = 0; len < N - 16; i++) {
+    char *w = words[(i * 5 + i / 7) % 8];
+    while (*w)
+      text[len++] = *w++;
+    text[len++] = (i % 9 == 8) ? '\n' : ' ';
+  }
+  text[len] = '\0';
+
+  int lines = 0;
+  int nwords = 0;
+  int in_word = 0;
+  for (char *p = text; *p; p++) {
+    if (*p == '\n')
+      lines++;
+    if (is_space(*p)) {
+      in_word = 0;
+    } else if (!in_word) {
+      in_word = 1;
+      nwords++;
+    }
+  }
+
+  int matches = count_matches(text, "needle");
+  printf("checksum: %d\n", string_length(text) + lines * 3 + nwords * 5 + matches * 7);
+  return 0;
+}
@@ -0,0 +1,521 @@
+#!/usr/bin/env python3
+#
+# Interprets the assembly chibicc generates for a LoongArch64 program
+# and counts the instructions it executes. It is meant for checking
+# the code generator where no LoongArch machine or qemu is available.
+#
+# Usage: bench/la64emu.py <file.s> [-v]
+#
+# Only the instructions and directives chibicc emits are supported.
+# There is no libc: printf, sprintf, vsprintf, strcmp, memcmp, strlen
+# and exit are implemented here, as are the functions and variables
+# of test/common, so that test/*.c can be run without linking. The
+# program's output goes to stdout and its exit code is ours. With -v,
+# the number of executed instructions is printed to stderr.
+import sys, re
+
+M64 = (1 << 64) - 1
+M32 = (1 << 32) - 1
+
+def sx(v, bits):
+    v &= (1 << bits) - 1
+    if v >> (bits - 1):
+        v -= 1 << bits
+    return v
+
+def s64(v): return sx(v, 64)
+def u64(v): return v & M64
+def sw(v): return u64(sx(v, 32))
+
+REGS = {'zero': 0, 'r0': 0, 'ra': 1, 'tp': 2, 'sp': 3, 'fp': 22, 's9': 22}
+for i in range(8): REGS['a%d' % i] = 4 + i
+for i in range(9): REGS['t%d' % i] = 12 + i
+for i in range(9): REGS['s%d' % i] = 23 + i
+for i in range(32): REGS['r%d' % i] = i
+
+class Fault(Exception): pass
+
+MEMSZ = 64 << 20
+DATA_BASE = 0x100000
+STACK_TOP = MEMSZ - 0x1000
+HEAP_BASE = 32 << 20
+
+class Machine:
+    def __init__(self, asm):
+        self.mem = bytearray(MEMSZ)
+        self.r = [0] * 32
+        self.out = []
+        self.icount = 0
+        self.symbols = {}
+        self.load(asm)
+
+    def reg(self, s):
+        s = s.strip()
+        if not s.startswith('$'):
+            raise Fault('bad reg ' + s)
+        n = s[1:]
+        if n not in REGS:
+            raise Fault('bad reg ' + s)
+        return REGS[n]
+
+    def imm(self, s, bits=None, signed=True):
+        v = int(s.strip(), 0)
+        if bits is not None:
+            lo = -(1 << (bits - 1)) if signed else 0
+            hi = (1 << (bits - 1)) - 1 if signed else (1 << bits) - 1
+            if not (lo <= v <= hi):
+                raise Fault('immediate out of range: %s' % s)
+        return v
+
+    def load(self, asm):
+        lines = asm.split('\n')
+        section = 'text'
+        data_ptr = DATA_BASE
+        text = []
+        pending_relocs = []
+        label_pc = {}
+        for raw in lines:
+            line = raw.split('#')[0].strip()
+            if not line:
+                continue
+            if line.endswith(':') and ' ' not in line:
+                name = line[:-1]
+                if section == 'text':
+                    label_pc[name] = len(text)
+                else:
+                    self.symbols[name] = data_ptr
+                continue
+            parts = line.split(None, 1)
+            op = parts[0]
+            args = [a.strip() for a in parts[1].split(',')] if len(parts) > 1 else []
+            if op.startswith('.'):
+                if op == '.text':
+                    section = 'text'
+                elif op in ('.data', '.bss'):
+                    section = 'data'
+                elif op == '.section':
+                    section = 'other'
+                elif op == '.align':
+                    a = 1 << int(args[0])
+                    data_ptr = (data_ptr + a - 1) // a * a
+                elif op == '.byte':
+                    self.mem[data_ptr] = int(args[0], 0) & 0xff
+                    data_ptr += 1
+                elif op == '.zero':
+                    data_ptr += int(args[0], 0)
+                elif op == '.quad':
+                    pending_relocs.append((data_ptr, args[0]))
+                    data_ptr += 8
+                elif op in ('.globl', '.local', '.loc', '.file', '.size', '.type', '.p2align'):
+                    pass
+                else:
+                    raise Fault('unknown directive ' + op)
+                continue
+            if section != 'text':
+                raise Fault('instruction outside text: ' + line)
+            text.append((op, args, raw))
+        for name, pc in label_pc.items():
+            self.symbols[name] = ('pc', pc)
+        self.label_pc = label_pc
+        self.text = text
+        self.data_end = data_ptr
+        for addr, expr in pending_relocs:
+            m = re.match(r'([^+\-]+)([+\-]\d+)?$', expr)
+            sym, add = m.group(1), int(m.group(2) or 0)
+            self.w(addr, 8, self.sym_addr(sym) + add)
+        self.code = [self.decode(op, args, raw) for op, args, raw in text]
+
+    def sym_addr(self, sym):
+        if sym in self.symbols:
+            v = self.symbols[sym]
+            if isinstance(v, tuple):
+                return 0x10000000 + v[1] * 4
+            return v
+        if sym in EXTERN_DATA:
+            return self.extern_data(sym)
+        # Functions outside the program get a fake address.
+        return 0x20000000 + (hash(sym) & 0xffff) * 4
+
+    def extern_data(self, sym):
+        if not hasattr(self, '_ext'):
+            self._ext = {}
+        if sym not in self._ext:
+            addr = self.data_end
+            self.data_end += 8
+            self._ext[sym] = addr
+            EXTERN_DATA[sym](self, addr)
+        return self._ext[sym]
+
+    def r8(self, a, n):
+        if a < 0x1000 or a + n > MEMSZ:
+            raise Fault('bad address %x' % a)
+        return int.from_bytes(self.mem[a:a + n], 'little')
+
+    def w(self, a, n, v):
+        if a < 0x1000 or a + n > MEMSZ:
+            raise Fault('bad address %x' % a)
+        self.mem[a:a + n] = (v & ((1 << (8 * n)) - 1)).to_bytes(n, 'little')
+
+    def cstr(self, a):
+        e = self.mem.index(0, a)
+        return bytes(self.mem[a:e])
+
+    def decode(self, op, args, raw):
+        R = self.r
+        reg = self.reg
+        imm = self.imm
+        def need(n):
+            if len(args) != n:
+                raise Fault('bad operand count: ' + raw)
+        if op in ('addi.d', 'addi.w'):
+            need(3); d, j, k = reg(args[0]), reg(args[1]), imm(args[2], 12)
+            if op == 'addi.d':
+                def f(): R[d] = u64(R[j] + k)
+            else:
+                def f(): R[d] = sw(R[j] + k)
+            return ('x', f, d)
+        if op in ('li.d', 'li.w'):
+            need(2); d, k = reg(args[0]), imm(args[1])
+            if op == 'li.w':
+                if not (-(1 << 31) <= k < (1 << 32)):
+                    raise Fault('li.w out of range ' + raw)
+                k = sw(k)
+            else:
+                if not (-(1 << 63) <= k < (1 << 64)):
+                    raise Fault('li.d out of range ' + raw)
+                k = u64(k)
+            def f(): R[d] = k
+            return ('x', f, d)
+        if op in ('ld.b', 'ld.h', 'ld.w', 'ld.d', 'ld.bu', 'ld.hu', 'ld.wu'):
+            need(3); d, j, k = reg(args[0]), reg(args[1]), imm(args[2], 12)
+            n = {'b': 1, 'h': 2, 'w': 4, 'd': 8}[op[3]]
+            signed = not op.endswith('u')
+            def f():
+                v = self.r8(u64(R[j] + k), n)
+                R[d] = u64(sx(v, 8 * n)) if signed else v
+            return ('x', f, d)
+        if op in ('ldx.b', 'ldx.h', 'ldx.w', 'ldx.d', 'ldx.bu', 'ldx.hu', 'ldx.wu'):
+            need(3); d, j, k = reg(args[0]), reg(args[1]), reg(args[2])
+            n = {'b': 1, 'h': 2, 'w': 4, 'd': 8}[op[4]]
+            signed = not op.endswith('u')
+            def f():
+                v = self.r8(u64(R[j] + R[k]), n)
+                R[d] = u64(sx(v, 8 * n)) if signed else v
+            return ('x', f, d)
+        if op in ('st.b', 'st.h', 'st.w', 'st.d'):
+            need(3); d, j, k = reg(args[0]), reg(args[1]), imm(args[2], 12)
+            n = {'b': 1, 'h': 2, 'w': 4, 'd': 8}[op[3]]
+            def f(): self.w(u64(R[j] + k), n, R[d])
+            return ('s', f)
+        if op in ('stx.b', 'stx.h', 'stx.w', 'stx.d'):
+            need(3); d, j, k = reg(args[0]), reg(args[1]), reg(args[2])
+            n = {'b': 1, 'h': 2, 'w': 4, 'd': 8}[op[4]]
+            def f(): self.w(u64(R[j] + R[k]), n, R[d])
+            return ('s', f)
+        if op == 'la.local':
+            need(2); d = reg(args[0]); sym = args[1]
+            def f(): R[d] = self.sym_addr(sym)
+            return ('x', f, d)
+        if op in ('add.d', 'sub.d', 'mul.d', 'add.w', 'sub.w', 'mul.w', 'and', 'or',
+                  'xor', 'nor', 'slt', 'sltu', 'sll.d', 'srl.d', 'sra.d', 'sll.w', 'srl.w',
+                  'sra.w', 'div.d', 'div.du', 'mod.d', 'mod.du', 'div.w', 'div.wu',
+                  'mod.w', 'mod.wu', 'mulh.d', 'maskeqz', 'masknez'):
+            need(3); d, j, k = reg(args[0]), reg(args[1]), reg(args[2])
+            fn = BINOPS[op]
+            def f(): R[d] = fn(R[j], R[k]) & M64
+            return ('x', f, d)
+        if op in ('slli.d', 'srli.d', 'srai.d', 'slli.w', 'srli.w', 'srai.w',
+                  'andi', 'ori', 'xori', 'slti', 'sltui'):
+            need(3); d, j = reg(args[0]), reg(args[1])
+            if op in ('andi', 'ori', 'xori'):
+                k = imm(args[2], 12, signed=False)
+            elif op in ('slti', 'sltui'):
+                k = imm(args[2], 12)
+            elif op.endswith('.d'):
+                k = imm(args[2], 6, signed=False)
+            else:
+                k = imm(args[2], 5, signed=False)
+            fn = IMMOPS[op]
+            def f(): R[d] = fn(R[j], k) & M64
+            return ('x', f, d)
+        if op in ('ext.w.b', 'ext.w.h'):
+            need(2); d, j = reg(args[0]), reg(args[1])
+            bits = 8 if op == 'ext.w.b' else 16
+            def f(): R[d] = sx(R[j], bits) & M64
+            return ('x', f, d)
+        if op in ('move',):
+            need(2); d, j = reg(args[0]), reg(args[1])
+            def f(): R[d] = R[j]
+            return ('x', f, d)
+        if op == 'beqz' or op == 'bnez':
+            need(2); j = reg(args[0]); lab = args[1]
+            return ('bz', op == 'beqz', j, lab)
+        if op in ('beq', 'bne', 'blt', 'bge', 'bltu', 'bgeu'):
+            need(3); j, d = reg(args[0]), reg(args[1]); lab = args[2]
+            return ('bc', op, j, d, lab)
+        if op == 'b':
+            need(1); return ('b', args[0])
+        if op == 'bl':
+            need(1); return ('bl', args[0])
+        if op == 'jr':
+            need(1); return ('jr', reg(args[0]))
+        if op == 'jirl':
+            need(3); return ('jirl', reg(args[0]), reg(args[1]), imm(args[2]))
+        raise Fault('unknown instruction: ' + raw)
+
+    def target(self, lab):
+        if lab not in self.label_pc:
+            raise Fault('unknown label ' + lab)
+        return self.label_pc[lab]
+
+    def run(self, entry='main', limit=200_000_000):
+        R = self.r
+        R[3] = STACK_TOP
+        R[22] = 0
+        R[1] = 0x30000000
+        pc = self.target(entry)
+        code = self.code
+        n = 0
+        while True:
+            ins = code[pc]
+            n += 1
+            k = ins[0]
+            if k == 'x':
+                ins[1]()
+                R[0] = 0
+                pc += 1
+            elif k == 's':
+                ins[1]()
+                pc += 1
+            elif k == 'bz':
+                z = R[ins[2]] == 0
+                pc = self.target(ins[3]) if z == ins[1] else pc + 1
+            elif k == 'bc':
+                a, b = R[ins[2]], R[ins[3]]
+                op = ins[1]
+                if op == 'beq': t = a == b
+                elif op == 'bne': t = a != b
+                elif op == 'blt': t = s64(a) < s64(b)
+                elif op == 'bge': t = s64(a) >= s64(b)
+                elif op == 'bltu': t = a < b
+                else: t = a >= b
+                pc = self.target(ins[4]) if t else pc + 1
+            elif k == 'b':
+                pc = self.target(ins[1])
+            elif k == 'bl':
+                name = ins[1]
+                if name in self.label_pc:
+                    R[1] = 0x10000000 + (pc + 1) * 4
+                    pc = self.label_pc[name]
+                else:
+                    if name not in BUILTINS:
+                        raise Fault('undefined function ' + name)
+                    ret = BUILTINS[name](self)
+                    if ret is not None:
+                        R[4] = u64(ret)
+                    # Clobber temporaries like a real call would.
+                    for t in list(range(5, 12)) + list(range(12, 21)):
+                        R[t] = 0xdeadbeefdeadbeef
+                    pc += 1
+            elif k == 'jr' or k == 'jirl':
+                tgt = R[ins[1]] if k == 'jr' else u64(R[ins[2]] + ins[3])
+                if tgt == 0x30000000:
+                    self.icount = n
+                    return s64(R[4])
+                if k == 'jirl' and ins[1] != 0:
+                    R[ins[1]] = 0x10000000 + (pc + 1) * 4
+                pc = (tgt - 0x10000000) // 4
+                if not (0 <= pc < len(code)):
+                    raise Fault('bad jump target %x' % tgt)
+            if n > limit:
+                raise Fault('instruction limit')
+
+class Exit(Exception):
+    def __init__(self, code): self.code = code
+
+def fmt_printf(m, fmt, args):
+    out = b''
+    i = 0
+    ai = 0
+    while i < len(fmt):
+        c = fmt[i:i+1]
+        if c != b'%':
+            out += c; i += 1; continue
+        j = i + 1
+        spec = b''
+        while fmt[j:j+1] in (b'l', b'0', b'1', b'2', b'3', b'4', b'5', b'6', b'7', b'8', b'9', b'-', b'.'):
+            spec += fmt[j:j+1]; j += 1
+        conv = fmt[j:j+1]
+        i = j + 1
+        if conv == b'%':
+            out += b'%'; continue
+        v = args(ai); ai += 1
+        width = spec.replace(b'l', b'').decode()
+        if conv == b'd':
+            val = s64(v) if b'l' in spec else sx(v, 32)
+            out += (('%' + width + 'd') % val).encode()
+        elif conv == b'u':
+            val = v if b'l' in spec else v & M32
+            out += (('%' + width + 'd') % val).encode()
+        elif conv == b'x':
+            val = v if b'l' in spec else v & M32
+            out += (('%' + width + 'x') % val).encode()
+        elif conv == b'c':
+            out += bytes([v & 0xff])
+        elif conv == b's':
+            out += m.cstr(v)
+        else:
+            raise Fault('printf conversion %r' % conv)
+    return out
+
+def regargs(m, first):
+    def get(i):
+        idx = first + i
+        if idx < 8:
+            return m.r[4 + idx]
+        raise Fault('too many printf args')
+    return get
+
+def b_printf(m):
+    s = fmt_printf(m, m.cstr(m.r[4]), regargs(m, 1))
+    m.out.append(s)
+    return len(s)
+
+def b_sprintf(m):
+    s = fmt_printf(m, m.cstr(m.r[5]), regargs(m, 2))
+    m.mem[m.r[4]:m.r[4] + len(s) + 1] = s + b'\0'
+    return len(s)
+
+def b_vsprintf(m):
+    ap = m.r[6]
+    s = fmt_printf(m, m.cstr(m.r[5]), lambda i: m.r8(ap + 8 * i, 8))
+    m.mem[m.r[4]:m.r[4] + len(s) + 1] = s + b'\0'
+    return len(s)
+
+def b_strcmp(m):
+    a, b = m.cstr(m.r[4]), m.cstr(m.r[5])
+    return (a > b) - (a < b)
+
+def b_memcmp(m):
+    n = m.r[6]
+    a = bytes(m.mem[m.r[4]:m.r[4] + n]); b = bytes(m.mem[m.r[5]:m.r[5] + n])
+    return (a > b) - (a < b)
+
+def b_strlen(m):
+    return len(m.cstr(m.r[4]))
+
+def b_exit(m):
+    raise Exit(sx(m.r[4], 32))
+
+def b_assert(m):
+    exp, act = sx(m.r[4], 32), sx(m.r[5], 32)
+    code = m.cstr(m.r[6]).decode('latin1')
+    if exp == act:
+        m.out.append(('%s => %d\n' % (code, act)).encode('latin1'))
+    else:
+        m.out.append(('%s => %d expected but got %d\n' % (code, exp, act)).encode('latin1'))
+        raise Exit(1)
+
+def b_add_all(m):
+    n = sx(m.r[4], 32)
+    s = 0
+    for i in range(n):
+        s += sx(m.r[5 + i], 32)
+    return sw(s)
+
+# Functions of libc and test/common
+BUILTINS = {
+    'printf': b_printf, 'sprintf': b_sprintf, 'vsprintf': b_vsprintf,
+    'strcmp': b_strcmp, 'memcmp': b_memcmp, 'strlen': b_strlen, 'exit': b_exit,
+    'assert': b_assert, 'add_all': b_add_all,
+    'ext_fn1': lambda m: sw(m.r[4]), 'ext_fn2': lambda m: sw(m.r[4]),
+    'false_fn': lambda m: 512, 'true_fn': lambda m: 513,
+    'char_fn': lambda m: (2 << 8) + 3, 'short_fn': lambda m: (2 << 16) + 5,
+    'uchar_fn': lambda m: (2 << 10) - 1 - 4, 'ushort_fn': lambda m: (2 << 20) - 1 - 7,
+    'schar_fn': lambda m: (2 << 10) - 1 - 4, 'sshort_fn': lambda m: (2 << 20) - 1 - 7,
+}
+
+def _ext1(m, a): m.w(a, 4, 5)
+def _ext3(m, a): m.w(a, 4, 7)
+def _ext2(m, a): m.w(a, 8, m.extern_data('ext1'))
+# Variables of test/common
+EXTERN_DATA = {'ext1': _ext1, 'ext2': _ext2, 'ext3': _ext3}
+
+BINOPS = {
+    'add.d': lambda a, b: a + b,
+    'sub.d': lambda a, b: a - b,
+    'mul.d': lambda a, b: a * b,
+    'add.w': lambda a, b: sw(a + b),
+    'sub.w': lambda a, b: sw(a - b),
+    'mul.w': lambda a, b: sw(sx(a, 32) * sx(b, 32)),
+    'and': lambda a, b: a & b,
+    'or': lambda a, b: a | b,
+    'xor': lambda a, b: a ^ b,
+    'nor': lambda a, b: ~(a | b),
+    'slt': lambda a, b: int(s64(a) < s64(b)),
+    'sltu': lambda a, b: int(a < b),
+    'sll.d': lambda a, b: a << (b & 63),
+    'srl.d': lambda a, b: a >> (b & 63),
+    'sra.d': lambda a, b: s64(a) >> (b & 63),
+    'sll.w': lambda a, b: sw(a << (b & 31)),
+    'srl.w': lambda a, b: sw((a & M32) >> (b & 31)),
+    'sra.w': lambda a, b: sw(sx(a, 32) >> (b & 31)),
+    'div.d': lambda a, b: tdiv(s64(a), s64(b)),
+    'div.du': lambda a, b: a // b if b else 0,
+    'mod.d': lambda a, b: tmod(s64(a), s64(b)),
+    'mod.du': lambda a, b: a % b if b else 0,
+    'div.w': lambda a, b: sw(tdiv(sx(a, 32), sx(b, 32))),
+    'div.wu': lambda a, b: sw((a & M32) // (b & M32)) if b & M32 else 0,
+    'mod.w': lambda a, b: sw(tmod(sx(a, 32), sx(b, 32))),
+    'mod.wu': lambda a, b: sw((a & M32) % (b & M32)) if b & M32 else 0,
+    'mulh.d': lambda a, b: (s64(a) * s64(b)) >> 64,
+    'maskeqz': lambda a, b: a if b else 0,
+    'masknez': lambda a, b: 0 if b else a,
+}
+
+def tdiv(a, b):
+    if b == 0: return 0
+    q = abs(a) // abs(b)
+    return q if (a < 0) == (b < 0) else -q
+
+def tmod(a, b):
+    if b == 0: return a
+    return a - tdiv(a, b) * b
+
+IMMOPS = {
+    'slli.d': lambda a, k: a << k,
+    'srli.d': lambda a, k: a >> k,
+    'srai.d': lambda a, k: s64(a) >> k,
+    'slli.w': lambda a, k: sw(a << k),
+    'srli.w': lambda a, k: sw((a & M32) >> k),
+    'srai.w': lambda a, k: sw(sx(a, 32) >> k),
+    'andi': lambda a, k: a & k,
+    'ori': lambda a, k: a | k,
+    'xori': lambda a, k: a ^ k,
+    'slti': lambda a, k: int(s64(a) < k),
+    'sltui': lambda a, k: int(a < u64(k)),
+}
+
+def main():
+    path = sys.argv[1]
+    asm = open(path).read()
+    try:
+        m = Machine(asm)
+    except Fault as e:
+        print('LOAD FAULT: %s' % e)
+        sys.exit(3)
+    try:
+        code = m.run() & 0xff
+    except Exit as e:
+        code = e.code & 0xff
+    except Fault as e:
+        sys.stdout.buffer.write(b''.join(m.out))
+        print('RUN FAULT: %s' % e)
+        sys.exit(4)
+    sys.stdout.buffer.write(b''.join(m.out))
+    if '-v' in sys.argv:
+        print('icount=%d' % m.icount, file=sys.stderr)
+    sys.exit(code)
+
+if __name__ == '__main__':
+    main()
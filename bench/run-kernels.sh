@@ -0,0 +1,118 @@
+#!/bin/bash
+#
+# Measures the code generated by chibicc by running the compute kernels
+# in bench/kernels under qemu-user and counting the instructions they
+# execute. Each kernel is also built with gcc -O0 and -O2 for
+# comparison, and all builds must print the same checksum.
+#
+# Usage: bench/run-kernels.sh [--update] [kernel...]
+#
+# Instructions are counted by a QEMU TCG plugin that prints
+# "insns: <count>" at exit, such as libinsn.so from QEMU's
+# tests/plugin directory. The following variables select the tools:
+#
+#   CROSS_CC     LoongArch C compiler (default: loongarch64-linux-gnu-gcc)
+#   QEMU         user-mode emulator (default: qemu-loongarch64)
+#   QEMU_PLUGIN  path to the instruction counting plugin (required)
+#
+# KERNEL_FLAGS is passed to all three builds of each kernel, e.g.
+# KERNEL_FLAGS=-DN=1000 to change the problem size.
+#
+# With --update, the counts of chibicc's code are recorded in
+# bench/kernels/baseline along with KERNEL_FLAGS. Later runs show the
+# change from a baseline recorded with the same flags, so that a
+# codegen change can be judged by its effect on the counts.
+
+chibicc=./chibicc
+cross_cc=${CROSS_CC:-loongarch64-linux-gnu-gcc}
+qemu=${QEMU:-qemu-loongarch64}
+plugin=$QEMU_PLUGIN
+flags=`echo $KERNEL_FLAGS`
+baseline=bench/kernels/baseline
+
+update=0
+if [ "$1" = --update ]; then
+    update=1
+    shift
+fi
+
+kernels="$@"
+[ -z "$kernels" ] && kernels=`cd bench/kernels; ls *.c | sed 's/\.c$//'`
+
+for tool in $cross_cc $qemu; do
+    if ! command -v $tool > /dev/null; then
+        echo "$tool not found"
+        exit 1
+    fi
+done
+
+if [ ! -f "$plugin" ]; then
+    echo "set QEMU_PLUGIN to the path of an instruction counting plugin"
+    exit 1
+fi
+
+tmp=`mktemp -d /tmp/chibicc-kernels-XXXXXX`
+trap 'rm -rf $tmp' INT TERM HUP EXIT
+
+# Runs a program under QEMU. Prints its output to $tmp/out and the
+# number of executed instructions to stdout.
+count_insns() {
+    if ! $qemu -plugin $plugin -d plugin -D $tmp/log $1 > $tmp/out; then
+        echo "$1 failed" >&2
+        exit 1
+    fi
+    grep -o 'insns: [0-9]*' $tmp/log | tail -1 | cut -d' ' -f2
+}
+
+# Prints a / b with two decimal places.
+ratio() {
+    awk -v a=$1 -v b=$2 'BEGIN { printf "%.2f", b ? a / b : 0 }'
+}
+
+printf "%-10s %14s %14s %14s %8s %8s %9s\n" kernel chibicc "gcc -O0" \
+       "gcc -O2" "vs -O0" "vs -O2" "vs base"
+
+for k in $kernels; do
+    src=bench/kernels/$k.c
+
+    $chibicc $flags -o $tmp/$k.s $src || exit 1
+    $cross_cc -static -o $tmp/$k.chibicc $tmp/$k.s || exit 1
+    $cross_cc -static -w -O0 $flags -o $tmp/$k.O0 $src || exit 1
+    $cross_cc -static -w -O2 $flags -o $tmp/$k.O2 $src || exit 1
+
+    o2=`count_insns $tmp/$k.O2` || exit 1
+    cp $tmp/out $tmp/expected
+    o0=`count_insns $tmp/$k.O0` || exit 1
+    n=`count_insns $tmp/$k.chibicc` || exit 1
+    if ! cmp -s $tmp/out $tmp/expected; then
+        echo "$k: output differs from gcc -O2's"
+        diff $tmp/expected $tmp/out
+        exit 1
+    fi
+
+    base=-
+    if [ $update = 1 ]; then
+        echo "$k $n $flags" >> $tmp/baseline
+    elif [ -f $baseline ]; then
+        # Lines are "<kernel> <count> <flags>...".
+        b=`awk -v k=$k -v f="$flags" '$1 == k {
+            n = $2; $1 = $2 = ""; sub(/^ +/, "")
+            if ($0 == f) print n
+        }' $baseline`
+        [ -n "$b" ] && base=`awk -v a=$n -v b=$b \
+            'BEGIN { printf "%+.1f%%", (a - b) * 100 / b }'`
+    fi
+
+    printf "%-10s %14d %14d %14d %8s %8s %9s\n" $k $n $o0 $o2 \
+           `ratio $n $o0` `ratio $n $o2` $base
+done
+
+# Keep the counts of the kernels that were not run.
+if [ $update = 1 ]; then
+    [ -f $baseline ] && for k in $kernels; do
+        sed -i "/^$k /d" $baseline
+    done
+    cat $tmp/baseline >> $baseline
+    sort -o $baseline $baseline
+    echo "baseline written to $baseline"
+fi
@@ -0,0 +1,207 @@
+// Micro-benchmark for the scanners in scan.c.
+//
+// For each generated input, this program walks the buffer with the
+// byte-at-a-time loops the tokenizer used to have and with the
+// scanners in scan.c, checks that both stop at the same places and
+// reports the throughput of each.
+//
+// Usage: make bench/scan && bench/scan [megabytes]
+
+#include "../chibicc.h"
+#include <time.h>
+
+// Input generators
+
+static char *buf;
+static int buflen;
+static int bufcap;
+
+static void emit(char *s) {
+  for (; *s; s++)
+    buf[buflen++] = *s;
+}
+
+static void emit_ident(void) {
+  static char first[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+  static char rest[] = "abcdefghijklmnopqrstuvwxyz_0123456789";
+  int len = 1 + rand() % 16;
+  buf[buflen++] = first[rand() % (sizeof(first) - 1)];
+  for (int i = 1; i < len; i++)
+    buf[buflen++] = rest[rand() % (sizeof(rest) - 1)];
+}
+
+static void emit_blanks(int max) {
+  int len = 1 + rand() % max;
+  for (int i = 0; i < len; i++)
+    buf[buflen++] = (rand() % 8) ? ' ' : '\t';
+}
+
+// Code-like text: indented lines of identifiers and punctuators.
+static void gen_code(void) {
+  while (buflen < bufcap - 256) {
+    emit_blanks(12);
+    int n = 1 + rand() % 6;
+    for (int i = 0; i < n; i++) {
+      emit_ident();
+      emit(i % 2 ? " = " : ", ");
+    }
+    emit(";\n");
+  }
+}
+
+// Long block comments spanning many lines.
+static void gen_comment(void) {
+  while (buflen < bufcap - 256) {
+    emit("/*");
+    int n = 1 + rand() % 40;
+    for (int i = 0; i < n && buflen < bufcap - 256; i++) {
+      emit(" * ");
+      while (rand() % 12)
+        emit("lorem ipsum ");
+      emit("\n");
+    }
+    emit(" */\n");
+  }
+}
+
+// Line comments after some code.
+static void gen_line_comment(void) {
+  while (buflen < bufcap - 256) {
+    emit_blanks(8);
+    emit_ident();
+    emit("; // ");
+    while (rand() % 10)
+      emit("dolor sit amet ");
+    emit("\n");
+  }
+}
+
+// Scalar reference loops, equivalent to the old tokenizer
+
+static char *skip_blanks_scalar(char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\v' || *p == '\f' || *p == '\r')
+    p++;
+  return p;
+}
+
+static char *skip_ident_scalar(char *p) {
+  while (('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z') ||
+         ('0' <= *p && *p <= '9') || *p == '_')
+    p++;
+  return p;
+}
+
+static char *find_comment_stop_scalar(char *p) {
+  while (*p && *p != '*' && *p != '\n')
+    p++;
+  return p;
+}
+
+static char *find_newline_scalar(char *p) {
+  while (*p && *p != '\n')
+    p++;
+  return p;
+}
+
+typedef struct {
+  char *(*skip_blanks)(char *);
+  char *(*skip_ident)(char *);
+  char *(*find_comment_stop)(char *);
+  char *(*find_newline)(char *);
+} Scanners;
+
+static Scanners scalar = {
+  skip_blanks_scalar, skip_ident_scalar,
+  find_comment_stop_scalar, find_newline_scalar,
+};
+
+static Scanners vector = {
+  skip_blanks, skip_ident, find_comment_stop, find_newline,
+};
+
+// A stripped-down tokenizer loop that only classifies bytes.
+// Returns a checksum of the stop positions.
+static uint64_t walk(Scanners *s, char *p) {
+  char *start = p;
+  uint64_t sum = 0;
+
+  while (*p) {
+    if (p[0] == '/' && p[1] == '/') {
+      p = s->find_newline(p + 2);
+    } else if (p[0] == '/' && p[1] == '*') {
+      char *q = p + 2;
+      for (;;) {
+        q = s->find_comment_stop(q);
+        if (*q == '\0' || (q[0] == '*' && q[1] == '/'))
+          break;
+        q++;
+      }
+      p = q + 2;
+    } else if (*p == '\n') {
+      p++;
+    } else if (isspace(*p)) {
+      p = s->skip_blanks(p);
+    } else if (isalpha(*p) || *p == '_') {
+      p = s->skip_ident(p + 1);
+    } else {
+      p++;
+    }
+    sum = sum * 31 + (p - start);
+  }
+  return sum;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(Scanners *s, uint64_t *sum) {
+  double best = 1e9;
+  for (int i = 0; i < 5; i++) {
+    double t = now();
+    *sum = walk(s, buf);
+    t = now() - t;
+    if (t < best)
+      best = t;
+  }
+  return best;
+}
+
+int main(int argc, char **argv) {
+  int mb = (argc > 1) ? atoi(argv[1]) : 64;
+  bufcap = mb * 1024 * 1024;
+  buf = aligned_alloc(16, bufcap + 16);
+
+  struct {
+    char *name;
+    void (*gen)(void);
+  } inputs[] = {
+    {"code", gen_code},
+    {"block comments", gen_comment},
+    {"line comments", gen_line_comment},
+  };
+
+  printf("%-16s %10s %10s %8s\n", "input", "scalar", "vector", "speedup");
+
+  for (int i = 0; i < sizeof(inputs) / sizeof(*inputs); i++) {
+    srand(1);
+    buflen = 0;
+    inputs[i].gen();
+    memset(buf + buflen, 0, 16);
+
+    uint64_t sum1, sum2;
+    double t1 = run(&scalar, &sum1);
+    double t2 = run(&vector, &sum2);
+    if (sum1 != sum2) {
+      fprintf(stderr, "%s: scanners disagree\n", inputs[i].name);
+      return 1;
+    }
+
+    double mbytes = buflen / 1024.0 / 1024.0;
+    printf("%-16s %7.0fMB/s %7.0fMB/s %7.2fx\n", inputs[i].name,
+           mbytes / t1, mbytes / t2, t1 / t2);
+  }
+  return 0;
+}
@@ -0,0 +1,303 @@
+// This file implements a compilation cache.
+//
+// With `-fcache-dir=<dir>`, the assembly generated for a translation
+// unit is saved in the cache directory under a hash of everything it
+// depends on: the preprocessed tokens with their file names and line
+// numbers, the precompiled header if any, and the compiler binary. If
+// the same translation unit is compiled again, the assembly is copied
+// from the cache and the parser and the code generator are skipped.
+//
+// Entries are written to temporary files and renamed into place, so
+// concurrent compilers never see a partially written entry. Entries
+// are spread over 16 subdirectories by the first digit of their key.
+// When a subdirectory grows beyond its share of `-fcache-size`, its
+// least recently used entries are removed. A hit updates an entry's
+// modification time, which serves as the time of last use.
+
+#include "chibicc.h"
+#include <dirent.h>
+#include <time.h>
+
+// Bump this if the format of cache entries or keys changes.
+#define CACHE_VERSION "chibicc-cache-1"
+
+// Temporary file being written, removed if the compiler exits early
+static char *tmp_path;
+
+//
+// 128-bit MurmurHash3, computed incrementally
+//
+
+typedef struct {
+  uint64_t h1;
+  uint64_t h2;
+  unsigned char buf[16];
+  int buflen;
+  uint64_t len;
+} Hash;
+
+#define C1 0x87c37b91114253d5
+#define C2 0x4cf5ad432745937f
+
+static uint64_t rotl(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccd;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53;
+  k ^= k >> 33;
+  return k;
+}
+
+static void hash_block(Hash *h, unsigned char *p) {
+  uint64_t k1, k2;
+  memcpy(&k1, p, 8);
+  memcpy(&k2, p + 8, 8);
+
+  k1 *= C1;
+  k1 = rotl(k1, 31);
+  k1 *= C2;
+  h->h1 ^= k1;
+  h->h1 = rotl(h->h1, 27) + h->h2;
+  h->h1 = h->h1 * 5 + 0x52dce729;
+
+  k2 *= C2;
+  k2 = rotl(k2, 33);
+  k2 *= C1;
+  h->h2 ^= k2;
+  h->h2 = rotl(h->h2, 31) + h->h1;
+  h->h2 = h->h2 * 5 + 0x38495ab5;
+}
+
+static void hash_update(Hash *h, void *data, size_t len) {
+  unsigned char *p = data;
+  h->len += len;
+
+  if (h->buflen) {
+    int n = MIN(len, 16 - h->buflen);
+    memcpy(h->buf + h->buflen, p, n);
+    h->buflen += n;
+    p += n;
+    len -= n;
+    if (h->buflen < 16)
+      return;
+    hash_block(h, h->buf);
+    h->buflen = 0;
+  }
+
+  for (; len >= 16; p += 16, len -= 16)
+    hash_block(h, p);
+
+  memcpy(h->buf, p, len);
+  h->buflen = len;
+}
+
+static void hash_int(Hash *h, int64_t val) {
+  hash_update(h, &val, sizeof(val));
+}
+
+static void hash_str(Hash *h, char *s) {
+  hash_update(h, s, strlen(s) + 1);
+}
+
+// Returns the hash value as 32 hexadecimal digits.
+static char *hash_final(Hash *h) {
+  uint64_t k1 = 0, k2 = 0;
+  for (int i = h->buflen - 1; i >= 8; i--)
+    k2 = (k2 << 8) | h->buf[i];
+  for (int i = MIN(h->buflen, 8) - 1; i >= 0; i--)
+    k1 = (k1 << 8) | h->buf[i];
+
+  if (h->buflen > 8) {
+    k2 *= C2;
+    k2 = rotl(k2, 33);
+    k2 *= C1;
+    h->h2 ^= k2;
+  }
+  if (h->buflen > 0) {
+    k1 *= C1;
+    k1 = rotl(k1, 31);
+    k1 *= C2;
+    h->h1 ^= k1;
+  }
+
+  h->h1 ^= h->len;
+  h->h2 ^= h->len;
+  h->h1 += h->h2;
+  h->h2 += h->h1;
+  h->h1 = fmix(h->h1);
+  h->h2 = fmix(h->h2);
+  h->h1 += h->h2;
+  h->h2 += h->h1;
+  return format("%016lx%016lx", h->h1, h->h2);
+}
+
+static void hash_file(Hash *h, char *path) {
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  char buf[65536];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+    hash_update(h, buf, n);
+  fclose(fp);
+}
+
+//
+// Cache
+//
+
+// Returns the key of the assembly for a preprocessed token array.
+char *cache_hash(Token *tok) {
+  Hash h = {};
+  hash_str(&h, CACHE_VERSION);
+
+  // A rebuilt compiler may generate different code.
+  struct stat st;
+  if (!stat("/proc/self/exe", &st)) {
+    hash_int(&h, st.st_size);
+    hash_int(&h, st.st_mtim.tv_sec);
+    hash_int(&h, st.st_mtim.tv_nsec);
+  }
+
+  // The declarations from a precompiled header are not in the
+  // token array.
+  hash_str(&h, opt_include_pch ? opt_include_pch : "");
+  if (opt_include_pch)
+    hash_file(&h, opt_include_pch);
+
+  // The assembly refers to files by name and to lines by number.
+  File **files = get_input_files();
+  for (int i = 0; files[i]; i++)
+    hash_str(&h, files[i]->name);
+
+  for (; tok->kind != TK_EOF; tok++) {
+    int file_no = tok->file_no ? get_file(tok->file_no)->display_no : 0;
+    int hdr[] = {tok->kind, file_no, tok->line_no, tok->len};
+    hash_update(&h, hdr, sizeof(hdr));
+    hash_update(&h, tok->loc, tok->len);
+  }
+  return hash_final(&h);
+}
+
+static char *subdir_path(char *key) {
+  return format("%s/%c", opt_cache_dir, key[0]);
+}
+
+static char *entry_path(char *key) {
+  return format("%s/%c/%s.s", opt_cache_dir, key[0], key + 1);
+}
+
+// Returns the cached assembly for a given key, or NULL if not found.
+FILE *cache_lookup(char *key) {
+  char *path = entry_path(key);
+  FILE *fp = fopen(path, "r");
+  if (!fp)
+    return NULL;
+
+  // Mark the entry as recently used.
+  utimensat(AT_FDCWD, path, NULL, 0);
+  return fp;
+}
+
+static void remove_tmp(void) {
+  if (tmp_path)
+    unlink(tmp_path);
+}
+
+static void make_dir(char *path) {
+  if (mkdir(path, 0777) && errno != EEXIST)
+    error("cannot create %s: %s", path, strerror(errno));
+}
+
+// Creates a temporary file for a new cache entry. cache_store()
+// moves it into place.
+FILE *cache_create(char *key) {
+  static bool registered;
+  if (!registered) {
+    atexit(remove_tmp);
+    registered = true;
+  }
+
+  make_dir(opt_cache_dir);
+  make_dir(subdir_path(key));
+
+  tmp_path = format("%s/tmp.%d.XXXXXX", subdir_path(key), getpid());
+  int fd = mkstemp(tmp_path);
+  if (fd == -1)
+    error("cannot create %s: %s", tmp_path, strerror(errno));
+  return fdopen(fd, "w+");
+}
+
+typedef struct {
+  char *path;
+  off_t size;
+  time_t mtime;
+} Entry;
+
+static int cmp_mtime(const void *a, const void *b) {
+  time_t x = ((Entry *)a)->mtime;
+  time_t y = ((Entry *)b)->mtime;
+  return (x > y) - (x < y);
+}
+
+// Removes the least recently used entries of a subdirectory if it is
+// larger than its share of the cache size. We remove a bit more than
+// necessary so that we don't have to do this on every store.
+static void evict(char *dir) {
+  DIR *dp = opendir(dir);
+  if (!dp)
+    return;
+
+  Entry *entries = NULL;
+  int len = 0;
+  int cap = 0;
+  int64_t total = 0;
+  time_t now = time(NULL);
+
+  for (struct dirent *de; (de = readdir(dp));) {
+    if (de->d_name[0] == '.')
+      continue;
+
+    char *path = format("%s/%s", dir, de->d_name);
+    struct stat st;
+    if (stat(path, &st) || !S_ISREG(st.st_mode))
+      continue;
+
+    // Remove temporary files left by compilers that were killed.
+    if (!strncmp(de->d_name, "tmp.", 4)) {
+      if (now - st.st_mtime > 3600)
+        unlink(path);
+      continue;
+    }
+
+    if (len == cap) {
+      cap = cap ? cap * 2 : 64;
+      entries = realloc(entries, sizeof(Entry) * cap);
+    }
+    entries[len++] = (Entry){path, st.st_size, st.st_mtime};
+    total += st.st_size;
+  }
+  closedir(dp);
+
+  int64_t limit = opt_cache_size / 16;
+  if (total > limit) {
+    qsort(entries, len, sizeof(Entry), cmp_mtime);
+    for (int i = 0; i < len && total > limit * 8 / 10; i++)
+      if (!unlink(entries[i].path))
+        total -= entries[i].size;
+  }
+  free(entries);
+}
+
+// Publishes the file returned by cache_create() as an entry.
+void cache_store(char *key) {
+  if (rename(tmp_path, entry_path(key)))
+    error("cannot rename %s: %s", tmp_path, strerror(errno));
+  tmp_path = NULL;
+  evict(subdir_path(key));
+}
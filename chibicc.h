@@ -2,13 +2,20 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #define MAX(x, y) ((x) < (y) ? (y) : (x))
 #define MIN(x, y) ((x) < (y) ? (x) : (y))
@@ -17,13 +24,92 @@ typedef struct Type Type;
 typedef struct Node Node;
 typedef struct Member Member;
 typedef struct Relocation Relocation;
+typedef struct PchWriter PchWriter;
+typedef struct PchReader PchReader;
+
+//
+// arena.c
+//
+
+typedef struct ArenaChunk ArenaChunk;
+
+typedef struct {
+  ArenaChunk *chunks;
+  char *ptr;
+  char *end;
+} Arena;
+
+// Kinds of objects counted by -fmem-report
+typedef enum {
+  MEM_TOKEN,
+  MEM_NODE,
+  MEM_TYPE,
+  MEM_OBJ,
+  MEM_SCOPE,
+  MEM_INIT,
+  MEM_STRING,
+  MEM_FILE,
+  NUM_MEM_KINDS,
+} MemKind;
+
+extern Arena *perm_arena;
+extern bool opt_mem_report;
+
+Arena *new_arena(void);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strndup(Arena *arena, char *p, size_t len);
+void arena_release(Arena *arena);
+void count_mem(MemKind kind, int64_t count, int64_t size);
+void print_mem_report(char *input);
+
+//
+// hashmap.c
+//
+
+typedef struct {
+  char *key;
+  int keylen;
+  void *val;
+} HashEntry;
+
+typedef struct {
+  HashEntry *buckets;
+  int capacity;
+  int used;
+} HashMap;
+
+void *hashmap_get(HashMap *map, char *key);
+void *hashmap_get2(HashMap *map, char *key, int keylen);
+void hashmap_put(HashMap *map, char *key, void *val);
+void hashmap_put2(HashMap *map, char *key, int keylen, void *val);
+void hashmap_delete(HashMap *map, char *key);
+void hashmap_delete2(HashMap *map, char *key, int keylen);
+HashEntry *hashmap_next(HashMap *map, HashEntry *ent);
+void hashmap_free(HashMap *map);
+uint64_t fnv_hash(char *s, int len);
 
 //
 // strings.c
 //
 
+typedef struct {
+  char **data;
+  int capacity;
+  int len;
+} StringArray;
+
+void strarray_push(StringArray *arr, char *s);
 char *format(char *fmt, ...);
 
+//
+// scan.c
+//
+
+char *skip_blanks(char *p);
+char *skip_ident(char *p);
+char *find_comment_stop(char *p);
+char *find_newline(char *p);
+
 //
 // tokenize.c
 //
@@ -38,19 +124,44 @@ typedef enum {
   TK_EOF,     // End-of-file markers
 } TokenKind;
 
-// Token type
-typedef struct Token Token;
-struct Token {
-  TokenKind kind; // Token kind
-  Token *next;    // Next token
+// Value of a numeric or string literal. Literals are rare compared
+// to other tokens, so they are kept out of Token in a side table.
+typedef struct {
   int64_t val;    // If kind is TK_NUM, its value
   double fval;    // If kind is TK_NUM, its value
-  char *loc;      // Token location
-  int len;        // Token length
   Type *ty;       // Used if TK_NUM or TK_STR
   char *str;      // String literal contents including terminating '\0'
+} Literal;
+
+typedef struct {
+  char *name;
+  int file_no;    // Unique number of the file in this process
+  int display_no; // Number in .file directives, or 0 if unused
+  char *contents;
+  int size;
+
+  // Offsets of the beginning of each line
+  int *lines;
+  int nlines;
+  int lines_cap;
+} File;
 
-  int line_no;    // Line number
+// Token type
+//
+// A source file is tokenized into a contiguous array of tokens that
+// ends with TK_EOF, so the next token of `tok` is `tok + 1`.
+typedef struct Token Token;
+struct Token {
+  TokenKind kind : 8;    // Token kind
+  bool at_bol : 1;       // True if this token is at beginning of line
+  bool has_space : 1;    // True if this token follows a space character
+  bool no_expand : 1;    // True if this token must not be macro-expanded
+  unsigned file_no : 21; // Source file number, or 0 if built-in
+  int len;               // Token length
+  char *name;            // Interned spelling if TK_IDENT, TK_KEYWORD or TK_PUNCT
+  char *loc;             // Token location
+  int line_no;           // Line number
+  int lit;               // Index into the literal table if TK_NUM or TK_STR
 };
 
 void error(char *fmt, ...);
@@ -59,11 +170,35 @@ void error_tok(Token *tok, char *fmt, ...);
 bool equal(Token *tok, char *op);
 Token *skip(Token *tok, char *op);
 bool consume(Token **rest, Token *tok, char *str);
+Literal *tok_literal(Token *tok);
+Literal *new_literal(Token *tok);
+char *intern(char *p, int len);
+File *new_file(char *name, int file_no, char *contents);
+char *scratch_string(char *s);
+File *add_file(char *name, char *contents, int size);
+File *get_file(int file_no);
+void add_input_file(int file_no);
+File **get_input_files(void);
+Token *tokenize(File *file);
+Token *tokenize_scratch(char *s);
 Token *tokenize_file(char *filename);
 
 #define unreachable() \
   error("internal error at %s:%d", __FILE__, __LINE__)
 
+//
+// preprocess.c
+//
+
+void init_macros(void);
+void define_macro(char *name, char *buf);
+void undef_macro(char *name);
+void preload_file(char *path);
+uint64_t macro_hash(void);
+void save_macros(PchWriter *w);
+void load_macros(PchReader *r);
+Token *preprocess(Token *tok);
+
 //
 // parse.c
 //
@@ -96,6 +231,7 @@ struct Obj {
   Obj *locals;
   Obj *va_area;
   int stack_size;
+  Arena *arena; // Owns the function's AST and local variables
 };
 
 // Global variable can be initialized either by a constant expression
@@ -156,55 +292,60 @@ typedef enum {
 } NodeKind;
 
 // AST node type
+//
+// A node consists of a common header followed by up to six slots whose
+// meaning depends on the node kind. Only as many slots as the kind
+// needs are allocated (see node_size() in parse.c), so a field must
+// not be accessed unless it is listed for the node's kind below.
 struct Node {
   NodeKind kind; // Node kind
   Node *next;    // Next node
   Type *ty;      // Type, e.g. int or pointer to int
   Token *tok;    // Representative token
 
-  Node *lhs;     // Left-hand side
-  Node *rhs;     // Right-hand side
-
-  // "if" or "for" statement
-  Node *cond;
-  Node *then;
-  Node *els;
-  Node *init;
-  Node *inc;
-
-  // "break" and "continue" labels
-  char *brk_label;
-  char *cont_label;
-
-  // Block or statement expression
-  Node *body;
-
-  // Struct member access
-  Member *member;
-
-  // Function call
-  char *funcname;
-  Type *func_ty;
-  Node *args;
-
-  // Goto or labeled statement
-  char *label;
-  char *unique_label;
-  Node *goto_next;
-
-  // Switch-cases
-  Node *case_next;
-  Node *default_case;
-
-  // Variable
-  Obj *var;
-
-  // Numeric literal
-  int64_t val;
-  double fval;
+  union {
+    Node *lhs;      // Operators, cast, member, return, case and label
+    Node *cond;     // "if", "for", "do", "switch" and ?:
+    Node *body;     // Block or statement expression
+    Obj *var;       // Variable or memzero
+    char *funcname; // Function call
+    double fval;    // Numeric literal
+  };
+
+  union {
+    Node *rhs;      // Right-hand side of a binary operator
+    Node *then;     // "if", "for", "do", "switch" and ?:
+    Member *member; // Struct member access
+    Type *func_ty;  // Function call
+    int64_t val;    // Numeric literal or case
+  };
+
+  union {
+    Node *els;       // "if" and ?:
+    char *brk_label; // "for", "do" and "switch"
+    char *label;     // Goto, labeled statement or case
+    Node *args;      // Function call
+  };
+
+  union {
+    char *cont_label;   // "for" and "do"
+    char *unique_label; // Goto or labeled statement
+    Node *case_next;    // "switch" or case
+  };
+
+  union {
+    Node *init;         // "for"
+    Node *goto_next;    // Goto or labeled statement
+    Node *default_case; // "switch"
+  };
+
+  Node *inc;            // "for"
 };
 
 Node *new_cast(Node *expr, Type *ty);
+int64_t const_expr(Token **rest, Token *tok);
+void save_globals(PchWriter *w);
+void load_globals(PchReader *r);
 Obj *parse(Token *tok);
 
 //
@@ -244,10 +385,6 @@ struct Type {
   // the C spec.
   Type *base;
 
-  // Declaration
-  Token *name;
-  Token *name_pos;
-
   // Array
   int array_len;
 
@@ -257,9 +394,9 @@ struct Type {
 
   // Function type
   Type *return_ty;
-  Type *params;
+  Type **params;
+  int nparams;
   bool is_variadic;
-  Type *next;
 };
 
 // Struct member
@@ -293,15 +430,263 @@ bool is_integer(Type *ty);
 bool is_flonum(Type *ty);
 Type *copy_type(Type *ty);
 Type *pointer_to(Type *base);
-Type *func_type(Type *return_ty);
+Type *func_type(Type *return_ty, Type **params, int nparams, bool is_variadic);
 Type *array_of(Type *base, int size);
 Type *enum_type(void);
 Type *struct_type(void);
 void add_type(Node *node);
 
+//
+// main.c
+//
+
+extern StringArray include_paths;
+extern char *opt_include_pch;
+extern char *opt_cache_dir;
+extern int64_t opt_cache_size;
+
+int run_driver(int argc, char **argv);
+
+//
+// server.c
+//
+
+void report_header(char *path);
+int run_client(char *path, int argc, char **argv);
+int run_server(char *path);
+
+//
+// pch.c
+//
+
+void pch_write_bytes(PchWriter *w, void *p, int64_t len);
+void pch_write_int(PchWriter *w, int64_t val);
+void pch_write_str(PchWriter *w, char *s);
+void pch_add_ref(PchWriter *w, void *p);
+void pch_write_ref(PchWriter *w, void *p);
+void pch_write_file(PchWriter *w, int file_no);
+void pch_write_token(PchWriter *w, Token *tok);
+void pch_write_type(PchWriter *w, Type *ty);
+void write_pch(FILE *out, uint64_t macro_hash);
+
+void pch_corrupted(PchReader *r);
+void *pch_read_bytes(PchReader *r, int64_t len);
+int64_t pch_read_int(PchReader *r);
+int pch_read_count(PchReader *r);
+char *pch_read_str(PchReader *r);
+void pch_push_ref(PchReader *r, void *p);
+void *pch_read_ref(PchReader *r);
+int pch_read_file(PchReader *r);
+void pch_read_token(PchReader *r, Token *tok);
+Type *pch_read_type(PchReader *r);
+bool load_pch(char *path, char *header);
+
+//
+// cache.c
+//
+
+char *cache_hash(Token *tok);
+FILE *cache_lookup(char *key);
+FILE *cache_create(char *key);
+void cache_store(char *key);
+
+//
+// timevar.c
+//
+
+typedef enum {
+  TV_READ_FILE,
+  TV_TOKENIZE,
+  TV_PREPROCESS,
+  TV_PARSE,
+  TV_LVAR_OFFSETS,
+  TV_EMIT_DATA,
+  TV_EMIT_TEXT,
+  NUM_TIMEVARS,
+} TimeVar;
+
+extern bool opt_time_report;
+extern char *opt_trace;
+extern bool timevar_enabled;
+
+int64_t timevar_now(void);
+void timevar_start(void);
+void timevar_push(TimeVar tv);
+void timevar_pop(TimeVar tv);
+void trace_event(char *cat, char *name, char *loc, int64_t start,
+                 int64_t end, int tid);
+void timevar_function(char *name, int64_t start, int64_t end, int tid);
+void timevar_finish(char *input, FILE *trace);
+FILE *open_trace(char *path);
+void close_trace(FILE *out);
+
+//
+// ir.c
+//
+
+typedef enum {
+  IR_I8,
+  IR_I16,
+  IR_I32,
+  IR_I64,
+  IR_U8,
+  IR_U16,
+  IR_U32,
+  IR_U64,
+} IrType;
+
+typedef enum {
+  IR_IMM,    // dst = imm
+  IR_LOCAL,  // dst = &var
+  IR_GLOBAL, // dst = &sym
+  IR_MOV,    // dst = a
+  IR_NEG,    // dst = -a
+  IR_NOT,    // dst = !a
+  IR_BITNOT, // dst = ~a
+  IR_ADD,    // dst = a + b
+  IR_SUB,    // dst = a - b
+  IR_MUL,    // dst = a * b
+  IR_DIV,    // dst = a / b
+  IR_MOD,    // dst = a % b
+  IR_AND,    // dst = a & b
+  IR_OR,     // dst = a | b
+  IR_XOR,    // dst = a ^ b
+  IR_SHL,    // dst = a << b
+  IR_SHR,    // dst = a >> b
+  IR_EQ,     // dst = a == b
+  IR_NE,     // dst = a != b
+  IR_LT,     // dst = a < b
+  IR_LE,     // dst = a <= b
+  IR_EXT,    // dst = a sign- or zero-extended from `ty`
+  IR_LOAD,   // dst = *a
+  IR_STORE,  // *a = b
+  IR_COPY,   // memcpy(a, b, imm)
+  IR_ZERO,   // memset(&var, 0, sizeof(var))
+  IR_CALL,   // dst = sym(args...)
+  IR_JMP,    // goto target[0]
+  IR_BR,     // if (a) goto target[0]; else goto target[1]
+  IR_RET,    // return a
+} IrOp;
+
+// A three-address instruction. Operands and results are value numbers,
+// or -1 if absent.
+typedef struct {
+  IrOp op;
+  IrType ty;
+  int dst;
+  int a;
+  int b;
+  int target[2]; // Blocks of IR_JMP and IR_BR
+  int args;      // Index of IR_CALL's first argument in IrFunc's `args`
+  int nargs;
+  int align;     // IR_COPY
+  long imm;
+  Obj *var;
+  char *sym;
+  Token *tok;
+} IrInsn;
+
+// A basic block is a run of instructions ending with a jmp, br or ret.
+typedef struct {
+  int first; // Index of the first instruction
+  int end;   // Index of the instruction after the last
+} IrBlock;
+
+typedef struct {
+  Obj *fn;
+  IrInsn *insns;
+  int ninsns;
+  int cap;
+  IrBlock *blocks;
+  int nblocks;
+  int blocks_cap;
+  int *args;
+  int nargs;
+  int args_cap;
+  int nvalues;
+} IrFunc;
+
+void lower_function(Obj *fn, IrFunc *f);
+void free_ir(IrFunc *f);
+void print_ir(IrFunc *f, FILE *out);
+void emit_ir(Obj *prog, FILE *out);
+
 //
 // codegen.c
 //
 
+extern int opt_codegen_threads;
+extern bool opt_codegen_stats;
+
 void codegen(Obj *prog, FILE *out);
-int align_to(int n, int align);
\ No newline at end of file
+int align_to(int n, int align);
+
+//
+// regalloc.c
+//
+
+// Physical registers of LoongArch. Virtual registers are numbered
+// from FIRST_VREG.
+enum {
+  REG_ZERO = 0,
+  REG_RA = 1,
+  REG_SP = 3,
+  REG_A0 = 4,
+  REG_T0 = 12,
+  REG_T1 = 13,
+  REG_FP = 22,
+  REG_S0 = 23,
+  FIRST_VREG = 32,
+};
+
+#define NO_REG -1
+
+typedef enum {
+  MI_RRR,   // op rd, rj, rk
+  MI_RRI,   // op rd, rj, imm
+  MI_RR,    // op rd, rj
+  MI_LI,    // li.d rd, imm
+  MI_LA,    // la.local rd, sym
+  MI_MOVE,  // move rd, rj
+  MI_LOAD,  // op rd, rj, imm (rd = *(rj + imm))
+  MI_STORE, // op rd, rj, imm (*(rj + imm) = rd)
+  MI_JUMP,  // b label
+  MI_BZ,    // op rj, label
+  MI_BR,    // op rj, rd, label
+  MI_CALL,  // bl sym
+  MI_RET,   // Jump to the epilogue
+  MI_LABEL, // label:
+  MI_LOC,   // .loc
+} MInsnKind;
+
+// A machine instruction. A label operand is `sym` followed by
+// `label_no`, or just `sym` if `label_no` is negative.
+typedef struct {
+  MInsnKind kind;
+  int rd;
+  int rj;
+  int rk;
+  int label_no;
+  bool is_spill; // Spill code inserted by regalloc()
+  long imm;
+  char *op;
+  char *sym;
+  Token *tok;    // MI_LOC
+} MInsn;
+
+// The code of a function
+typedef struct {
+  MInsn *insns;
+  int ninsns;
+  int cap;
+  int nvregs;
+
+  // Spill slots are allocated downward from this offset from $fp.
+  int slot_base;
+
+  // Set by regalloc()
+  int nslots;     // Number of 8-byte spill slots
+  uint32_t saved; // Callee-saved registers in use
+} MFunc;
+
+void regalloc(MFunc *mf);
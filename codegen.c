@@ -1,501 +1,1027 @@
 #include "chibicc.h"
+#include <pthread.h>
+
+// Assembly text is accumulated in a buffer. Text outside of functions
+// goes to a large file-level buffer, which is written out with write(2)
+// only when it fills up. The code of a function may be generated on a
+// worker thread (see emit_text()), in which case it goes to a buffer
+// of its own that grows as needed.
+//
+// Most of the output consists of fixed instruction templates with a
+// register name or an integer filled in, so we format those by hand
+// instead of using vfprintf.
+#define OUTBUF_SIZE (1024 * 1024)
+
+typedef struct {
+  char *data;
+  int len;
+  int cap;
+  bool is_file; // Flushed to `output_fd` instead of growing
+} Buffer;
+
+static char outbuf[OUTBUF_SIZE];
+static Buffer file_buf = {outbuf, 0, OUTBUF_SIZE, true};
+static int output_fd;
+
+// Number of threads to generate functions with
+int opt_codegen_threads = 1;
+
+// Counts of emitted instructions by class for -fcodegen-stats.
+// Spills and reloads are the stores and loads inserted by the register
+// allocator; they are also counted as stores and loads.
+bool opt_codegen_stats;
+
+typedef struct {
+  int insns;
+  int spills;
+  int reloads;
+  int loads;
+  int stores;
+  int branches;
+  int lis;
+  int locs;
+} CodegenStats;
+
+// Upper limit of the number of functions listed
+#define MAX_STATS_FUNCS 10
+
+// Code generation state. Each thread generates one function at a time,
+// so the state is per thread and reset for each function.
+static _Thread_local Buffer *out = &file_buf;
+static _Thread_local Obj *current_fn;
+static _Thread_local IrFunc ir;
+static _Thread_local MFunc mfunc;
+static _Thread_local char *label_prefix; // ".L.<function>."
+static _Thread_local CodegenStats *stats; // NULL unless -fcodegen-stats
+
+// What instruction selection knows about an IR value
+typedef struct {
+  int def;     // Index of the defining instruction
+  int ndefs;
+  int nuses;
+  bool folded; // Computed as part of the instruction that uses it
+} ValueInfo;
+
+static _Thread_local ValueInfo *values;
+static _Thread_local int values_cap;
+static _Thread_local bool *labeled; // Blocks that are jumped to
+static _Thread_local int labeled_cap;
 
-static FILE *output_file;
-static int depth;
 static char *argreg[] = {"a0", "a1", "a2", "a3", "a4", "a5", "a6", "a7"};
-static Obj *current_fn;
 
-static void gen_expr(Node *node);
-static void gen_stmt(Node *node);
+static char *reg_names[] = {
+  "r0", "ra", "tp", "sp", "a0", "a1", "a2", "a3", "a4", "a5", "a6",
+  "a7", "t0", "t1", "t2", "t3", "t4", "t5", "t6", "t7", "t8", "r21",
+  "fp", "s0", "s1", "s2", "s3", "s4", "s5", "s6", "s7", "s8",
+};
+
+static void write_all(char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(output_fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      error("cannot write output: %s", strerror(errno));
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static void flush_output(void) {
+  write_all(file_buf.data, file_buf.len);
+  file_buf.len = 0;
+}
+
+// Makes room for `len` more bytes in the current buffer. Returns false
+// if the text should be written out directly because it is larger
+// than the file-level buffer.
+static bool reserve(int len) {
+  if (out->is_file) {
+    flush_output();
+    return len <= out->cap;
+  }
+
+  while (out->len + len > out->cap)
+    out->cap = out->cap ? out->cap * 2 : 4096;
+  out->data = realloc(out->data, out->cap);
+  return true;
+}
+
+static void emit(char *s, int len) {
+  if (out->len + len > out->cap && !reserve(len)) {
+    write_all(s, len);
+    return;
+  }
+  memcpy(out->data + out->len, s, len);
+  out->len += len;
+}
+
+static void emit_str(char *s) {
+  emit(s, strlen(s));
+}
+
+static void emit_char(char c) {
+  if (out->len == out->cap)
+    reserve(1);
+  out->data[out->len++] = c;
+}
+
+static void emit_uint(unsigned long val) {
+  char buf[20];
+  char *p = buf + sizeof(buf);
+  do {
+    *--p = '0' + val % 10;
+    val /= 10;
+  } while (val);
+  emit(p, buf + sizeof(buf) - p);
+}
+
+static char *branch_ops[] = {
+  "b", "bl", "beq", "bne", "beqz", "bnez", "blt", "bge", "bltu", "bgeu",
+  "jr", "jirl",
+};
+
+// Counts an instruction for -fcodegen-stats. `op` starts with its
+// mnemonic.
+static void count_insn(char *op) {
+  stats->insns++;
+  if (!strncmp(op, "ld.", 3)) {
+    stats->loads++;
+    return;
+  }
+  if (!strncmp(op, "st.", 3)) {
+    stats->stores++;
+    return;
+  }
+  if (!strncmp(op, "li.", 3)) {
+    stats->lis++;
+    return;
+  }
+
+  int len = strcspn(op, " ");
+  for (int i = 0; i < sizeof(branch_ops) / sizeof(*branch_ops); i++) {
+    if (strlen(branch_ops[i]) == len && !strncmp(op, branch_ops[i], len)) {
+      stats->branches++;
+      return;
+    }
+  }
+}
+
+static void emit_int(long val) {
+  if (val < 0) {
+    emit_char('-');
+    emit_uint(-(unsigned long)val);
+    return;
+  }
+  emit_uint(val);
+}
 
+// A printf-like function which understands only the conversions
+// used in this file: %d, %u, %ld, %lu, %+ld, %s and %f.
 static void println(char *fmt, ...) {
+  // Instructions are indented, and their mnemonics are never
+  // formatted.
+  if (stats && fmt[0] == ' ' && fmt[2] != '.')
+    count_insn(fmt + 2);
+
   va_list ap;
   va_start(ap, fmt);
-  vfprintf(output_file, fmt, ap);
+
+  for (char *p = fmt;;) {
+    char *q = p;
+    while (*q && *q != '%')
+      q++;
+    emit(p, q - p);
+    if (*q == '\0')
+      break;
+
+    q++;
+    bool plus = (*q == '+');
+    if (plus)
+      q++;
+    bool is_long = (*q == 'l');
+    if (is_long)
+      q++;
+
+    switch (*q) {
+    case 'd': {
+      long val = is_long ? va_arg(ap, long) : va_arg(ap, int);
+      if (plus && val >= 0)
+        emit_char('+');
+      emit_int(val);
+      break;
+    }
+    case 'u':
+      emit_uint(is_long ? va_arg(ap, unsigned long) : va_arg(ap, unsigned));
+      break;
+    case 's':
+      emit_str(va_arg(ap, char *));
+      break;
+    case 'f': {
+      char buf[512];
+      emit(buf, snprintf(buf, sizeof(buf), "%f", va_arg(ap, double)));
+      break;
+    }
+    default:
+      unreachable();
+    }
+    p = q + 1;
+  }
+
   va_end(ap);
-  fprintf(output_file, "\n");
+  emit_char('\n');
 }
 
-static int count(void) {
-  static int i = 1;
-  return i++;
+// Fast paths for the most common instruction shapes.
+
+// "  op $rd, imm"
+static void emit_ri(char *op, char *rd, long imm) {
+  if (stats)
+    count_insn(op);
+  emit("  ", 2);
+  emit_str(op);
+  emit(" $", 2);
+  emit_str(rd);
+  emit(", ", 2);
+  emit_int(imm);
+  emit_char('\n');
 }
 
-static void push(void) {
-  println("  addi.d $sp, $sp, -8");
-  println("  st.d $a0, $sp, 0");
-  depth++;
+// "  op $rd, $rj, imm"
+static void emit_rri(char *op, char *rd, char *rj, long imm) {
+  if (stats)
+    count_insn(op);
+  emit("  ", 2);
+  emit_str(op);
+  emit(" $", 2);
+  emit_str(rd);
+  emit(", $", 3);
+  emit_str(rj);
+  emit(", ", 2);
+  emit_int(imm);
+  emit_char('\n');
 }
 
-static void pop(char *arg) {
-  println("  ld.d $%s, $sp, 0", arg);
-  println("  addi.d $sp, $sp, 8");
-  depth--;
+static void emit_loc(Token *tok) {
+  if (stats)
+    stats->locs++;
+  emit("  .loc ", 7);
+  emit_int(tok->file_no ? get_file(tok->file_no)->display_no : 0);
+  emit_char(' ');
+  emit_int(tok->line_no);
+  emit_char('\n');
 }
 
-// Round up `n` to the nearest multiple of `align`. For instance,
-// align_to(5, 8) returns 8 and align_to(11, 8) returns 16.
-int align_to(int n, int align) {
-  return (n + align - 1) / align * align;
+static void emit_reg(int reg) {
+  assert(0 <= reg && reg < FIRST_VREG);
+  emit_char('$');
+  emit_str(reg_names[reg]);
 }
 
-// Compute the absolute address of a given node.
-// It's an error if a given node does not reside in memory.
-static void gen_addr(Node *node) {
-  switch (node->kind) {
-  case ND_VAR:
-    if (node->var->is_local) {
-      // Local variable
-      println("  li.d $t1, %d", node->var->offset - node->var->ty->size);
-      println("  add.d $a0, $fp, $t1");
-    } else {
-      // Global variable
-      println("  la.local $a0, %s", node->var->name);
-    }
+static void emit_label(MInsn *mi) {
+  emit_str(mi->sym);
+  if (mi->label_no >= 0)
+    emit_int(mi->label_no);
+}
 
+// Writes out an instruction whose registers have been allocated.
+static void emit_insn(MInsn *mi) {
+  switch (mi->kind) {
+  case MI_LOC:
+    emit_loc(mi->tok);
     return;
-  case ND_DEREF:
-    gen_expr(node->lhs);
-    return;
-  case ND_COMMA:
-    gen_expr(node->lhs);
-    gen_addr(node->rhs);
-    return;
-  case ND_MEMBER:
-    gen_addr(node->lhs);
-    println("  addi.d $a0, $a0, %d", node->member->offset);
+  case MI_LABEL:
+    emit_label(mi);
+    emit(":\n", 2);
     return;
   }
 
-  error_tok(node->tok, "not an lvalue");
+  if (stats) {
+    count_insn(mi->op);
+    if (mi->is_spill && mi->kind == MI_STORE)
+      stats->spills++;
+    else if (mi->is_spill && mi->kind == MI_LOAD)
+      stats->reloads++;
+  }
+
+  emit("  ", 2);
+  emit_str(mi->op);
+  emit_char(' ');
+
+  switch (mi->kind) {
+  case MI_RRR:
+    emit_reg(mi->rd);
+    emit(", ", 2);
+    emit_reg(mi->rj);
+    emit(", ", 2);
+    emit_reg(mi->rk);
+    break;
+  case MI_RRI:
+  case MI_LOAD:
+  case MI_STORE:
+    emit_reg(mi->rd);
+    emit(", ", 2);
+    emit_reg(mi->rj);
+    emit(", ", 2);
+    emit_int(mi->imm);
+    break;
+  case MI_LI:
+    emit_reg(mi->rd);
+    emit(", ", 2);
+    emit_int(mi->imm);
+    break;
+  case MI_LA:
+    emit_reg(mi->rd);
+    emit(", ", 2);
+    emit_str(mi->sym);
+    break;
+  case MI_RR:
+  case MI_MOVE:
+    emit_reg(mi->rd);
+    emit(", ", 2);
+    emit_reg(mi->rj);
+    break;
+  case MI_JUMP:
+    emit_label(mi);
+    break;
+  case MI_BZ:
+    emit_reg(mi->rj);
+    emit(", ", 2);
+    emit_label(mi);
+    break;
+  case MI_BR:
+    emit_reg(mi->rj);
+    emit(", ", 2);
+    emit_reg(mi->rd);
+    emit(", ", 2);
+    emit_label(mi);
+    break;
+  case MI_CALL:
+    emit_str(mi->sym);
+    break;
+  case MI_RET:
+    emit(".L.return.", 10);
+    emit_str(current_fn->name);
+    break;
+  default:
+    unreachable();
+  }
+  emit_char('\n');
 }
 
-// Load a value from where a0 is pointing to.
-static void load(Type *ty) {
-  if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
-    // If it is an array, do not attempt to load a value to the
-    // register because in general we can't load an entire array to a
-    // register. As a result, the result of an evaluation of an array
-    // becomes not the array itself but the address of the array.
-    // This is where "array is automatically converted to a pointer to
-    // the first element of the array in C" occurs.
-    return;
+// The IR of a function is translated to machine instructions that
+// operate on virtual registers, which regalloc() then assigns to
+// physical registers. IR value %n is held in virtual register
+// FIRST_VREG + n.
+
+static MInsn *new_insn(MInsnKind kind, char *op) {
+  if (mfunc.ninsns == mfunc.cap) {
+    mfunc.cap = mfunc.cap ? mfunc.cap * 2 : 1024;
+    mfunc.insns = realloc(mfunc.insns, sizeof(MInsn) * mfunc.cap);
   }
+  MInsn *mi = &mfunc.insns[mfunc.ninsns++];
+  *mi = (MInsn){.kind = kind, .op = op, .rd = NO_REG, .rj = NO_REG,
+                .rk = NO_REG, .label_no = -1};
+  return mi;
+}
+
+static int new_vreg(void) {
+  return FIRST_VREG + mfunc.nvregs++;
+}
+
+// rd = rj op rk
+static void ins_rrr(char *op, int rd, int rj, int rk) {
+  MInsn *mi = new_insn(MI_RRR, op);
+  mi->rd = rd;
+  mi->rj = rj;
+  mi->rk = rk;
+}
+
+// rd = rj op imm
+static void ins_rri(char *op, int rd, int rj, long imm) {
+  MInsn *mi = new_insn(MI_RRI, op);
+  mi->rd = rd;
+  mi->rj = rj;
+  mi->imm = imm;
+}
+
+// rd = op rj
+static void ins_rr(char *op, int rd, int rj) {
+  MInsn *mi = new_insn(MI_RR, op);
+  mi->rd = rd;
+  mi->rj = rj;
+}
+
+static void ins_li_to(int rd, long imm) {
+  MInsn *mi = new_insn(MI_LI, "li.d");
+  mi->rd = rd;
+  mi->imm = imm;
+}
+
+static int ins_li(long imm) {
+  int rd = new_vreg();
+  ins_li_to(rd, imm);
+  return rd;
+}
+
+static void ins_la(int rd, char *sym) {
+  MInsn *mi = new_insn(MI_LA, "la.local");
+  mi->rd = rd;
+  mi->sym = sym;
+}
 
-  char *suffix = ty->is_unsigned ? "u" : "";
+static void ins_move(int rd, int rj) {
+  MInsn *mi = new_insn(MI_MOVE, "move");
+  mi->rd = rd;
+  mi->rj = rj;
+}
+
+static void ins_load(char *op, int rd, int rj, long imm) {
+  MInsn *mi = new_insn(MI_LOAD, op);
+  mi->rd = rd;
+  mi->rj = rj;
+  mi->imm = imm;
+}
+
+static void ins_store(char *op, int rd, int rj, long imm) {
+  MInsn *mi = new_insn(MI_STORE, op);
+  mi->rd = rd;
+  mi->rj = rj;
+  mi->imm = imm;
+}
+
+// Local labels are named after the function and the block number.
+static void ins_jump(int bb) {
+  MInsn *mi = new_insn(MI_JUMP, "b");
+  mi->sym = label_prefix;
+  mi->label_no = bb;
+}
+
+// Jumps if rj is (beqz) or is not (bnez) zero.
+static void ins_bz(char *op, int rj, int bb) {
+  MInsn *mi = new_insn(MI_BZ, op);
+  mi->rj = rj;
+  mi->sym = label_prefix;
+  mi->label_no = bb;
+}
+
+// Jumps if rj and rd compare as `op` says.
+static void ins_br(char *op, int rj, int rd, int bb) {
+  MInsn *mi = new_insn(MI_BR, op);
+  mi->rj = rj;
+  mi->rd = rd;
+  mi->sym = label_prefix;
+  mi->label_no = bb;
+}
+
+static void ins_label(int bb) {
+  MInsn *mi = new_insn(MI_LABEL, NULL);
+  mi->sym = label_prefix;
+  mi->label_no = bb;
+}
 
-  // When we load a char or a short value to a register, we always
-  // extend them to the size of int, so we can assume the lower half of
-  // a register always contains a valid value. The upper half of a
-  // register for char, short and int may contain garbage. When we load
-  // a long value to a register, it simply occupies the entire register.
-  if (ty->size == 1)
-     println("  ld.b%s $a0, $a0, 0", suffix);
-  else if (ty->size == 2)
-     println("  ld.h%s $a0, $a0, 0", suffix);
-  else if (ty->size == 4)
-    println("  ld.w%s $a0, $a0, 0", suffix);
+// Only the last of consecutive .loc directives takes effect, so they
+// are merged.
+static void ins_loc(Token *tok) {
+  if (mfunc.ninsns && mfunc.insns[mfunc.ninsns - 1].kind == MI_LOC)
+    mfunc.insns[mfunc.ninsns - 1].tok = tok;
   else
-     println("  ld.d $a0, $a0, 0");
+    new_insn(MI_LOC, NULL)->tok = tok;
+}
+
+// Round up `n` to the nearest multiple of `align`. For instance,
+// align_to(5, 8) returns 8 and align_to(11, 8) returns 16.
+int align_to(int n, int align) {
+  return (n + align - 1) / align * align;
 }
 
-// Store a0 to an address that the stack top is pointing to.
-static void store(Type *ty) {
-  pop("a1");
+static bool is_imm12(long val) {
+  return -2048 <= val && val < 2048;
+}
 
-  if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
-    for (int i = 0; i < ty->size; i++) {
-      println("  ld.b $a4, $a0, %d\n", i);
-      println("  st.b $a4, $a1, %d\n", i);
+static bool is_64bit(IrType ty) {
+  return ty == IR_I64 || ty == IR_U64;
+}
+
+static bool is_unsigned(IrType ty) {
+  return ty >= IR_U8;
+}
+
+// Returns the instruction that defines `v` if there is only one.
+static IrInsn *def_of(int v) {
+  return values[v].ndefs == 1 ? &ir.insns[values[v].def] : NULL;
+}
+
+static bool get_imm(int v, long *val) {
+  IrInsn *def = def_of(v);
+  if (!def || def->op != IR_IMM)
+    return false;
+  *val = def->imm;
+  return true;
+}
+
+// The address of a local variable as an offset from $fp
+static long local_offset(Obj *var) {
+  return var->offset - var->ty->size;
+}
+
+// Returns a new register holding rj + imm.
+static int add_imm(int rj, long imm) {
+  int rd = new_vreg();
+  if (is_imm12(imm))
+    ins_rri("addi.d", rd, rj, imm);
+  else
+    ins_rrr("add.d", rd, rj, ins_li(imm));
+  return rd;
+}
+
+// Returns a register holding value `v`. Constants and addresses of
+// variables are not kept in registers; they are computed again where
+// they are used.
+static int reg(int v) {
+  IrInsn *def = def_of(v);
+  if (def) {
+    switch (def->op) {
+    case IR_IMM:
+      return def->imm ? ins_li(def->imm) : REG_ZERO;
+    case IR_LOCAL:
+      return add_imm(REG_FP, local_offset(def->var));
+    case IR_GLOBAL: {
+      int rd = new_vreg();
+      ins_la(rd, def->sym);
+      return rd;
+    }
     }
-    return;
   }
+  return FIRST_VREG + v;
+}
 
-  if (ty->size == 1)
-     println("  st.b $a0, $a1, 0");
-  else if (ty->size == 2)
-     println("  st.h $a0, $a1, 0");
-  else if (ty->size == 4)
-    println("  st.w $a0, $a1, 0");
-  else
-     println("  st.d $a0, $a1, 0");
-}
-
-enum { I8, I16, I32, I64, U8, U16, U32, U64 };
-
-static int getTypeId(Type *ty) {
-  switch (ty->kind) {
-  case TY_CHAR:
-    return ty->is_unsigned ? U8 : I8;
-  case TY_SHORT:
-    return ty->is_unsigned ? U16 : I16;
-  case TY_INT:
-    return ty->is_unsigned ? U32 : I32;
-  case TY_LONG:
-    return ty->is_unsigned ? U64 : I64;
-  }
-  return U64;
-}
-
-// The table for type casts
-static char i32i8[] = "  slli.w $a0, $a0, 24\n  srai.w $a0, $a0, 24";
-static char i32u8[] = "  andi $a0, $a0, 0xff";
-static char i32i16[] = "  slli.w $a0, $a0, 16\n  srai.w $a0, $a0, 16";
-static char i32u16[] = "  slli.d $a0, $a0, 48\n  srli.d $a0, $a0, 48";
-
-static char *cast_table[][10] = {
-  // i8   i16     i32   i64     u8     u16     u32   u64
-  {NULL,  NULL,   NULL, NULL, i32u8, i32u16, NULL, NULL}, // i8
-  {i32i8, NULL,   NULL, NULL, i32u8, i32u16, NULL, NULL}, // i16
-  {i32i8, i32i16, NULL, NULL, i32u8, i32u16, NULL, NULL}, // i32
-  {i32i8, i32i16, NULL, NULL,   i32u8, i32u16, NULL, NULL},   // i64
-  {i32i8, NULL,   NULL, NULL, NULL,  NULL,   NULL, NULL}, // u8
-  {i32i8, i32i16, NULL, NULL, i32u8, NULL,   NULL, NULL}, // u16
-  {i32i8, i32i16, NULL, NULL, i32u8, i32u16, NULL, NULL}, // u32
-  {i32i8, i32i16, NULL, NULL,   i32u8, i32u16, NULL, NULL},   // u64
-};
+// Splits the address in value `v` into a base and an offset that fits
+// in a load or store. The base is a value, or -1 for $fp. Additions of
+// constants are absorbed into the offset if they have no other use,
+// and are marked as folded if `mark` is true.
+static int split_addr(int v, long *off, bool mark) {
+  *off = 0;
+  for (;;) {
+    IrInsn *def = def_of(v);
+    long val;
+    if (def && def->op == IR_LOCAL &&
+        is_imm12(*off + local_offset(def->var))) {
+      *off += local_offset(def->var);
+      return -1;
+    }
 
-static void cast(Type *from, Type *to) {
-  if (to->kind == TY_VOID)
-    return;
+    if (!def || def->op != IR_ADD || def->ty != IR_I64 ||
+        values[v].nuses != 1 || !def_of(def->a) ||
+        !get_imm(def->b, &val) || !is_imm12(*off + val))
+      return v;
 
-  if (to->kind == TY_BOOL) {
-    println("  sltu $a0, $r0, $a0");
-    return;
+    if (mark)
+      values[v].folded = true;
+    *off += val;
+    v = def->a;
   }
+}
 
-  int t1 = getTypeId(from);
-  int t2 = getTypeId(to);
-  if (cast_table[t1][t2])
-    println(cast_table[t1][t2]);
+static int addr_reg(int v, long *off) {
+  int base = split_addr(v, off, false);
+  return base == -1 ? REG_FP : reg(base);
 }
 
-// Generate code for a given node.
-static void gen_expr(Node *node) {
-  println("  .loc 1 %d", node->tok->line_no);
+// Finds what the branch ir.insns[i] tests. A comparison or a negation
+// right before the branch is done by the branch itself if its result
+// has no other use. A comparison to branch on is returned, and
+// negations toggle `neg`. Otherwise, `cond` is set to a value to test
+// against zero.
+static IrInsn *branch_cond(int i, int *cond, bool *neg, bool mark) {
+  int c = ir.insns[i].a;
+  *neg = false;
 
-  switch (node->kind) {
-  case ND_NULL_EXPR:
-    return;
-  case ND_NUM: {
-    union { float f32; double f64; uint32_t u32; uint64_t u64; } u;
+  for (; i > 0; i--) {
+    IrInsn *def = def_of(c);
+    if (def != &ir.insns[i - 1] || values[c].nuses != 1)
+      break;
+    if (def->op != IR_NOT && def->op != IR_EQ && def->op != IR_NE &&
+        def->op != IR_LT && def->op != IR_LE)
+      break;
 
-    switch (node->ty->kind) {
-    case TY_FLOAT:
-      u.f32 = node->fval;
-      println("  li.w $a0, %u  # float %f", u.u32, node->fval);
-      println("  movgr2fr.w $f0, $a0");
-      return;
-    case TY_DOUBLE:
-      u.f64 = node->fval;
-      println("  li.d $a0, %lu  # float %f", u.u64, node->fval);
-	  println("  movgr2fr.d $f0, $a0");
-      return;
+    if (mark)
+      values[c].folded = true;
+    if (def->op != IR_NOT)
+      return def;
+    *neg = !*neg;
+    c = def->a;
+  }
+
+  *cond = c;
+  return NULL;
+}
+
+// Counts the definitions and uses of values, and finds the blocks
+// that are jumped to and the instructions that are folded into others.
+static void analyze(void) {
+  if (!values || values_cap < ir.nvalues) {
+    values_cap = MAX(ir.nvalues, 256);
+    free(values);
+    values = malloc(sizeof(ValueInfo) * values_cap);
+  }
+  memset(values, 0, sizeof(ValueInfo) * ir.nvalues);
+
+  if (!labeled || labeled_cap < ir.nblocks) {
+    labeled_cap = MAX(ir.nblocks, 256);
+    free(labeled);
+    labeled = malloc(labeled_cap);
+  }
+  memset(labeled, 0, ir.nblocks);
+
+  for (int i = 0; i < ir.ninsns; i++) {
+    IrInsn *in = &ir.insns[i];
+    if (in->dst != -1) {
+      values[in->dst].def = i;
+      values[in->dst].ndefs++;
     }
+    if (in->a != -1)
+      values[in->a].nuses++;
+    if (in->b != -1)
+      values[in->b].nuses++;
+    for (int j = 0; j < in->nargs; j++)
+      values[ir.args[in->args + j]].nuses++;
+  }
 
-    println("  li.d $a0, %ld", node->val);
-    return;
+  // A branch falls through to the next block if it can.
+  for (int bb = 0; bb < ir.nblocks; bb++) {
+    IrInsn *in = &ir.insns[ir.blocks[bb].end - 1];
+    if (in->op == IR_JMP && in->target[0] != bb + 1) {
+      labeled[in->target[0]] = true;
+    } else if (in->op == IR_BR) {
+      if (in->target[0] != bb + 1)
+        labeled[in->target[0]] = true;
+      if (in->target[1] != bb + 1 || in->target[0] == bb + 1)
+        labeled[in->target[1]] = true;
+    }
   }
-  case ND_NEG:
-    gen_expr(node->lhs);
-    println("  sub.d $a0, $r0, $a0");
-    return;
-  case ND_VAR:
-  case ND_MEMBER:
-    gen_addr(node);
-    load(node->ty);
-    return;
-  case ND_DEREF:
-    gen_expr(node->lhs);
-    load(node->ty);
+
+  for (int i = 0; i < ir.ninsns; i++) {
+    IrInsn *in = &ir.insns[i];
+    long off;
+    int cond;
+    bool neg;
+    if (in->op == IR_LOAD || in->op == IR_STORE)
+      split_addr(in->a, &off, true);
+    else if (in->op == IR_BR)
+      branch_cond(i, &cond, &neg, true);
+  }
+}
+
+// Returns true if no code has to be generated for `in` at its place.
+static bool is_skipped(IrInsn *in) {
+  if (in->dst == -1)
+    return false;
+
+  ValueInfo *v = &values[in->dst];
+  if (v->folded)
+    return true;
+
+  // Constants and addresses are computed by their users.
+  if (v->ndefs == 1 &&
+      (in->op == IR_IMM || in->op == IR_LOCAL || in->op == IR_GLOBAL))
+    return true;
+
+  // Unused results of operations without side effects
+  return v->nuses == 0 && in->op <= IR_EXT;
+}
+
+static char *load_ops[] = {
+  "ld.b", "ld.h", "ld.w", "ld.d", "ld.bu", "ld.hu", "ld.wu", "ld.d",
+};
+
+static char *store_ops[] = {
+  "st.b", "st.h", "st.w", "st.d", "st.b", "st.h", "st.w", "st.d",
+};
+
+static void select_binary(IrInsn *in, int rd) {
+  bool is_long = is_64bit(in->ty);
+  int lhs = in->a;
+  int rhs = in->b;
+  long val;
+
+  // Put a constant operand of a commutative operator on the right.
+  switch (in->op) {
+  case IR_ADD:
+  case IR_AND:
+  case IR_OR:
+  case IR_XOR:
+  case IR_EQ:
+  case IR_NE:
+    if (get_imm(lhs, &val)) {
+      lhs = in->b;
+      rhs = in->a;
+    }
+  }
+
+  bool has_imm = get_imm(rhs, &val);
+
+  switch (in->op) {
+  case IR_ADD:
+    if (has_imm && is_imm12(val))
+      ins_rri(is_long ? "addi.d" : "addi.w", rd, reg(lhs), val);
+    else
+      ins_rrr(is_long ? "add.d" : "add.w", rd, reg(lhs), reg(rhs));
     return;
-  case ND_ADDR:
-    gen_addr(node->lhs);
+  case IR_SUB:
+    if (has_imm && is_imm12(-val))
+      ins_rri(is_long ? "addi.d" : "addi.w", rd, reg(lhs), -val);
+    else
+      ins_rrr(is_long ? "sub.d" : "sub.w", rd, reg(lhs), reg(rhs));
     return;
-  case ND_ASSIGN:
-    gen_addr(node->lhs);
-    push();
-    gen_expr(node->rhs);
-    store(node->ty);
+  case IR_MUL:
+    ins_rrr(is_long ? "mul.d" : "mul.w", rd, reg(lhs), reg(rhs));
     return;
-  case ND_STMT_EXPR:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
+  case IR_DIV:
+    if (is_unsigned(in->ty))
+      ins_rrr(is_long ? "div.du" : "div.wu", rd, reg(lhs), reg(rhs));
+    else
+      ins_rrr(is_long ? "div.d" : "div.w", rd, reg(lhs), reg(rhs));
     return;
-  case ND_COMMA:
-    gen_expr(node->lhs);
-    gen_expr(node->rhs);
+  case IR_MOD:
+    if (is_unsigned(in->ty))
+      ins_rrr(is_long ? "mod.du" : "mod.wu", rd, reg(lhs), reg(rhs));
+    else
+      ins_rrr(is_long ? "mod.d" : "mod.w", rd, reg(lhs), reg(rhs));
     return;
-  case ND_CAST:
-    gen_expr(node->lhs);
-    cast(node->lhs->ty, node->ty);
+  case IR_AND:
+  case IR_OR:
+  case IR_XOR: {
+    static char *ops[] = {"and", "or", "xor"};
+    static char *imm_ops[] = {"andi", "ori", "xori"};
+    int i = in->op - IR_AND;
+    if (has_imm && 0 <= val && val < 4096)
+      ins_rri(imm_ops[i], rd, reg(lhs), val);
+    else
+      ins_rrr(ops[i], rd, reg(lhs), reg(rhs));
     return;
-  case ND_MEMZERO: {
-    int offset = node->var->offset;
-    for (int i = 0; i < node->var->ty->size; i++) {
-      offset -= sizeof(char);
-      println("  li.d $t1, %d", offset);
-      println("  add.d $t1, $t1, $fp");
-      println("  st.b $r0, $t1, 0");
-    }
+  }
+  case IR_SHL:
+  case IR_SHR: {
+    static char *ops[][2][2] = {
+      {{"sll.w", "slli.w"}, {"sll.d", "slli.d"}},
+      {{"srl.w", "srli.w"}, {"srl.d", "srli.d"}},
+      {{"sra.w", "srai.w"}, {"sra.d", "srai.d"}},
+    };
+    int i = (in->op == IR_SHL) ? 0 : is_unsigned(in->ty) ? 1 : 2;
+    if (has_imm && 0 <= val && val < (is_long ? 64 : 32))
+      ins_rri(ops[i][is_long][1], rd, reg(lhs), val);
+    else
+      ins_rrr(ops[i][is_long][0], rd, reg(lhs), reg(rhs));
     return;
   }
-  case ND_COND: {
-    int c = count();
-    gen_expr(node->cond);
-    println("  beqz $a0, .L.else.%d", c);
-    gen_expr(node->then);
-    println("  b .L.end.%d", c);
-    println(".L.else.%d:", c);
-    gen_expr(node->els);
-    println(".L.end.%d:", c);
-    return;
-  }
-  case ND_NOT:
-    gen_expr(node->lhs);
-    println("  sltui $a0, $a0, 1");
-    return;
-  case ND_BITNOT:
-    gen_expr(node->lhs);
-    println("  li.d $a2, -1");
-    println("  xor $a0, $a0, $a2");
-    return;
-  case ND_LOGAND: {
-    int c = count();
-    gen_expr(node->lhs);
-    println("  beqz $a0, .L.false.%d", c);
-    gen_expr(node->rhs);
-    println("  beqz $a0, .L.false.%d", c);
-    println("  li.d $a0, 1");
-    println("  b .L.end.%d", c);
-    println(".L.false.%d:", c);
-    println("  li.d $a0, 0");
-    println(".L.end.%d:", c);
-    return;
-  }
-  case ND_LOGOR: {
-    int c = count();
-    gen_expr(node->lhs);
-    println("  bne $a0, $r0, .L.true.%d", c);
-    gen_expr(node->rhs);
-    println("  bne $a0, $r0, .L.true.%d", c);
-    println("  li.d $a0, 0");
-    println("  b .L.end.%d", c);
-    println(".L.true.%d:", c);
-    println("  li.d $a0, 1");
-    println(".L.end.%d:", c);
-    return;
-  }
-  case ND_FUNCALL: {
-    int nargs = 0;
-    for (Node *arg = node->args; arg; arg = arg->next) {
-      gen_expr(arg);
-      push();
-      nargs++;
-    }
-
-    for (int i = nargs - 1; i >= 0; i--)
-      pop(argreg[i]);
-
-    if (depth % 2 == 0) {
-      println("  bl %s", node->funcname);
+  case IR_EQ:
+  case IR_NE: {
+    int diff;
+    if (has_imm && val == 0) {
+      diff = reg(lhs);
+    } else if (has_imm && is_imm12(-val)) {
+      diff = new_vreg();
+      ins_rri("addi.d", diff, reg(lhs), -val);
     } else {
-      println("  addi.d $fp, $fp,-8");
-      println("  bl %s", node->funcname);
-      println("  addi.d $fp, $fp, 8");
+      diff = new_vreg();
+      ins_rrr("xor", diff, reg(lhs), reg(rhs));
     }
 
-    // It looks like the most significant 48 or 56 bits in a0 may
-    // contain garbage if a function return type is short or bool/char,
-    // respectively. We clear the upper bits here.
-    switch (node->ty->kind) {
-    case TY_BOOL:
-      println("  andi $a0, $a0, 0xff");
-    case TY_CHAR:
-      if (node->ty->is_unsigned) {
-        println("  andi $a0, $a0, 0xff");
-      } else {
-        println("  slli.w $a0, $a0, 24");
-        println("  srai.w $a0, $a0, 24");
-      }
-      return;
-    case TY_SHORT:
-      if (node->ty->is_unsigned) {
-        println("  slli.d $a0, $a0, 48");
-        println("  srli.d $a0, $a0, 48");
-      } else {
-        println("  slli.w $a0, $a0, 16");
-        println("  srai.w $a0, $a0, 16");
-      }
+    if (in->op == IR_EQ)
+      ins_rri("sltui", rd, diff, 1);
+    else
+      ins_rrr("sltu", rd, REG_ZERO, diff);
+    return;
+  }
+  case IR_LT:
+    if (has_imm && is_imm12(val))
+      ins_rri(is_unsigned(in->ty) ? "sltui" : "slti", rd, reg(lhs), val);
+    else
+      ins_rrr(is_unsigned(in->ty) ? "sltu" : "slt", rd, reg(lhs), reg(rhs));
+    return;
+  case IR_LE: {
+    // a <= b is a < b + 1 unless b is the largest number.
+    if (has_imm && is_imm12(val + 1) && !(is_unsigned(in->ty) && val == -1)) {
+      ins_rri(is_unsigned(in->ty) ? "sltui" : "slti", rd, reg(lhs), val + 1);
       return;
     }
+    int tmp = new_vreg();
+    ins_rrr(is_unsigned(in->ty) ? "sltu" : "slt", tmp, reg(rhs), reg(lhs));
+    ins_rri("xori", rd, tmp, 1);
     return;
   }
   }
+  unreachable();
+}
 
-  gen_expr(node->rhs);
-  push();
-  gen_expr(node->lhs);
-  pop("a1");
+// Copies `size` bytes from the address in `src` to the address in
+// `dst` with the widest accesses the alignment allows.
+static void copy(int dst, int src, long size, int align) {
+  int unit = MIN(align, 8);
+  while (size % unit)
+    unit /= 2;
 
-  char* suffix = node->lhs->ty->kind == TY_LONG || node->lhs->ty->base
-               ? "d" : "w";
-  switch (node->kind) {
-  case ND_ADD:
-    println("  add.%s $a0, $a0, $a1", suffix);
-    return;
-  case ND_SUB:
-    println("  sub.%s $a0, $a0, $a1", suffix);
-    return;
-  case ND_MUL:
-    println("  mul.%s $a0, $a0, $a1", suffix);
-    return;
-  case ND_DIV:
-    if (node->ty->is_unsigned) {
-      println("  div.%su $a0, $a0, $a1", suffix);
-    } else {
-      println("  div.%s $a0, $a0, $a1", suffix);
+  char *ld = load_ops[__builtin_ctz(unit)];
+  char *st = store_ops[__builtin_ctz(unit)];
+  int to = reg(dst);
+  int from = reg(src);
+  long base = 0;
+
+  for (long i = 0; i < size; i += unit) {
+    if (!is_imm12(i - base)) {
+      to = add_imm(to, i - base);
+      from = add_imm(from, i - base);
+      base = i;
     }
-    return;
-  case ND_MOD:
-    if (node->ty->is_unsigned) {
-      println("  mod.%su $a0, $a0, $a1", suffix);
-    } else {
-      println("  mod.%s $a0, $a0, $a1", suffix);
+    int tmp = new_vreg();
+    ins_load(ld, tmp, from, i - base);
+    ins_store(st, tmp, to, i - base);
+  }
+}
+
+static void zero(Obj *var) {
+  long size = var->ty->size;
+  int unit = MIN(var->align, 8);
+  while (size % unit)
+    unit /= 2;
+
+  char *st = store_ops[__builtin_ctz(unit)];
+  long off = local_offset(var);
+  int addr = REG_FP;
+  long base = 0;
+
+  for (long i = 0; i < size; i += unit) {
+    if (!is_imm12(off + i - base)) {
+      addr = add_imm(REG_FP, off + i);
+      base = off + i;
     }
+    ins_store(st, REG_ZERO, addr, off + i - base);
+  }
+}
+
+static void select_branch(int i, int bb) {
+  IrInsn *in = &ir.insns[i];
+  int then = in->target[0];
+  int els = in->target[1];
+  int cond;
+  bool neg;
+  IrInsn *cmp = branch_cond(i, &cond, &neg, false);
+
+  // Fall through to the next block if possible.
+  if (then == bb + 1) {
+    then = els;
+    els = bb + 1;
+    neg = !neg;
+  }
+
+  if (!cmp) {
+    ins_bz(neg ? "beqz" : "bnez", reg(cond), then);
+  } else if (cmp->op == IR_EQ || cmp->op == IR_NE) {
+    bool eq = (cmp->op == IR_EQ) != neg;
+    int lhs = cmp->a;
+    int rhs = cmp->b;
+    long val;
+    if (get_imm(lhs, &val) && val == 0) {
+      lhs = cmp->b;
+      rhs = cmp->a;
+    }
+
+    if (get_imm(rhs, &val) && val == 0)
+      ins_bz(eq ? "beqz" : "bnez", reg(lhs), then);
+    else
+      ins_br(eq ? "beq" : "bne", reg(lhs), reg(rhs), then);
+  } else {
+    // a <= b is b >= a.
+    bool is_lt = (cmp->op == IR_LT) != neg;
+    int lhs = (cmp->op == IR_LT) ? cmp->a : cmp->b;
+    int rhs = (cmp->op == IR_LT) ? cmp->b : cmp->a;
+    char *op;
+    if (is_unsigned(cmp->ty))
+      op = is_lt ? "bltu" : "bgeu";
+    else
+      op = is_lt ? "blt" : "bge";
+    ins_br(op, reg(lhs), reg(rhs), then);
+  }
+
+  if (els != bb + 1)
+    ins_jump(els);
+}
+
+static void select_insn(int i, int bb) {
+  IrInsn *in = &ir.insns[i];
+  int rd = FIRST_VREG + in->dst;
+
+  switch (in->op) {
+  case IR_IMM:
+    ins_li_to(rd, in->imm);
     return;
-  case ND_BITAND:
-    println("  and $a0, $a0, $a1");
+  case IR_LOCAL:
+    ins_move(rd, add_imm(REG_FP, local_offset(in->var)));
     return;
-  case ND_BITOR:
-    println("  or $a0, $a0, $a1");
+  case IR_GLOBAL:
+    ins_la(rd, in->sym);
     return;
-  case ND_BITXOR:
-    println("  xor $a0, $a0, $a1");
+  case IR_MOV:
+    ins_move(rd, reg(in->a));
     return;
-  case ND_EQ:
-    println("  sub.d $a0, $a0, $a1");
-    println("  sltui $a0, $a0, 1");
+  case IR_NEG:
+    ins_rrr(is_64bit(in->ty) ? "sub.d" : "sub.w", rd, REG_ZERO, reg(in->a));
     return;
-  case ND_NE:
-    println("  sub.d $a0, $a0, $a1");
-    println("  slt $a0, $a0, $r0");
+  case IR_NOT:
+    ins_rri("sltui", rd, reg(in->a), 1);
     return;
-  case ND_LT:
-    if (node->lhs->ty->is_unsigned) {
-      println("  sltu $a0, $a0, $a1");
-    } else {
-      println("  slt $a0, $a0, $a1");
-    }
+  case IR_BITNOT:
+    ins_rrr("nor", rd, reg(in->a), REG_ZERO);
     return;
-  case ND_LE:
-    if (node->lhs->ty->is_unsigned) {
-      println("  sltu $a0, $a1, $a0");
-    } else {
-      println("  slt $a0, $a1, $a0");
+  case IR_EXT:
+    switch (in->ty) {
+    case IR_I8:
+      ins_rr("ext.w.b", rd, reg(in->a));
+      return;
+    case IR_I16:
+      ins_rr("ext.w.h", rd, reg(in->a));
+      return;
+    case IR_U8:
+      ins_rri("andi", rd, reg(in->a), 0xff);
+      return;
+    case IR_U16: {
+      int tmp = new_vreg();
+      ins_rri("slli.d", tmp, reg(in->a), 48);
+      ins_rri("srli.d", rd, tmp, 48);
+      return;
     }
-    println("  xori $a0, $a0, 1");
-    return;
-  case ND_SHL:
-    println("  sll.%s $a0, $a0, $a1", suffix);
-    return;
-  case ND_SHR:
-    if (node->lhs->ty->is_unsigned) {
-      println("  srl.%s $a0, $a0, $a1", suffix);
-    } else {
-      println("  sra.%s $a0, $a0, $a1", suffix);
     }
+    unreachable();
+  case IR_LOAD: {
+    long off;
+    int base = addr_reg(in->a, &off);
+    ins_load(load_ops[in->ty], rd, base, off);
     return;
-  default:
-    break;
   }
-
-  error_tok(node->tok, "invalid expression");
-}
-
-static void gen_stmt(Node *node) {
-  println("  .loc 1 %d", node->tok->line_no);
-  switch (node->kind) {
-  case ND_IF: {
-    int c = count();
-    gen_expr(node->cond);
-    println("  beqz $a0, .L.else.%d", c);
-    gen_stmt(node->then);
-    println("  b .L.end.%d", c);
-    println(".L.else.%d:", c);
-    if (node->els)
-      gen_stmt(node->els);
-    println(".L.end.%d:", c);
-    return;
-  }
-  case ND_FOR: {
-    int c = count();
-    if (node->init)
-      gen_stmt(node->init);
-    println(".L.begin.%d:", c);
-    if (node->cond) {
-      gen_expr(node->cond);
-      println("  beqz $a0,%s", node->brk_label);
-    }
-    gen_stmt(node->then);
-    println("%s:", node->cont_label);
-    if (node->inc)
-      gen_expr(node->inc);
-    println("  b .L.begin.%d", c);
-    println("%s:", node->brk_label);
-    return;
-  }
-  case ND_DO: {
-    int c = count();
-    println(".L.begin.%d:", c);
-    gen_stmt(node->then);
-    println("%s:", node->cont_label);
-    gen_expr(node->cond);
-    println("  bne $a0, $r0, .L.begin.%d", c);
-    println("%s:", node->brk_label);
-    return;
-  }
-  case ND_SWITCH:
-    gen_expr(node->cond);
-
-    for (Node *n = node->case_next; n; n = n->case_next) {
-      println("  li.d $a4, %ld", n->val);
-      println("  beq $a0, $a4, %s", n->label);
-    }
-
-    if (node->default_case)
-      println("  b %s", node->default_case->label);
-
-    println("  b %s", node->brk_label);
-    gen_stmt(node->then);
-    println("%s:", node->brk_label);
+  case IR_STORE: {
+    long off;
+    int base = addr_reg(in->a, &off);
+    ins_store(store_ops[in->ty], reg(in->b), base, off);
     return;
-  case ND_CASE:
-    println("%s:", node->label);
-    gen_stmt(node->lhs);
+  }
+  case IR_COPY:
+    copy(in->a, in->b, in->imm, in->align);
     return;
-  case ND_BLOCK:
-    for (Node *n = node->body; n; n = n->next)
-      gen_stmt(n);
+  case IR_ZERO:
+    zero(in->var);
     return;
-  case ND_GOTO:
-    println("  b %s", node->unique_label);
+  case IR_CALL:
+    for (int j = 0; j < in->nargs; j++)
+      ins_move(REG_A0 + j, reg(ir.args[in->args + j]));
+    new_insn(MI_CALL, "bl")->sym = in->sym;
+    if (in->dst != -1)
+      ins_move(rd, REG_A0);
     return;
-  case ND_LABEL:
-    println("%s:", node->unique_label);
-    gen_stmt(node->lhs);
+  case IR_JMP:
+    if (in->target[0] != bb + 1)
+      ins_jump(in->target[0]);
     return;
-  case ND_RETURN:
-    if (node->lhs)
-      gen_expr(node->lhs);
-    println("  b .L.return.%s", current_fn->name);
+  case IR_BR:
+    select_branch(i, bb);
     return;
-  case ND_EXPR_STMT:
-    gen_expr(node->lhs);
+  case IR_RET:
+    if (in->a != -1)
+      ins_move(REG_A0, reg(in->a));
+    // The epilogue follows the last block.
+    if (i + 1 < ir.ninsns)
+      new_insn(MI_RET, "b");
     return;
   }
 
-  error_tok(node->tok, "invalid statement");
+  select_binary(in, rd);
+}
+
+static void select_function(void) {
+  analyze();
+
+  int file_no = -1;
+  int line_no = -1;
+
+  for (int bb = 0; bb < ir.nblocks; bb++) {
+    if (labeled[bb])
+      ins_label(bb);
+
+    for (int i = ir.blocks[bb].first; i < ir.blocks[bb].end; i++) {
+      IrInsn *in = &ir.insns[i];
+      if (is_skipped(in))
+        continue;
+
+      Token *tok = in->tok;
+      if (tok && (tok->file_no != file_no || tok->line_no != line_no)) {
+        ins_loc(tok);
+        file_no = tok->file_no;
+        line_no = tok->line_no;
+      }
+      select_insn(i, bb);
+    }
+  }
 }
 
 // Assign offsets to local variables.
@@ -551,85 +1077,307 @@ static void emit_data(Obj *prog) {
 }
 
 static void store_gp(int r, int offset, int sz) {
-  println("  li.d $t1, %d", offset - sz);
-  println("  add.d $t1, $t1, $fp");
-  switch (sz) {
-  case 1:
-    println("  st.b $%s, $t1, 0", argreg[r]);
-    return;
-  case 2:
-    println("  st.h $%s, $t1, 0", argreg[r]);
+  assert(sz == 1 || sz == 2 || sz == 4 || sz == 8);
+  char *op = store_ops[__builtin_ctz(sz)];
+  if (is_imm12(offset - sz)) {
+    emit_rri(op, argreg[r], "fp", offset - sz);
     return;
-  case 4:
-    println("  st.w $%s, $t1, 0", argreg[r]);
-    return;
-  case 8:
-    println("  st.d $%s, $t1, 0", argreg[r]);
+  }
+  emit_ri("li.d", "t1", offset - sz);
+  println("  add.d $t1, $t1, $fp");
+  emit_rri(op, argreg[r], "t1", 0);
+}
+
+// Saves (st.d) or restores (ld.d) a callee-saved register at
+// $fp + offset.
+static void save_reg(char *op, int reg, int offset) {
+  if (-2048 <= offset && offset < 2048) {
+    emit_rri(op, reg_names[reg], "fp", offset);
     return;
   }
-  unreachable();
+  emit_ri("li.d", "t1", offset);
+  println("  add.d $t1, $t1, $fp");
+  emit_rri(op, reg_names[reg], "t1", 0);
 }
 
-static void emit_text(Obj *prog) {
-  for (Obj *fn = prog; fn; fn = fn->next) {
-    if (!fn->is_function || !fn->is_definition)
-      continue;
+// Generates code for a function into the current buffer.
+static void gen_function(Obj *fn) {
+  current_fn = fn;
+  free(label_prefix);
+  label_prefix = malloc(strlen(fn->name) + 5);
+  sprintf(label_prefix, ".L.%s.", fn->name);
 
-    if (fn->is_static)
-      println("  .local %s", fn->name);
-    else
-      println("  .globl %s", fn->name);
-
-    println("  .text");
-    println("%s:", fn->name);
-    current_fn = fn;
-
-    // Prologue
-    println("  st.d $ra, $sp, -8");
-    println("  st.d $fp, $sp, -16");
-    println("  addi.d $fp, $sp, -16");
-    println("  li.d $t1, -%d", fn->stack_size + 16);
-    println("  add.d $sp, $sp, $t1");
-
-//    println("  addi.d $sp, $sp, -%d", fn->stack_size);
-
-    // Save passed-by-register arguments to the stack
-    int i = 0;
-    for (Obj *var = fn->params; var; var = var->next) {
-      // __va_area__
-      if (var->ty->kind == TY_ARRAY) {
-        int offset = var->offset - var->ty->size;
-        while (i < 8) {
-          offset += 8;
-          store_gp(i++, offset, 8);
-        }
-      } else {
-        store_gp(i++, var->offset, var->ty->size);
+  // Lower the body to IR, select instructions and allocate registers.
+  // Spill slots and the callee-saved registers go below the local
+  // variables.
+  lower_function(fn, &ir);
+  mfunc.ninsns = 0;
+  mfunc.nvregs = ir.nvalues;
+  mfunc.slot_base = -fn->stack_size;
+  select_function();
+  regalloc(&mfunc);
+
+  int nsaved = __builtin_popcount(mfunc.saved);
+  int save_base = mfunc.slot_base - mfunc.nslots * 8;
+  int stack_size = align_to(fn->stack_size + (mfunc.nslots + nsaved) * 8, 16);
+
+  if (fn->is_static)
+    println("  .local %s", fn->name);
+  else
+    println("  .globl %s", fn->name);
+
+  println("  .text");
+  println("%s:", fn->name);
+
+  // Prologue
+  println("  st.d $ra, $sp, -8");
+  println("  st.d $fp, $sp, -16");
+  println("  addi.d $fp, $sp, -16");
+  emit_ri("li.d", "t1", -(stack_size + 16));
+  println("  add.d $sp, $sp, $t1");
+
+  for (int r = REG_S0, off = save_base; r < FIRST_VREG; r++)
+    if (mfunc.saved & (1u << r))
+      save_reg("st.d", r, off -= 8);
+
+  // Save passed-by-register arguments to the stack
+  int i = 0;
+  for (Obj *var = fn->params; var; var = var->next) {
+    // __va_area__
+    if (var->ty->kind == TY_ARRAY) {
+      int offset = var->offset - var->ty->size;
+      while (i < 8) {
+        offset += 8;
+        store_gp(i++, offset, 8);
       }
+    } else {
+      store_gp(i++, var->offset, var->ty->size);
     }
+  }
+
+  // Emit code
+  for (int i = 0; i < mfunc.ninsns; i++)
+    emit_insn(&mfunc.insns[i]);
 
-    // Emit code
-    gen_stmt(fn->body);
-    assert(depth == 0);
+  // Epilogue
+  println(".L.return.%s:", fn->name);
+  for (int r = REG_S0, off = save_base; r < FIRST_VREG; r++)
+    if (mfunc.saved & (1u << r))
+      save_reg("ld.d", r, off -= 8);
+  emit_ri("li.d", "t1", stack_size + 16);
+  println("  add.d $sp, $sp, $t1");
+  println("  ld.d $ra, $sp, -8");
+  println("  ld.d $fp, $sp, -16");
+  println("  jr $ra");
+}
+
+// The AST of a function is no longer needed once its code has been
+// generated.
+static void release_function(Obj *fn) {
+  arena_release(fn->arena);
+  fn->params = fn->locals = NULL;
+  fn->body = NULL;
+}
 
-    // Epilogue
-    println(".L.return.%s:", fn->name);
-    println("  li.d $t1, %d", fn->stack_size + 16);
-    println("  add.d $sp, $sp, $t1");
-    println("  ld.d $ra, $sp, -8");
-    println("  ld.d $fp, $sp, -16");
-    println("  jr $ra");
+// A function to be generated by a worker thread
+typedef struct {
+  Obj *fn;
+  Buffer buf;
+  int64_t start; // For -ftime-report and -ftrace
+  int64_t end;
+  int tid;
+  CodegenStats stats; // For -fcodegen-stats
+  bool done;
+} FuncJob;
+
+static FuncJob *jobs;
+static int njobs;
+static int next_job;
+static int nwritten;
+static int window;
+static pthread_mutex_t jobs_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t job_written = PTHREAD_COND_INITIALIZER;
+
+static void run_job(FuncJob *job, int tid) {
+  if (timevar_enabled)
+    job->start = timevar_now();
+
+  stats = opt_codegen_stats ? &job->stats : NULL;
+  gen_function(job->fn);
+  stats = NULL;
+
+  if (timevar_enabled) {
+    job->end = timevar_now();
+    job->tid = tid;
+  }
+}
+
+static void *worker(void *arg) {
+  int tid = (intptr_t)arg;
+
+  for (;;) {
+    // Don't get too far ahead of the main thread, so that the code
+    // and the ASTs of functions waiting to be written out don't pile
+    // up in memory.
+    pthread_mutex_lock(&jobs_mutex);
+    int i = next_job++;
+    while (i < njobs && i >= nwritten + window)
+      pthread_cond_wait(&job_written, &jobs_mutex);
+    pthread_mutex_unlock(&jobs_mutex);
+    if (i >= njobs) {
+      free_ir(&ir);
+      free(mfunc.insns);
+      free(values);
+      free(labeled);
+      free(label_prefix);
+      return NULL;
+    }
+
+    out = &jobs[i].buf;
+    run_job(&jobs[i], tid);
+
+    pthread_mutex_lock(&jobs_mutex);
+    jobs[i].done = true;
+    pthread_cond_signal(&job_done);
+    pthread_mutex_unlock(&jobs_mutex);
+  }
+}
+
+// Generates functions on worker threads. The main thread writes out
+// their code in the order of definition as soon as it is ready, so the
+// output is the same as if we generated them one by one.
+static void emit_text_parallel(int nthreads) {
+  nwritten = 0;
+  window = nthreads * 4;
+
+  pthread_t *threads = calloc(nthreads, sizeof(pthread_t));
+  for (int i = 0; i < nthreads; i++)
+    if (pthread_create(&threads[i], NULL, worker, (void *)(intptr_t)(i + 1)))
+      error("pthread_create failed");
+
+  for (int i = 0; i < njobs; i++) {
+    pthread_mutex_lock(&jobs_mutex);
+    while (!jobs[i].done)
+      pthread_cond_wait(&job_done, &jobs_mutex);
+    pthread_mutex_unlock(&jobs_mutex);
+
+    emit(jobs[i].buf.data, jobs[i].buf.len);
+    free(jobs[i].buf.data);
+    release_function(jobs[i].fn);
+
+    pthread_mutex_lock(&jobs_mutex);
+    nwritten++;
+    pthread_cond_broadcast(&job_written);
+    pthread_mutex_unlock(&jobs_mutex);
   }
+
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+  free(threads);
+}
+
+static void print_stats_line(char *name, CodegenStats *st) {
+  fprintf(stderr, " %-20s %8d %7d %7d %7d %7d %8d %7d %7d\n", name,
+          st->insns, st->spills, st->reloads, st->loads, st->stores,
+          st->branches, st->lis, st->locs);
+}
+
+static int cmp_stats(const void *a, const void *b) {
+  FuncJob *x = *(FuncJob **)a;
+  FuncJob *y = *(FuncJob **)b;
+  if (x->stats.insns != y->stats.insns)
+    return (x->stats.insns < y->stats.insns) - (x->stats.insns > y->stats.insns);
+  return (x > y) - (x < y);
+}
+
+// Prints the totals of -fcodegen-stats and the functions with the
+// most instructions.
+static void print_codegen_stats(void) {
+  CodegenStats total = {};
+  FuncJob **sorted = calloc(njobs, sizeof(FuncJob *));
+  for (int i = 0; i < njobs; i++) {
+    CodegenStats *st = &jobs[i].stats;
+    total.insns += st->insns;
+    total.spills += st->spills;
+    total.reloads += st->reloads;
+    total.loads += st->loads;
+    total.stores += st->stores;
+    total.branches += st->branches;
+    total.lis += st->lis;
+    total.locs += st->locs;
+    sorted[i] = &jobs[i];
+  }
+  qsort(sorted, njobs, sizeof(FuncJob *), cmp_stats);
+
+  File **files = get_input_files();
+  fprintf(stderr, "\nCode generation statistics for %s (%d functions)\n",
+          files[0] ? files[0]->name : "-", njobs);
+  fprintf(stderr, " %-20s %8s %7s %7s %7s %7s %8s %7s %7s\n", "function",
+          "insns", "spill", "reload", "load", "store", "branch", "li", ".loc");
+  print_stats_line("TOTAL", &total);
+  for (int i = 0; i < njobs && i < MAX_STATS_FUNCS; i++)
+    print_stats_line(sorted[i]->fn->name, &sorted[i]->stats);
+  if (njobs > MAX_STATS_FUNCS)
+    fprintf(stderr, " ... %d more\n", njobs - MAX_STATS_FUNCS);
+  free(sorted);
+}
+
+static void emit_text(Obj *prog) {
+  njobs = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      njobs++;
+
+  jobs = calloc(njobs, sizeof(FuncJob));
+  next_job = 0;
+
+  int i = 0;
+  for (Obj *fn = prog; fn; fn = fn->next)
+    if (fn->is_function && fn->is_definition)
+      jobs[i++].fn = fn;
+
+  int nthreads = MIN(opt_codegen_threads, njobs);
+  if (nthreads > 1) {
+    emit_text_parallel(nthreads);
+  } else {
+    for (int i = 0; i < njobs; i++) {
+      run_job(&jobs[i], 0);
+      release_function(jobs[i].fn);
+    }
+  }
+
+  if (timevar_enabled)
+    for (int i = 0; i < njobs; i++)
+      timevar_function(jobs[i].fn->name, jobs[i].start, jobs[i].end,
+                       jobs[i].tid);
+  if (opt_codegen_stats)
+    print_codegen_stats();
+  free(jobs);
 }
 
 void codegen(Obj *prog, FILE *out) {
-  output_file = out;
+  fflush(out);
+  output_fd = fileno(out);
+
+  File **files = get_input_files();
+  for (int i = 0; files[i]; i++)
+    println(".file %d \"%s\"", files[i]->display_no, files[i]->name);
 
+  timevar_push(TV_LVAR_OFFSETS);
   assign_lvar_offsets(prog);
+  timevar_pop(TV_LVAR_OFFSETS);
+
+  timevar_push(TV_EMIT_DATA);
   emit_data(prog);
+  timevar_pop(TV_EMIT_DATA);
+
+  timevar_push(TV_EMIT_TEXT);
   emit_text(prog);
+  timevar_pop(TV_EMIT_TEXT);
 
   println(".LFE0:");
   println("  .size   main, .-main");
   println("  .section  .note.GNU-stack,\"\",@progbits");
+  flush_output();
 }
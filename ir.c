@@ -0,0 +1,807 @@
+// This file lowers the AST of a function to a three-address IR, which
+// codegen.c then translates to LoongArch instructions.
+//
+// A function is a list of basic blocks, each of which ends with a jmp,
+// br or ret, so the control flow graph can be read off the last
+// instructions of blocks. Instructions compute numbered values (%0,
+// %1, ...) from other values. A value is usually defined once, but the
+// results of ?:, && and || are assigned in more than one block.
+//
+// Local variables stay in memory and are accessed by load and store,
+// as in the code chibicc used to generate directly from the AST.
+// The type of an instruction tells how it treats its operands: the
+// width and signedness of arithmetic, the width of memory accesses or
+// the size an operand is extended from. Compares and branches look at
+// all 64 bits of their operands.
+
+#include "chibicc.h"
+
+// Lowering state. Functions may be lowered on codegen's worker
+// threads, so the state is per thread.
+static _Thread_local IrFunc *f;
+static _Thread_local int cur_block; // -1 after a jmp, br or ret
+static _Thread_local HashMap labels; // Label name -> block number + 1
+
+// Blocks in the order they are started, which becomes their layout
+static _Thread_local int *order;
+static _Thread_local int norder;
+static _Thread_local int order_cap;
+
+static int lower_expr(Node *node);
+static void lower_stmt(Node *node);
+
+static int new_block(void) {
+  if (f->nblocks == f->blocks_cap) {
+    f->blocks_cap = f->blocks_cap ? f->blocks_cap * 2 : 64;
+    f->blocks = realloc(f->blocks, sizeof(IrBlock) * f->blocks_cap);
+  }
+  f->blocks[f->nblocks] = (IrBlock){.first = -1};
+  return f->nblocks++;
+}
+
+static void start_block(int bb);
+
+static IrInsn *new_insn(IrOp op, IrType ty, Token *tok) {
+  // Code after a jump is unreachable, but it still needs a block.
+  if (cur_block == -1)
+    start_block(new_block());
+
+  if (f->ninsns == f->cap) {
+    f->cap = f->cap ? f->cap * 2 : 1024;
+    f->insns = realloc(f->insns, sizeof(IrInsn) * f->cap);
+  }
+  IrInsn *in = &f->insns[f->ninsns++];
+  *in = (IrInsn){.op = op, .ty = ty, .dst = -1, .a = -1, .b = -1,
+                 .tok = tok};
+
+  if (op == IR_JMP || op == IR_BR || op == IR_RET)
+    cur_block = -1;
+  return in;
+}
+
+static void jump(int bb, Token *tok) {
+  new_insn(IR_JMP, IR_I64, tok)->target[0] = bb;
+}
+
+static void branch(int cond, int then, int els, Token *tok) {
+  IrInsn *in = new_insn(IR_BR, IR_I64, tok);
+  in->a = cond;
+  in->target[0] = then;
+  in->target[1] = els;
+}
+
+// Ends the current block, falling through to `bb`, and starts `bb`.
+static void start_block(int bb) {
+  if (cur_block != -1)
+    jump(bb, NULL);
+
+  if (norder == order_cap) {
+    order_cap = order_cap ? order_cap * 2 : 64;
+    order = realloc(order, sizeof(int) * order_cap);
+  }
+  order[norder++] = bb;
+  f->blocks[bb].first = f->ninsns;
+  cur_block = bb;
+}
+
+// Returns the block of a named label, such as a goto target or
+// a case label.
+static int label_block(char *name) {
+  intptr_t bb = (intptr_t)hashmap_get(&labels, name);
+  if (bb)
+    return bb - 1;
+  bb = new_block();
+  hashmap_put(&labels, name, (void *)(bb + 1));
+  return bb;
+}
+
+static int new_value(void) {
+  return f->nvalues++;
+}
+
+// Emits an instruction that computes a new value.
+static int emit_op(IrOp op, IrType ty, int a, int b, Token *tok) {
+  IrInsn *in = new_insn(op, ty, tok);
+  in->dst = new_value();
+  in->a = a;
+  in->b = b;
+  return in->dst;
+}
+
+static void emit_imm_to(int dst, IrType ty, long val, Token *tok) {
+  IrInsn *in = new_insn(IR_IMM, ty, tok);
+  in->dst = dst;
+  in->imm = val;
+}
+
+static int emit_imm(IrType ty, long val, Token *tok) {
+  int dst = new_value();
+  emit_imm_to(dst, ty, val, tok);
+  return dst;
+}
+
+static void emit_mov(int dst, IrType ty, int src, Token *tok) {
+  IrInsn *in = new_insn(IR_MOV, ty, tok);
+  in->dst = dst;
+  in->a = src;
+}
+
+static IrType ir_type(Type *ty) {
+  switch (ty->size) {
+  case 1:
+    return ty->is_unsigned ? IR_U8 : IR_I8;
+  case 2:
+    return ty->is_unsigned ? IR_U16 : IR_I16;
+  case 4:
+    return ty->is_unsigned ? IR_U32 : IR_I32;
+  }
+  return ty->is_unsigned ? IR_U64 : IR_I64;
+}
+
+// Compute the absolute address of a given node.
+// It's an error if a given node does not reside in memory.
+static int lower_addr(Node *node) {
+  switch (node->kind) {
+  case ND_VAR: {
+    IrInsn *in;
+    if (node->var->is_local) {
+      in = new_insn(IR_LOCAL, IR_I64, node->tok);
+      in->var = node->var;
+    } else {
+      in = new_insn(IR_GLOBAL, IR_I64, node->tok);
+      in->sym = node->var->name;
+    }
+    in->dst = new_value();
+    return in->dst;
+  }
+  case ND_DEREF:
+    return lower_expr(node->lhs);
+  case ND_COMMA:
+    lower_expr(node->lhs);
+    return lower_addr(node->rhs);
+  case ND_MEMBER: {
+    int base = lower_addr(node->lhs);
+    int off = emit_imm(IR_I64, node->member->offset, node->tok);
+    return emit_op(IR_ADD, IR_I64, base, off, node->tok);
+  }
+  }
+
+  error_tok(node->tok, "not an lvalue");
+}
+
+// Load a value from where `addr` is pointing to.
+static int load(Type *ty, int addr, Token *tok) {
+  // An array or a struct evaluates to its address. This is where
+  // "array is automatically converted to a pointer to the first element
+  // of the array in C" occurs.
+  if (ty->kind == TY_ARRAY || ty->kind == TY_STRUCT || ty->kind == TY_UNION)
+    return addr;
+  return emit_op(IR_LOAD, ir_type(ty), addr, -1, tok);
+}
+
+// Store `val` to where `addr` is pointing to.
+static void store(Type *ty, int addr, int val, Token *tok) {
+  IrInsn *in;
+  if (ty->kind == TY_STRUCT || ty->kind == TY_UNION) {
+    in = new_insn(IR_COPY, IR_I64, tok);
+    in->imm = ty->size;
+    in->align = ty->align;
+  } else {
+    in = new_insn(IR_STORE, ir_type(ty), tok);
+  }
+  in->a = addr;
+  in->b = val;
+}
+
+enum { I8, I16, I32, I64, U8, U16, U32, U64 };
+
+static int getTypeId(Type *ty) {
+  switch (ty->kind) {
+  case TY_CHAR:
+    return ty->is_unsigned ? U8 : I8;
+  case TY_SHORT:
+    return ty->is_unsigned ? U16 : I16;
+  case TY_INT:
+    return ty->is_unsigned ? U32 : I32;
+  case TY_LONG:
+    return ty->is_unsigned ? U64 : I64;
+  }
+  return U64;
+}
+
+// The table for type casts. An entry is the type to extend a value
+// from, or -1 if the value can be used as is.
+enum { NONE = -1 };
+
+static int cast_table[][8] = {
+  // i8     i16     i32   i64   u8     u16     u32   u64
+  {NONE,    NONE,   NONE, NONE, IR_U8, IR_U16, NONE, NONE}, // i8
+  {IR_I8,   NONE,   NONE, NONE, IR_U8, IR_U16, NONE, NONE}, // i16
+  {IR_I8,   IR_I16, NONE, NONE, IR_U8, IR_U16, NONE, NONE}, // i32
+  {IR_I8,   IR_I16, NONE, NONE, IR_U8, IR_U16, NONE, NONE}, // i64
+  {IR_I8,   NONE,   NONE, NONE, NONE,  NONE,   NONE, NONE}, // u8
+  {IR_I8,   IR_I16, NONE, NONE, IR_U8, NONE,   NONE, NONE}, // u16
+  {IR_I8,   IR_I16, NONE, NONE, IR_U8, IR_U16, NONE, NONE}, // u32
+  {IR_I8,   IR_I16, NONE, NONE, IR_U8, IR_U16, NONE, NONE}, // u64
+};
+
+static int cast(Type *from, Type *to, int val, Token *tok) {
+  if (to->kind == TY_VOID)
+    return val;
+
+  if (to->kind == TY_BOOL)
+    return emit_op(IR_NE, IR_I64, val, emit_imm(IR_I64, 0, tok), tok);
+
+  int ext = cast_table[getTypeId(from)][getTypeId(to)];
+  if (ext == NONE)
+    return val;
+  return emit_op(IR_EXT, ext, val, -1, tok);
+}
+
+static IrOp binary_ops[] = {
+  [ND_ADD] = IR_ADD, [ND_SUB] = IR_SUB, [ND_MUL] = IR_MUL,
+  [ND_DIV] = IR_DIV, [ND_MOD] = IR_MOD, [ND_BITAND] = IR_AND,
+  [ND_BITOR] = IR_OR, [ND_BITXOR] = IR_XOR, [ND_SHL] = IR_SHL,
+  [ND_SHR] = IR_SHR, [ND_EQ] = IR_EQ, [ND_NE] = IR_NE, [ND_LT] = IR_LT,
+  [ND_LE] = IR_LE,
+};
+
+// Lower a given node to instructions. Returns the value of the node,
+// or -1 if it has none.
+static int lower_expr(Node *node) {
+  Token *tok = node->tok;
+
+  switch (node->kind) {
+  case ND_NULL_EXPR:
+    return -1;
+  case ND_NUM: {
+    union { float f32; double f64; int32_t i32; int64_t i64; } u;
+
+    switch (node->ty->kind) {
+    case TY_FLOAT:
+      u.f32 = node->fval;
+      return emit_imm(IR_I32, u.i32, tok);
+    case TY_DOUBLE:
+      u.f64 = node->fval;
+      return emit_imm(IR_I64, u.i64, tok);
+    }
+
+    return emit_imm(ir_type(node->ty), node->val, tok);
+  }
+  case ND_NEG:
+    return emit_op(IR_NEG, ir_type(node->ty), lower_expr(node->lhs), -1, tok);
+  case ND_VAR:
+  case ND_MEMBER:
+    return load(node->ty, lower_addr(node), tok);
+  case ND_DEREF:
+    return load(node->ty, lower_expr(node->lhs), tok);
+  case ND_ADDR:
+    return lower_addr(node->lhs);
+  case ND_ASSIGN: {
+    int addr = lower_addr(node->lhs);
+    int val = lower_expr(node->rhs);
+    store(node->ty, addr, val, tok);
+    return val;
+  }
+  case ND_STMT_EXPR:
+    // The value is that of the last expression statement.
+    for (Node *n = node->body; n; n = n->next) {
+      if (!n->next && n->kind == ND_EXPR_STMT)
+        return lower_expr(n->lhs);
+      lower_stmt(n);
+    }
+    return -1;
+  case ND_COMMA:
+    lower_expr(node->lhs);
+    return lower_expr(node->rhs);
+  case ND_CAST:
+    return cast(node->lhs->ty, node->ty, lower_expr(node->lhs), tok);
+  case ND_MEMZERO: {
+    IrInsn *in = new_insn(IR_ZERO, IR_I64, tok);
+    in->var = node->var;
+    return -1;
+  }
+  case ND_COND: {
+    int then = new_block();
+    int els = new_block();
+    int end = new_block();
+    int dst = new_value();
+    IrType ty = ir_type(node->ty);
+
+    branch(lower_expr(node->cond), then, els, tok);
+    start_block(then);
+    int val = lower_expr(node->then);
+    if (val != -1)
+      emit_mov(dst, ty, val, tok);
+    jump(end, tok);
+    start_block(els);
+    int val2 = lower_expr(node->els);
+    if (val2 != -1)
+      emit_mov(dst, ty, val2, tok);
+    start_block(end);
+    return (val == -1 && val2 == -1) ? -1 : dst;
+  }
+  case ND_NOT:
+    return emit_op(IR_NOT, IR_I64, lower_expr(node->lhs), -1, tok);
+  case ND_BITNOT:
+    return emit_op(IR_BITNOT, ir_type(node->ty), lower_expr(node->lhs), -1,
+                   tok);
+  case ND_LOGAND:
+  case ND_LOGOR: {
+    // a && b is (a ? b != 0 : 0), and a || b is (a ? 1 : b != 0).
+    int rhs = new_block();
+    int other = new_block();
+    int end = new_block();
+    int dst = new_value();
+    bool is_and = node->kind == ND_LOGAND;
+
+    int lhs = lower_expr(node->lhs);
+    if (is_and)
+      branch(lhs, rhs, other, tok);
+    else
+      branch(lhs, other, rhs, tok);
+
+    start_block(rhs);
+    int val = lower_expr(node->rhs);
+    int zero = emit_imm(IR_I64, 0, tok);
+    IrInsn *in = new_insn(IR_NE, IR_I64, tok);
+    in->dst = dst;
+    in->a = val;
+    in->b = zero;
+    jump(end, tok);
+
+    start_block(other);
+    emit_imm_to(dst, IR_I32, !is_and, tok);
+    start_block(end);
+    return dst;
+  }
+  case ND_FUNCALL: {
+    int args[8];
+    int nargs = 0;
+    for (Node *arg = node->args; arg; arg = arg->next) {
+      if (nargs == 8)
+        error_tok(arg->tok, "too many arguments");
+      args[nargs++] = lower_expr(arg);
+    }
+
+    if (f->nargs + nargs > f->args_cap) {
+      f->args_cap = f->args_cap ? f->args_cap * 2 : 256;
+      f->args = realloc(f->args, sizeof(int) * f->args_cap);
+    }
+
+    IrInsn *in = new_insn(IR_CALL, ir_type(node->ty), tok);
+    if (node->ty->kind != TY_VOID)
+      in->dst = new_value();
+    in->sym = node->funcname;
+    in->args = f->nargs;
+    in->nargs = nargs;
+    for (int i = 0; i < nargs; i++)
+      f->args[f->nargs++] = args[i];
+
+    // It looks like the most significant 48 or 56 bits in a0 may
+    // contain garbage if a function return type is short or bool/char,
+    // respectively. We clear the upper bits here.
+    int val = in->dst;
+    switch (node->ty->kind) {
+    case TY_BOOL:
+      val = emit_op(IR_EXT, IR_U8, val, -1, tok);
+    case TY_CHAR:
+      return emit_op(IR_EXT, node->ty->is_unsigned ? IR_U8 : IR_I8, val, -1,
+                     tok);
+    case TY_SHORT:
+      return emit_op(IR_EXT, node->ty->is_unsigned ? IR_U16 : IR_I16, val, -1,
+                     tok);
+    }
+    return val;
+  }
+  }
+
+  int rhs = lower_expr(node->rhs);
+  int lhs = lower_expr(node->lhs);
+
+  bool is_long = node->lhs->ty->kind == TY_LONG || node->lhs->ty->base;
+  IrType ty;
+  if (node->lhs->ty->is_unsigned)
+    ty = is_long ? IR_U64 : IR_U32;
+  else
+    ty = is_long ? IR_I64 : IR_I32;
+
+  switch (node->kind) {
+  case ND_ADD:
+  case ND_SUB:
+  case ND_MUL:
+  case ND_DIV:
+  case ND_MOD:
+  case ND_BITAND:
+  case ND_BITOR:
+  case ND_BITXOR:
+  case ND_EQ:
+  case ND_NE:
+  case ND_LT:
+  case ND_LE:
+  case ND_SHL:
+  case ND_SHR:
+    return emit_op(binary_ops[node->kind], ty, lhs, rhs, tok);
+  }
+
+  error_tok(node->tok, "invalid expression");
+}
+
+static void lower_stmt(Node *node) {
+  Token *tok = node->tok;
+
+  switch (node->kind) {
+  case ND_IF: {
+    int then = new_block();
+    int els = new_block();
+    int end = new_block();
+    branch(lower_expr(node->cond), then, els, tok);
+    start_block(then);
+    lower_stmt(node->then);
+    jump(end, tok);
+    start_block(els);
+    if (node->els)
+      lower_stmt(node->els);
+    start_block(end);
+    return;
+  }
+  case ND_FOR: {
+    int begin = new_block();
+    int body = new_block();
+    int brk = label_block(node->brk_label);
+    if (node->init)
+      lower_stmt(node->init);
+    start_block(begin);
+    if (node->cond)
+      branch(lower_expr(node->cond), body, brk, tok);
+    start_block(body);
+    lower_stmt(node->then);
+    start_block(label_block(node->cont_label));
+    if (node->inc)
+      lower_expr(node->inc);
+    jump(begin, tok);
+    start_block(brk);
+    return;
+  }
+  case ND_DO: {
+    int begin = new_block();
+    int brk = label_block(node->brk_label);
+    start_block(begin);
+    lower_stmt(node->then);
+    start_block(label_block(node->cont_label));
+    branch(lower_expr(node->cond), begin, brk, tok);
+    start_block(brk);
+    return;
+  }
+  case ND_SWITCH: {
+    int cond = lower_expr(node->cond);
+
+    for (Node *n = node->case_next; n; n = n->case_next) {
+      int next = new_block();
+      int val = emit_imm(IR_I64, n->val, n->tok);
+      int eq = emit_op(IR_EQ, IR_I64, cond, val, n->tok);
+      branch(eq, label_block(n->label), next, n->tok);
+      start_block(next);
+    }
+
+    if (node->default_case)
+      jump(label_block(node->default_case->label), tok);
+    else
+      jump(label_block(node->brk_label), tok);
+
+    lower_stmt(node->then);
+    start_block(label_block(node->brk_label));
+    return;
+  }
+  case ND_CASE:
+    start_block(label_block(node->label));
+    lower_stmt(node->lhs);
+    return;
+  case ND_BLOCK:
+    for (Node *n = node->body; n; n = n->next)
+      lower_stmt(n);
+    return;
+  case ND_GOTO:
+    jump(label_block(node->unique_label), tok);
+    return;
+  case ND_LABEL:
+    start_block(label_block(node->unique_label));
+    lower_stmt(node->lhs);
+    return;
+  case ND_RETURN: {
+    int val = node->lhs ? lower_expr(node->lhs) : -1;
+    IrInsn *in = new_insn(IR_RET, IR_I64, tok);
+    if (val != -1) {
+      in->ty = ir_type(node->lhs->ty);
+      in->a = val;
+    }
+    return;
+  }
+  case ND_EXPR_STMT:
+    lower_expr(node->lhs);
+    return;
+  }
+
+  error_tok(node->tok, "invalid statement");
+}
+
+// Renumbers blocks in the order they were started, which is the order
+// their code is laid out in.
+static void layout_blocks(void) {
+  int *num = malloc(sizeof(int) * f->nblocks);
+  IrBlock *blocks = malloc(sizeof(IrBlock) * f->blocks_cap);
+  assert(norder == f->nblocks);
+
+  for (int i = 0; i < norder; i++) {
+    num[order[i]] = i;
+    blocks[i].first = f->blocks[order[i]].first;
+    blocks[i].end = (i + 1 < norder) ? f->blocks[order[i + 1]].first
+                                     : f->ninsns;
+  }
+
+  for (int i = 0; i < f->ninsns; i++) {
+    IrInsn *in = &f->insns[i];
+    if (in->op == IR_JMP || in->op == IR_BR) {
+      in->target[0] = num[in->target[0]];
+      if (in->op == IR_BR)
+        in->target[1] = num[in->target[1]];
+    }
+  }
+
+  free(f->blocks);
+  f->blocks = blocks;
+  free(num);
+}
+
+// Returns where a jump to `bb` ends up after following blocks that
+// consist of nothing but a jump.
+static int jump_dest(int bb) {
+  for (int i = 0; i < 16; i++) {
+    IrInsn *in = &f->insns[f->blocks[bb].first];
+    if (in->op != IR_JMP || in->target[0] == bb)
+      break;
+    bb = in->target[0];
+  }
+  return bb;
+}
+
+// Threads jumps through empty blocks and deletes the blocks that
+// cannot be reached from the entry block.
+static void simplify_cfg(void) {
+  for (int i = 0; i < f->nblocks; i++) {
+    IrInsn *in = &f->insns[f->blocks[i].end - 1];
+    if (in->op == IR_JMP || in->op == IR_BR)
+      in->target[0] = jump_dest(in->target[0]);
+    if (in->op == IR_BR)
+      in->target[1] = jump_dest(in->target[1]);
+    if (in->op == IR_BR && in->target[0] == in->target[1]) {
+      in->op = IR_JMP;
+      in->a = -1;
+    }
+  }
+
+  // Find reachable blocks.
+  int *num = calloc(f->nblocks, sizeof(int));
+  int *stack = malloc(sizeof(int) * f->nblocks);
+  int sp = 0;
+  num[0] = 1;
+  stack[sp++] = 0;
+  while (sp > 0) {
+    IrInsn *in = &f->insns[f->blocks[stack[--sp]].end - 1];
+    int n = (in->op == IR_BR) ? 2 : (in->op == IR_JMP);
+    for (int i = 0; i < n; i++) {
+      if (!num[in->target[i]]) {
+        num[in->target[i]] = 1;
+        stack[sp++] = in->target[i];
+      }
+    }
+  }
+
+  // Move them to the front.
+  int nblocks = 0;
+  int ninsns = 0;
+  for (int i = 0; i < f->nblocks; i++) {
+    if (!num[i])
+      continue;
+    IrBlock *bb = &f->blocks[i];
+    int len = bb->end - bb->first;
+    memmove(f->insns + ninsns, f->insns + bb->first, sizeof(IrInsn) * len);
+    f->blocks[nblocks] = (IrBlock){ninsns, ninsns + len};
+    num[i] = nblocks++;
+    ninsns += len;
+  }
+  f->nblocks = nblocks;
+  f->ninsns = ninsns;
+
+  for (int i = 0; i < f->nblocks; i++) {
+    IrInsn *in = &f->insns[f->blocks[i].end - 1];
+    if (in->op == IR_JMP || in->op == IR_BR)
+      in->target[0] = num[in->target[0]];
+    if (in->op == IR_BR)
+      in->target[1] = num[in->target[1]];
+  }
+
+  free(num);
+  free(stack);
+}
+
+// Lowers the body of `fn` to `ir`. The arrays of `ir` are reused.
+void lower_function(Obj *fn, IrFunc *ir) {
+  f = ir;
+  f->fn = fn;
+  f->ninsns = 0;
+  f->nblocks = 0;
+  f->nargs = 0;
+  f->nvalues = 0;
+  norder = 0;
+
+  cur_block = -1;
+  start_block(new_block());
+  lower_stmt(fn->body);
+
+  // Falling off the end of a function returns.
+  if (cur_block != -1)
+    new_insn(IR_RET, IR_I64, NULL);
+
+  layout_blocks();
+  simplify_cfg();
+  hashmap_free(&labels);
+  f = NULL;
+}
+
+void free_ir(IrFunc *ir) {
+  free(ir->insns);
+  free(ir->blocks);
+  free(ir->args);
+  *ir = (IrFunc){};
+  free(order);
+  order = NULL;
+  order_cap = 0;
+}
+
+//
+// Textual dump for -emit-ir
+//
+
+static char *type_names[] = {
+  "i8", "i16", "i32", "i64", "u8", "u16", "u32", "u64",
+};
+
+static char *op_names[] = {
+  [IR_IMM] = "imm", [IR_LOCAL] = "local", [IR_GLOBAL] = "global",
+  [IR_MOV] = "mov", [IR_NEG] = "neg", [IR_NOT] = "not",
+  [IR_BITNOT] = "bitnot", [IR_ADD] = "add", [IR_SUB] = "sub",
+  [IR_MUL] = "mul", [IR_DIV] = "div", [IR_MOD] = "mod", [IR_AND] = "and",
+  [IR_OR] = "or", [IR_XOR] = "xor", [IR_SHL] = "shl", [IR_SHR] = "shr",
+  [IR_EQ] = "eq", [IR_NE] = "ne", [IR_LT] = "lt", [IR_LE] = "le",
+  [IR_EXT] = "ext", [IR_LOAD] = "load", [IR_STORE] = "store",
+  [IR_COPY] = "copy", [IR_ZERO] = "zero", [IR_CALL] = "call",
+  [IR_JMP] = "jmp", [IR_BR] = "br", [IR_RET] = "ret",
+};
+
+// Temporary variables have no names, so they are shown by their
+// position in the list of locals.
+static void print_var(IrFunc *ir, Obj *var, FILE *out) {
+  if (*var->name) {
+    fprintf(out, "%s", var->name);
+    return;
+  }
+
+  int i = 0;
+  for (Obj *v = ir->fn->locals; v != var; v = v->next)
+    i++;
+  fprintf(out, ".tmp%d", i);
+}
+
+static void print_insn(IrFunc *ir, IrInsn *in, FILE *out) {
+  char *ty = type_names[in->ty];
+
+  fprintf(out, "  ");
+  if (in->dst != -1)
+    fprintf(out, "%%%d = ", in->dst);
+  fprintf(out, "%s", op_names[in->op]);
+
+  switch (in->op) {
+  case IR_IMM:
+    fprintf(out, " %s %ld\n", ty, in->imm);
+    return;
+  case IR_LOCAL:
+    fprintf(out, " ");
+    print_var(ir, in->var, out);
+    fprintf(out, "\n");
+    return;
+  case IR_GLOBAL:
+    fprintf(out, " %s\n", in->sym);
+    return;
+  case IR_STORE:
+    fprintf(out, " %s %%%d, %%%d\n", ty, in->b, in->a);
+    return;
+  case IR_COPY:
+    fprintf(out, " %%%d, %%%d, %ld\n", in->a, in->b, in->imm);
+    return;
+  case IR_ZERO:
+    fprintf(out, " ");
+    print_var(ir, in->var, out);
+    fprintf(out, ", %d\n", in->var->ty->size);
+    return;
+  case IR_CALL:
+    fprintf(out, " %s %s(", in->dst == -1 ? "void" : ty, in->sym);
+    for (int i = 0; i < in->nargs; i++)
+      fprintf(out, "%s%%%d", i ? ", " : "", ir->args[in->args + i]);
+    fprintf(out, ")\n");
+    return;
+  case IR_JMP:
+    fprintf(out, " bb%d\n", in->target[0]);
+    return;
+  case IR_BR:
+    fprintf(out, " %%%d, bb%d, bb%d\n", in->a, in->target[0], in->target[1]);
+    return;
+  case IR_RET:
+    if (in->a != -1)
+      fprintf(out, " %s %%%d", ty, in->a);
+    fprintf(out, "\n");
+    return;
+  }
+
+  fprintf(out, " %s %%%d", ty, in->a);
+  if (in->b != -1)
+    fprintf(out, ", %%%d", in->b);
+  fprintf(out, "\n");
+}
+
+void print_ir(IrFunc *ir, FILE *out) {
+  fprintf(out, "function %s(", ir->fn->name);
+  for (Obj *var = ir->fn->params; var; var = var->next)
+    fprintf(out, "%s%s", var == ir->fn->params ? "" : ", ", var->name);
+  fprintf(out, ")\n");
+
+  // Collect the predecessors of each block.
+  int *npreds = calloc(ir->nblocks + 1, sizeof(int));
+  for (int i = 0; i < ir->nblocks; i++) {
+    IrInsn *in = &ir->insns[ir->blocks[i].end - 1];
+    npreds[in->target[0] + 1] += (in->op == IR_JMP || in->op == IR_BR);
+    npreds[in->target[1] + 1] += (in->op == IR_BR);
+  }
+  for (int i = 0; i < ir->nblocks; i++)
+    npreds[i + 1] += npreds[i];
+
+  int *preds = malloc(sizeof(int) * (npreds[ir->nblocks] + 1));
+  int *pos = calloc(ir->nblocks, sizeof(int));
+  for (int i = 0; i < ir->nblocks; i++) {
+    IrInsn *in = &ir->insns[ir->blocks[i].end - 1];
+    for (int j = 0; j < (in->op == IR_BR ? 2 : in->op == IR_JMP); j++) {
+      int bb = in->target[j];
+      preds[npreds[bb] + pos[bb]++] = i;
+    }
+  }
+
+  for (int i = 0; i < ir->nblocks; i++) {
+    fprintf(out, "bb%d:", i);
+    for (int j = npreds[i]; j < npreds[i + 1]; j++)
+      fprintf(out, "%s bb%d", j == npreds[i] ? "  ; preds:" : ",", preds[j]);
+    fprintf(out, "\n");
+
+    for (int j = ir->blocks[i].first; j < ir->blocks[i].end; j++)
+      print_insn(ir, &ir->insns[j], out);
+  }
+
+  free(npreds);
+  free(preds);
+  free(pos);
+}
+
+// Writes the IR of all functions instead of assembly.
+void emit_ir(Obj *prog, FILE *out) {
+  IrFunc ir = {};
+  bool first = true;
+  for (Obj *fn = prog; fn; fn = fn->next) {
+    if (!fn->is_function || !fn->is_definition)
+      continue;
+    lower_function(fn, &ir);
+    if (!first)
+      fprintf(out, "\n");
+    print_ir(&ir, out);
+    first = false;
+  }
+  free_ir(&ir);
+}
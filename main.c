@@ -1,23 +1,69 @@
 #include "chibicc.h"
 
+StringArray include_paths;
+char *opt_include_pch;
+char *opt_cache_dir;
+int64_t opt_cache_size = 1LL << 30;
+
+static StringArray opt_include;
+static bool opt_E;
+static bool opt_emit_pch;
+static bool opt_emit_ir;
 static char *opt_o;
+static int opt_j;
+
+static StringArray input_paths;
 
-static char *input_path;
+// Where the trace events of this process go if -ftrace is given
+static FILE *trace_file;
 
 static void usage(int status) {
-  fprintf(stderr, "chibicc [ -o <path> ] <file>\n");
+  fprintf(stderr, "chibicc [ -o <path> ] [ -j <jobs> ] [ -E ] [ -I <dir> ] [ -D <macro>[=<val>] ] [ -U <macro> ] [ -emit-pch ] [ -emit-ir ] [ -include-pch <file> ] [ -ftime-report ] [ -ftrace=<file> ] [ -fmem-report ] [ -fcodegen-stats ] [ -fcache-dir=<dir> ] [ -fcache-size=<size> ] <file>...\n");
+  fprintf(stderr, "chibicc --server <socket>\n");
+  fprintf(stderr, "chibicc --connect <socket> <args>...\n");
   exit(status);
 }
 
+static void define(char *str) {
+  char *eq = strchr(str, '=');
+  if (eq)
+    define_macro(arena_strndup(perm_arena, str, eq - str), eq + 1);
+  else
+    define_macro(str, "1");
+}
+
+// Parses a size such as "500M" or "2G".
+static int64_t parse_size(char *str) {
+  char *end;
+  int64_t val = strtoll(str, &end, 10);
+  if (*end == 'K' || *end == 'k')
+    val <<= 10, end++;
+  else if (*end == 'M' || *end == 'm')
+    val <<= 20, end++;
+  else if (*end == 'G' || *end == 'g')
+    val <<= 30, end++;
+
+  if (end == str || *end || val <= 0)
+    error("invalid size: %s", str);
+  return val;
+}
+
 static void parse_args(int argc, char **argv) {
+  // Make sure that all command line options that take an argument
+  // have an argument.
+  for (int i = 1; i < argc; i++)
+    if (!strcmp(argv[i], "-o") || !strcmp(argv[i], "-j") ||
+        !strcmp(argv[i], "-I") || !strcmp(argv[i], "-D") ||
+        !strcmp(argv[i], "-U") || !strcmp(argv[i], "-include-pch"))
+      if (!argv[++i])
+        usage(1);
+
   for (int i = 1; i < argc; i++) {
     if (!strcmp(argv[i], "--help"))
       usage(0);
 
     if (!strcmp(argv[i], "-o")) {
-      if (!argv[++i])
-        usage(1);
-      opt_o = argv[i];
+      opt_o = argv[++i];
       continue;
     }
 
@@ -26,14 +72,113 @@ static void parse_args(int argc, char **argv) {
       continue;
     }
 
+    if (!strncmp(argv[i], "-j", 2)) {
+      char *arg = argv[i][2] ? argv[i] + 2 : argv[++i];
+      char *end;
+      opt_j = strtol(arg, &end, 10);
+      if (*end || opt_j < 1)
+        error("invalid number of jobs: %s", arg);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-E")) {
+      opt_E = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-emit-pch")) {
+      opt_emit_pch = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-emit-ir")) {
+      opt_emit_ir = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-include-pch")) {
+      opt_include_pch = argv[++i];
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-ftime-report")) {
+      opt_time_report = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fcodegen-stats")) {
+      opt_codegen_stats = true;
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-fmem-report")) {
+      opt_mem_report = true;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-ftrace=", 8)) {
+      opt_trace = argv[i] + 8;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fcache-dir=", 12)) {
+      opt_cache_dir = argv[i] + 12;
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-fcache-size=", 13)) {
+      opt_cache_size = parse_size(argv[i] + 13);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-I")) {
+      strarray_push(&opt_include, argv[++i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-I", 2)) {
+      strarray_push(&opt_include, argv[i] + 2);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-D")) {
+      define(argv[++i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-D", 2)) {
+      define(argv[i] + 2);
+      continue;
+    }
+
+    if (!strcmp(argv[i], "-U")) {
+      undef_macro(argv[++i]);
+      continue;
+    }
+
+    if (!strncmp(argv[i], "-U", 2)) {
+      undef_macro(argv[i] + 2);
+      continue;
+    }
+
     if (argv[i][0] == '-' && argv[i][1] != '\0')
       error("unknown argument: %s", argv[i]);
 
-    input_path = argv[i];
+    strarray_push(&input_paths, argv[i]);
   }
 
-  if (!input_path)
+  if (input_paths.len == 0)
     error("no input files");
+
+  if (input_paths.len > 1 && opt_o)
+    error("cannot specify '-o' with multiple files");
+
+  if (!opt_j)
+    opt_j = MAX(sysconf(_SC_NPROCESSORS_ONLN), 1);
+
+  // Preprocessed output includes the header in full.
+  if (opt_E)
+    opt_include_pch = NULL;
 }
 
 static FILE *open_file(char *path) {
@@ -46,16 +191,292 @@ static FILE *open_file(char *path) {
   return out;
 }
 
-int main(int argc, char **argv) {
-  parse_args(argc, argv);
+static void add_default_include_paths(void) {
+  // Add paths specified by -I.
+  for (int i = 0; i < opt_include.len; i++)
+    strarray_push(&include_paths, opt_include.data[i]);
 
-  // Tokenize and parse.
-  Token *tok = tokenize_file(input_path);
+  // Add standard include paths.
+  strarray_push(&include_paths, "/usr/local/include");
+  strarray_push(&include_paths, "/usr/include/loongarch64-linux-gnu");
+  strarray_push(&include_paths, "/usr/include");
+}
+
+// Print tokens to a given file, or stdout if NULL. Used for -E.
+static void print_tokens(Token *tok, char *path) {
+  FILE *out = open_file(path);
+
+  int line = 1;
+  for (; tok->kind != TK_EOF; tok++) {
+    if (line > 1 && tok->at_bol)
+      fprintf(out, "\n");
+    if (tok->has_space && !tok->at_bol)
+      fprintf(out, " ");
+    fprintf(out, "%.*s", tok->len, tok->loc);
+    line++;
+  }
+  fprintf(out, "\n");
+}
+
+static void copy_stream(FILE *in, FILE *out) {
+  char buf[4096];
+  rewind(in);
+  for (;;) {
+    size_t n = fread(buf, 1, sizeof(buf), in);
+    if (n == 0)
+      break;
+    fwrite(buf, 1, n, out);
+  }
+  fclose(in);
+}
+
+static void compile(char *input, char *output) {
+  // Tokenize and preprocess.
+  Token *tok = tokenize_file(input);
+  if (!tok)
+    error("cannot open %s: %s", input, strerror(errno));
+
+  // A precompiled header is only valid for the macros it was
+  // built with.
+  uint64_t hash = opt_emit_pch ? macro_hash() : 0;
+
+  // The preprocessor copies tokens to a new array, so the tokens of
+  // the input file are no longer needed after that.
+  timevar_push(TV_PREPROCESS);
+  Token *tok2 = preprocess(tok);
+  timevar_pop(TV_PREPROCESS);
+  free(tok);
+  tok = tok2;
+
+  // If -E is given, print out preprocessed C code as a result.
+  if (opt_E) {
+    print_tokens(tok, output);
+    return;
+  }
+
+  // If -emit-pch is given, save the declarations instead of
+  // generating code.
+  if (opt_emit_pch) {
+    timevar_push(TV_PARSE);
+    parse(tok);
+    timevar_pop(TV_PARSE);
+    write_pch(open_file(output), hash);
+    return;
+  }
+
+  // If -emit-ir is given, print the IR that code would be generated
+  // from.
+  if (opt_emit_ir) {
+    timevar_push(TV_PARSE);
+    Obj *prog = parse(tok);
+    timevar_pop(TV_PARSE);
+    emit_ir(prog, open_file(output));
+    return;
+  }
+
+  // If the same input has been compiled before, use the cached
+  // assembly.
+  char *key = NULL;
+  if (opt_cache_dir) {
+    key = cache_hash(tok);
+    FILE *entry = cache_lookup(key);
+    if (entry) {
+      copy_stream(entry, open_file(output));
+      return;
+    }
+  }
+
+  // Parse.
+  timevar_push(TV_PARSE);
   Obj *prog = parse(tok);
+  timevar_pop(TV_PARSE);
 
   // Traverse the AST to emit assembly.
-  FILE *out = open_file(opt_o);
-  fprintf(out, ".file 1 \"%s\"\n", input_path);
-  codegen(prog, out);
-  return 0;
+  FILE *out = open_file(output);
+  if (!key) {
+    codegen(prog, out);
+    return;
+  }
+
+  FILE *tmp = cache_create(key);
+  codegen(prog, tmp);
+  copy_stream(tmp, out);
+  cache_store(key);
+}
+
+// Compiles a single input file.
+static void cc1(char *input, char *output) {
+  timevar_start();
+  compile(input, output);
+  timevar_finish(input, trace_file);
+  print_mem_report(input);
+}
+
+// Replace file extension
+static char *replace_extn(char *tmpl, char *extn) {
+  char *filename = basename(format("%s", tmpl));
+  char *dot = strrchr(filename, '.');
+  if (dot)
+    *dot = '\0';
+  return format("%s%s", filename, extn);
+}
+
+// A compilation of one input file by a child process. Its stdout and
+// stderr are captured in temporary files, which the driver copies to
+// its own stdout and stderr in the order of the input files, so that
+// the output doesn't depend on the order in which jobs finish. So are
+// its trace events.
+typedef struct {
+  char *input;
+  char *output;
+  pid_t pid;
+  FILE *out;
+  FILE *err;
+  FILE *trace;
+  int status;
+  bool done;
+} Job;
+
+static void start_job(Job *job) {
+  job->out = tmpfile();
+  job->err = tmpfile();
+  job->trace = opt_trace ? tmpfile() : NULL;
+  if (!job->out || !job->err || (opt_trace && !job->trace))
+    error("tmpfile failed: %s", strerror(errno));
+
+  fflush(stdout);
+  fflush(stderr);
+  if (trace_file)
+    fflush(trace_file);
+
+  job->pid = fork();
+  if (job->pid == -1)
+    error("fork failed: %s", strerror(errno));
+
+  if (job->pid == 0) {
+    // Child process
+    dup2(fileno(job->out), STDOUT_FILENO);
+    dup2(fileno(job->err), STDERR_FILENO);
+    trace_file = job->trace;
+    cc1(job->input, job->output);
+    if (trace_file)
+      fflush(trace_file);
+    exit(0);
+  }
+}
+
+// Copies the output of a finished job. Returns true if it succeeded.
+static bool report_job(Job *job) {
+  copy_stream(job->out, stdout);
+  copy_stream(job->err, stderr);
+  if (job->trace)
+    copy_stream(job->trace, trace_file);
+  fflush(stdout);
+  fflush(stderr);
+
+  if (WIFEXITED(job->status) && WEXITSTATUS(job->status) == 0)
+    return true;
+
+  if (WIFSIGNALED(job->status))
+    fprintf(stderr, "%s: compiler killed by signal %d\n", job->input,
+            WTERMSIG(job->status));
+
+  // Don't leave an incomplete output file behind.
+  if (job->output)
+    unlink(job->output);
+  return false;
+}
+
+// Compiles all input files with up to `opt_j` processes at a time.
+// Each job is a fork of this process, so it starts with the macros
+// and other state the driver has already set up.
+static int run_jobs(void) {
+  int njobs = input_paths.len;
+  Job *jobs = calloc(njobs, sizeof(Job));
+
+  for (int i = 0; i < njobs; i++) {
+    jobs[i].input = input_paths.data[i];
+    if (!opt_E)
+      jobs[i].output = replace_extn(input_paths.data[i],
+                                    opt_emit_pch ? ".pch" : opt_emit_ir ? ".ir" : ".s");
+  }
+
+  // Split the CPUs among jobs running at the same time.
+  opt_codegen_threads = MAX(opt_j / njobs, 1);
+
+  int next = 0;
+  int running = 0;
+  int reported = 0;
+  bool ok = true;
+
+  while (reported < njobs) {
+    // Each job holds a few file descriptors until it is reported, so
+    // we don't get too far ahead of the first unfinished job.
+    while (running < opt_j && next < njobs && next - reported < 256) {
+      start_job(&jobs[next++]);
+      running++;
+    }
+
+    int status;
+    pid_t pid = wait(&status);
+    if (pid == -1) {
+      if (errno == EINTR)
+        continue;
+      error("wait failed: %s", strerror(errno));
+    }
+
+    for (int i = 0; i < next; i++) {
+      if (jobs[i].pid == pid) {
+        jobs[i].status = status;
+        jobs[i].done = true;
+        running--;
+        break;
+      }
+    }
+
+    while (reported < njobs && jobs[reported].done)
+      if (!report_job(&jobs[reported++]))
+        ok = false;
+  }
+  return ok ? 0 : 1;
+}
+
+// Compiles files as specified by command line arguments. Called by
+// main() or by the compile server in a fresh fork.
+int run_driver(int argc, char **argv) {
+  parse_args(argc, argv);
+  add_default_include_paths();
+
+  if (opt_trace)
+    trace_file = open_trace(opt_trace);
+
+  int status = 0;
+  if (input_paths.len == 1) {
+    opt_codegen_threads = opt_j;
+    cc1(input_paths.data[0], opt_o);
+  } else {
+    status = run_jobs();
+  }
+
+  if (trace_file)
+    close_trace(trace_file);
+  return status;
+}
+
+int main(int argc, char **argv) {
+  init_macros();
+
+  if (argc >= 2 && !strcmp(argv[1], "--server")) {
+    if (argc != 3)
+      usage(1);
+    return run_server(argv[2]);
+  }
+
+  if (argc >= 2 && !strcmp(argv[1], "--connect")) {
+    if (argc < 3)
+      usage(1);
+    return run_client(argv[2], argc - 3, argv + 3);
+  }
+
+  return run_driver(argc, argv);
 }
@@ -20,23 +20,12 @@
 
 // Scope for local variables, global variables, typedefs
 // or enum constants
-typedef struct VarScope VarScope;
-struct VarScope {
-  VarScope *next;
-  char *name;
+typedef struct {
   Obj *var;
   Type *type_def;
   Type *enum_ty;
   int enum_val;
-};
-
-// Scope for struct, union or enum tags
-typedef struct TagScope TagScope;
-struct TagScope {
-  TagScope *next;
-  char *name;
-  Type *ty;
-};
+} VarScope;
 
 // Represents a block scope.
 typedef struct Scope Scope;
@@ -45,8 +34,8 @@ struct Scope {
 
   // C has two block scopes; one is for variables/typedefs and
   // the other is for struct/union/enum tags.
-  VarScope *vars;
-  TagScope *tags;
+  HashMap vars;
+  HashMap tags;
 };
 
 // Variable attributes such as typedef or extern.
@@ -57,6 +46,16 @@ typedef struct {
   int align;
 } VarAttr;
 
+// The identifier introduced by a declarator and the names of the
+// parameters of a function declarator. They are kept out of Type so
+// that structurally identical types can be shared.
+typedef struct Decl Decl;
+struct Decl {
+  Token *name;     // NULL if omitted
+  Token *name_pos; // Where the name is or would be
+  Decl *params;    // Parameters if a function declarator
+};
+
 // This struct represents a variable initializer. Since initializers
 // can be nested (e.g. `int x[2][2] = {{1, 2}, {3, 4}}`), this struct
 // is a tree data structure.
@@ -94,6 +93,14 @@ static Obj *globals;
 
 static Scope *scope = &(Scope){};
 
+// Number for the next anonymous global variable
+static int unique_id;
+
+// Objects that are needed only while the current function is being
+// parsed and emitted are allocated from this arena. At file scope,
+// it points to `perm_arena`.
+static Arena *arena;
+
 // Points to the function object the parser is currently parsing.
 static Obj *current_fn;
 
@@ -113,8 +120,8 @@ static bool is_typename(Token *tok);
 static Type *declspec(Token **rest, Token *tok, VarAttr *attr);
 static Type *typename(Token **rest, Token *tok);
 static Type *enum_specifier(Token **rest, Token *tok);
-static Type *type_suffix(Token **rest, Token *tok, Type *ty);
-static Type *declarator(Token **rest, Token *tok, Type *ty);
+static Type *type_suffix(Token **rest, Token *tok, Type *ty, Decl *decl);
+static Type *declarator(Token **rest, Token *tok, Type *ty, Decl *decl);
 static Node *declaration(Token **rest, Token *tok, Type *basety, VarAttr *attr);
 static void initializer2(Token **rest, Token *tok, Initializer *init);
 static Initializer *initializer(Token **rest, Token *tok, Type *ty, Type **new_ty);
@@ -129,7 +136,6 @@ static int64_t eval2(Node *node, char **label);
 static int64_t eval_rval(Node *node, char **label);
 static Node *assign(Token **rest, Token *tok);
 static Node *logor(Token **rest, Token *tok);
-static int64_t const_expr(Token **rest, Token *tok);
 static Node *conditional(Token **rest, Token *tok);
 static Node *logand(Token **rest, Token *tok);
 static Node *bitor(Token **rest, Token *tok);
@@ -154,34 +160,77 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr);
 static Token *global_variable(Token *tok, Type *basety, VarAttr *attr);
 
 static void enter_scope(void) {
-  Scope *sc = calloc(1, sizeof(Scope));
+  Scope *sc = arena_alloc(arena, sizeof(Scope));
+  count_mem(MEM_SCOPE, 1, sizeof(Scope));
   sc->next = scope;
   scope = sc;
 }
 
 static void leave_scope(void) {
+  hashmap_free(&scope->vars);
+  hashmap_free(&scope->tags);
   scope = scope->next;
 }
 
 // Find a variable by name.
 static VarScope *find_var(Token *tok) {
-  for (Scope *sc = scope; sc; sc = sc->next)
-    for (VarScope *sc2 = sc->vars; sc2; sc2 = sc2->next)
-      if (equal(tok, sc2->name))
-        return sc2;
+  for (Scope *sc = scope; sc; sc = sc->next) {
+    VarScope *sc2 = hashmap_get2(&sc->vars, tok->name, tok->len);
+    if (sc2)
+      return sc2;
+  }
   return NULL;
 }
 
 static Type *find_tag(Token *tok) {
-  for (Scope *sc = scope; sc; sc = sc->next)
-    for (TagScope *sc2 = sc->tags; sc2; sc2 = sc2->next)
-      if (equal(tok, sc2->name))
-        return sc2->ty;
+  for (Scope *sc = scope; sc; sc = sc->next) {
+    Type *ty = hashmap_get2(&sc->tags, tok->name, tok->len);
+    if (ty)
+      return ty;
+  }
   return NULL;
 }
 
+// Returns the number of bytes needed for a given kind of node.
+static int node_size(NodeKind kind) {
+  switch (kind) {
+  case ND_NULL_EXPR:
+    return offsetof(Node, lhs);
+  case ND_NEG:
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_NOT:
+  case ND_BITNOT:
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+  case ND_CAST:
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+  case ND_VAR:
+  case ND_MEMZERO:
+    return offsetof(Node, rhs);
+  case ND_IF:
+  case ND_COND:
+  case ND_FUNCALL:
+    return offsetof(Node, cont_label);
+  case ND_DO:
+  case ND_CASE:
+    return offsetof(Node, init);
+  case ND_SWITCH:
+  case ND_GOTO:
+  case ND_LABEL:
+    return offsetof(Node, inc);
+  case ND_FOR:
+    return sizeof(Node);
+  default:
+    // Binary operators, ND_MEMBER and ND_NUM
+    return offsetof(Node, els);
+  }
+}
+
 static Node *new_node(NodeKind kind, Token *tok) {
-  Node *node = calloc(1, sizeof(Node));
+  Node *node = arena_alloc(arena, node_size(kind));
+  count_mem(MEM_NODE, 1, node_size(kind));
   node->kind = kind;
   node->tok = tok;
   return node;
@@ -229,24 +278,22 @@ static Node *new_var_node(Obj *var, Token *tok) {
 Node *new_cast(Node *expr, Type *ty) {
   add_type(expr);
 
-  Node *node = calloc(1, sizeof(Node));
-  node->kind = ND_CAST;
-  node->tok = expr->tok;
+  Node *node = new_node(ND_CAST, expr->tok);
   node->lhs = expr;
-  node->ty = copy_type(ty);
+  node->ty = ty;
   return node;
 }
 
 static VarScope *push_scope(char *name) {
-  VarScope *sc = calloc(1, sizeof(VarScope));
-  sc->name = name;
-  sc->next = scope->vars;
-  scope->vars = sc;
+  VarScope *sc = arena_alloc(arena, sizeof(VarScope));
+  count_mem(MEM_SCOPE, 1, sizeof(VarScope));
+  hashmap_put(&scope->vars, name, sc);
   return sc;
 }
 
 static Initializer *new_initializer(Type *ty, bool is_flexible) {
-  Initializer *init = calloc(1, sizeof(Initializer));
+  Initializer *init = arena_alloc(arena, sizeof(Initializer));
+  count_mem(MEM_INIT, 1, sizeof(Initializer));
   init->ty = ty;
 
   if (ty->kind == TY_ARRAY) {
@@ -255,7 +302,8 @@ static Initializer *new_initializer(Type *ty, bool is_flexible) {
       return init;
     }
 
-    init->children = calloc(ty->array_len, sizeof(Initializer *));
+    init->children = arena_alloc(arena, ty->array_len * sizeof(Initializer *));
+    count_mem(MEM_INIT, 0, ty->array_len * sizeof(Initializer *));
     for (int i = 0; i < ty->array_len; i++)
       init->children[i] = new_initializer(ty->base, false);
     return init;
@@ -267,11 +315,13 @@ static Initializer *new_initializer(Type *ty, bool is_flexible) {
     for (Member *mem = ty->members; mem; mem = mem->next)
       len++;
 
-    init->children = calloc(len, sizeof(Initializer *));
+    init->children = arena_alloc(arena, len * sizeof(Initializer *));
+    count_mem(MEM_INIT, 0, len * sizeof(Initializer *));
 
     for (Member *mem = ty->members; mem; mem = mem->next) {
       if (is_flexible && ty->is_flexible && !mem->next) {
-        Initializer *child = calloc(1, sizeof(Initializer));
+        Initializer *child = arena_alloc(arena, sizeof(Initializer));
+        count_mem(MEM_INIT, 1, sizeof(Initializer));
         child->ty = mem->ty;
         child->is_flexible = true;
         init->children[mem->idx] = child;
@@ -285,8 +335,9 @@ static Initializer *new_initializer(Type *ty, bool is_flexible) {
   return init;
 }
 
-static Obj *new_var(char *name, Type *ty) {
-  Obj *var = calloc(1, sizeof(Obj));
+static Obj *new_var(Arena *arena, char *name, Type *ty) {
+  Obj *var = arena_alloc(arena, sizeof(Obj));
+  count_mem(MEM_OBJ, 1, sizeof(Obj));
   var->name = name;
   var->ty = ty;
   var->align = ty->align;
@@ -295,7 +346,7 @@ static Obj *new_var(char *name, Type *ty) {
 }
 
 static Obj *new_lvar(char *name, Type *ty) {
-  Obj *var = new_var(name, ty);
+  Obj *var = new_var(arena, name, ty);
   var->is_local = true;
   var->next = locals;
   locals = var;
@@ -303,7 +354,7 @@ static Obj *new_lvar(char *name, Type *ty) {
 }
 
 static Obj *new_gvar(char *name, Type *ty) {
-  Obj *var = new_var(name, ty);
+  Obj *var = new_var(perm_arena, name, ty);
   var->next = globals;
   var->is_static = true;
   var->is_definition = true;
@@ -312,8 +363,7 @@ static Obj *new_gvar(char *name, Type *ty) {
 }
 
 static char *new_unique_name(void) {
-  static int id = 0;
-  return format(".L..%d", id++);
+  return format(".L..%d", unique_id++);
 }
 
 static Obj *new_anon_gvar(Type *ty) {
@@ -329,7 +379,7 @@ static Obj *new_string_literal(char *p, Type *ty) {
 static char *get_ident(Token *tok) {
   if (tok->kind != TK_IDENT)
     error_tok(tok, "expected an identifier");
-  return strndup(tok->loc, tok->len);
+  return tok->name;
 }
 
 static Type *find_typedef(Token *tok) {
@@ -342,11 +392,7 @@ static Type *find_typedef(Token *tok) {
 }
 
 static void push_tag_scope(Token *tok, Type *ty) {
-  TagScope *sc = calloc(1, sizeof(TagScope));
-  sc->name = strndup(tok->loc, tok->len);
-  sc->ty = ty;
-  sc->next = scope->tags;
-  scope->tags = sc;
+  hashmap_put2(&scope->tags, tok->name, tok->len, ty);
 }
 
 // declspec = ("void" | "_Bool" | "char" | "short" | "int" | "long"
@@ -403,7 +449,7 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
 
       if (attr->is_typedef && attr->is_static + attr->is_extern > 1)
         error_tok(tok, "typedef may not be used together with static or extern");
-      tok = tok->next;
+      tok++;
       continue;
     }
 
@@ -417,7 +463,7 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
     if (equal(tok, "_Alignas")) {
       if (!attr)
         error_tok(tok, "_Alignas is not allowed in this context");
-      tok = skip(tok->next, "(");
+      tok = skip(tok + 1, "(");
 
       if (is_typename(tok))
         attr->align = typename(&tok, tok)->align;
@@ -434,14 +480,14 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
         break;
 
       if (equal(tok, "struct")) {
-        ty = struct_decl(&tok, tok->next);
+        ty = struct_decl(&tok, tok + 1);
       } else if (equal(tok, "union")) {
-        ty = union_decl(&tok, tok->next);
+        ty = union_decl(&tok, tok + 1);
       } else if (equal(tok, "enum")) {
-        ty = enum_specifier(&tok, tok->next);
+        ty = enum_specifier(&tok, tok + 1);
       } else {
         ty = ty2;
-        tok = tok->next;
+        tok++;
       }
 
       counter += OTHER;
@@ -521,7 +567,7 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
       error_tok(tok, "invalid type");
     }
 
-    tok = tok->next;
+    tok++;
   }
 
   *rest = tok;
@@ -530,76 +576,90 @@ static Type *declspec(Token **rest, Token *tok, VarAttr *attr) {
 
 // func-params = ("void" | param ("," param)* ("," "...")?)? ")"
 // param       = declspec declarator
-static Type *func_params(Token **rest, Token *tok, Type *ty) {
-  if (equal(tok, "void") && equal(tok->next, ")")) {
-    *rest = tok->next->next;
-    return func_type(ty);
-  }
-
-  Type head = {};
-  Type *cur = &head;
+//
+// If `decl` is not NULL, parameter names are stored to decl->params.
+static Type *func_params(Token **rest, Token *tok, Type *ty, Decl *decl) {
+  if (equal(tok, "void") && equal(tok + 1, ")")) {
+    *rest = tok + 2;
+    if (decl)
+      decl->params = NULL;
+    return func_type(ty, NULL, 0, false);
+  }
+
+  int cap = 8;
+  Type **params = arena_alloc(arena, cap * sizeof(Type *));
+  Decl *decls = arena_alloc(arena, cap * sizeof(Decl));
+  int nparams = 0;
   bool is_variadic = false;
 
   while (!equal(tok, ")")) {
-    if (cur != &head)
+    if (nparams > 0)
       tok = skip(tok, ",");
 
     if (equal(tok, "...")) {
       is_variadic = true;
-      tok = tok->next;
+      tok++;
       skip(tok, ")");
       break;
     }
 
+    Decl decl2 = {};
     Type *ty2 = declspec(&tok, tok, NULL);
-    ty2 = declarator(&tok, tok, ty2);
+    ty2 = declarator(&tok, tok, ty2, &decl2);
 
     // "array of T" is converted to "pointer to T" only in the parameter
     // context. For example, *argv[] is converted to **argv by this.
-    if (ty2->kind == TY_ARRAY) {
-      Token *name = ty2->name;
+    if (ty2->kind == TY_ARRAY)
       ty2 = pointer_to(ty2->base);
-      ty2->name = name;
-    }
 
-    cur = cur->next = copy_type(ty2);
+    if (nparams == cap) {
+      cap *= 2;
+      Type **p = arena_alloc(arena, cap * sizeof(Type *));
+      Decl *d = arena_alloc(arena, cap * sizeof(Decl));
+      memcpy(p, params, nparams * sizeof(Type *));
+      memcpy(d, decls, nparams * sizeof(Decl));
+      params = p;
+      decls = d;
+    }
+    params[nparams] = ty2;
+    decls[nparams] = decl2;
+    nparams++;
   }
 
-  if (cur == &head)
+  if (nparams == 0)
     is_variadic = true;
 
-  ty = func_type(ty);
-  ty->params = head.next;
-  ty->is_variadic = is_variadic;
-  *rest = tok->next;
-  return ty;
+  if (decl)
+    decl->params = decls;
+  *rest = tok + 1;
+  return func_type(ty, params, nparams, is_variadic);
 }
 
 // array-dimensions = ("static" | "restrict")* const-expr? "]" type-suffix
-static Type *array_dimensions(Token **rest, Token *tok, Type *ty) {
+static Type *array_dimensions(Token **rest, Token *tok, Type *ty, Decl *decl) {
   while (equal(tok, "static") || equal(tok, "restrict"))
-    tok = tok->next;
+    tok++;
 
   if (equal(tok, "]")) {
-    ty = type_suffix(rest, tok->next, ty);
+    ty = type_suffix(rest, tok + 1, ty, decl);
     return array_of(ty, -1);
   }
 
   int sz = const_expr(&tok, tok);
   tok = skip(tok, "]");
-  ty = type_suffix(rest, tok, ty);
+  ty = type_suffix(rest, tok, ty, decl);
   return array_of(ty, sz);
 }
 
 // type-suffix = "(" func-params
 //             | "[" array-dimensions
 //             | ε
-static Type *type_suffix(Token **rest, Token *tok, Type *ty) {
+static Type *type_suffix(Token **rest, Token *tok, Type *ty, Decl *decl) {
   if (equal(tok, "("))
-    return func_params(rest, tok->next, ty);
+    return func_params(rest, tok + 1, ty, decl);
 
   if (equal(tok, "["))
-    return array_dimensions(rest, tok->next, ty);
+    return array_dimensions(rest, tok + 1, ty, decl);
 
   *rest = tok;
   return ty;
@@ -611,23 +671,25 @@ static Type *pointers(Token **rest, Token *tok, Type *ty) {
     ty = pointer_to(ty);
     while (equal(tok, "const") || equal(tok, "volatile") || equal(tok, "restrict") ||
            equal(tok, "__restrict") || equal(tok, "__restrict__"))
-      tok = tok->next;
+      tok++;
   }
   *rest = tok;
   return ty;
 }
 
 // declarator = pointers ("(" ident ")" | "(" declarator ")" | ident) type-suffix
-static Type *declarator(Token **rest, Token *tok, Type *ty) {
+//
+// The declared name is returned via `decl`, which may be NULL if the
+// caller is not interested in it.
+static Type *declarator(Token **rest, Token *tok, Type *ty, Decl *decl) {
   ty = pointers(&tok, tok, ty);
 
   if (equal(tok, "(")) {
     Token *start = tok;
-    Type dummy = {};
-    declarator(&tok, start->next, &dummy);
+    declarator(&tok, start + 1, ty_void, NULL);
     tok = skip(tok, ")");
-    ty = type_suffix(rest, tok, ty);
-    return declarator(&tok, start->next, ty);
+    ty = type_suffix(rest, tok, ty, decl);
+    return declarator(&tok, start + 1, ty, decl);
   }
 
   Token *name = NULL;
@@ -635,12 +697,14 @@ static Type *declarator(Token **rest, Token *tok, Type *ty) {
 
   if (tok->kind == TK_IDENT) {
     name = tok;
-    tok = tok->next;
+    tok++;
   }
 
-  ty = type_suffix(rest, tok, ty);
-  ty->name = name;
-  ty->name_pos = name_pos;
+  ty = type_suffix(rest, tok, ty, decl);
+  if (decl) {
+    decl->name = name;
+    decl->name_pos = name_pos;
+  }
   return ty;
 }
 
@@ -650,14 +714,13 @@ static Type *abstract_declarator(Token **rest, Token *tok, Type *ty) {
 
   if (equal(tok, "(")) {
     Token *start = tok;
-    Type dummy = {};
-    abstract_declarator(&tok, start->next, &dummy);
+    abstract_declarator(&tok, start + 1, ty_void);
     tok = skip(tok, ")");
-    ty = type_suffix(rest, tok, ty);
-    return abstract_declarator(&tok, start->next, ty);
+    ty = type_suffix(rest, tok, ty, NULL);
+    return abstract_declarator(&tok, start + 1, ty);
   }
 
-  return type_suffix(rest, tok, ty);
+  return type_suffix(rest, tok, ty, NULL);
 }
 
 // type-name = declspec abstract-declarator
@@ -667,17 +730,17 @@ static Type *typename(Token **rest, Token *tok) {
 }
 
 static bool is_end(Token *tok) {
-  return equal(tok, "}") || (equal(tok, ",") && equal(tok->next, "}"));
+  return equal(tok, "}") || (equal(tok, ",") && equal(tok + 1, "}"));
 }
 
 static bool consume_end(Token **rest, Token *tok) {
   if (equal(tok, "}")) {
-    *rest = tok->next;
+    *rest = tok + 1;
     return true;
   }
 
-  if (equal(tok, ",") && equal(tok->next, "}")) {
-    *rest = tok->next->next;
+  if (equal(tok, ",") && equal(tok + 1, "}")) {
+    *rest = tok + 2;
     return true;
   }
 
@@ -695,7 +758,7 @@ static Type *enum_specifier(Token **rest, Token *tok) {
   Token *tag = NULL;
   if (tok->kind == TK_IDENT) {
     tag = tok;
-    tok = tok->next;
+    tok++;
   }
 
   if (tag && !equal(tok, "{")) {
@@ -718,10 +781,10 @@ static Type *enum_specifier(Token **rest, Token *tok) {
       tok = skip(tok, ",");
 
     char *name = get_ident(tok);
-    tok = tok->next;
+    tok++;
 
     if (equal(tok, "="))
-      val = const_expr(&tok, tok->next);
+      val = const_expr(&tok, tok + 1);
 
     VarScope *sc = push_scope(name);
     sc->enum_ty = ty;
@@ -743,45 +806,46 @@ static Node *declaration(Token **rest, Token *tok, Type *basety, VarAttr *attr)
     if (i++ > 0)
       tok = skip(tok, ",");
 
-    Type *ty = declarator(&tok, tok, basety);
+    Decl decl = {};
+    Type *ty = declarator(&tok, tok, basety, &decl);
     if (ty->kind == TY_VOID)
       error_tok(tok, "variable declared void");
-    if (!ty->name)
-      error_tok(ty->name_pos, "variable name omitted");
+    if (!decl.name)
+      error_tok(decl.name_pos, "variable name omitted");
 
     if (attr && attr->is_static) {
       // static local variable
       Obj *var = new_anon_gvar(ty);
-      push_scope(get_ident(ty->name))->var = var;
+      push_scope(get_ident(decl.name))->var = var;
       if (equal(tok, "="))
-        gvar_initializer(&tok, tok->next, var);
+        gvar_initializer(&tok, tok + 1, var);
       continue;
     }
 
-    Obj *var = new_lvar(get_ident(ty->name), ty);
+    Obj *var = new_lvar(get_ident(decl.name), ty);
     if (attr && attr->align)
       var->align = attr->align;
 
     if (equal(tok, "=")) {
-      Node *expr = lvar_initializer(&tok, tok->next, var);
+      Node *expr = lvar_initializer(&tok, tok + 1, var);
       cur = cur->next = new_unary(ND_EXPR_STMT, expr, tok);
     }
 
     if (var->ty->size < 0)
-      error_tok(ty->name, "variable has incomplete type");
+      error_tok(decl.name, "variable has incomplete type");
     if (var->ty->kind == TY_VOID)
-      error_tok(ty->name, "variable declared void");
+      error_tok(decl.name, "variable declared void");
   }
 
   Node *node = new_node(ND_BLOCK, tok);
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return node;
 }
 
 static Token *skip_excess_element(Token *tok) {
   if (equal(tok, "{")) {
-    tok = skip_excess_element(tok->next);
+    tok = skip_excess_element(tok + 1);
     return skip(tok, "}");
   }
 
@@ -791,13 +855,14 @@ static Token *skip_excess_element(Token *tok) {
 
 // string-initializer = string-literal
 static void string_initializer(Token **rest, Token *tok, Initializer *init) {
+  Literal *lit = tok_literal(tok);
   if (init->is_flexible)
-    *init = *new_initializer(array_of(init->ty->base, tok->ty->array_len), false);
+    *init = *new_initializer(array_of(init->ty->base, lit->ty->array_len), false);
 
-  int len = MIN(init->ty->array_len, tok->ty->array_len);
+  int len = MIN(init->ty->array_len, lit->ty->array_len);
   for (int i = 0; i < len; i++)
-    init->children[i]->expr = new_num(tok->str[i], tok);
-  *rest = tok->next;
+    init->children[i]->expr = new_num(lit->str[i], tok);
+  *rest = tok + 1;
 }
 
 static int count_array_init_elements(Token *tok, Type *ty) {
@@ -883,7 +948,7 @@ static void union_initializer(Token **rest, Token *tok, Initializer *init) {
   // Unlike structs, union initializers take only one initializer,
   // and that initializes the first union member.
   if (equal(tok, "{")) {
-    initializer2(&tok, tok->next, init->children[0]);
+    initializer2(&tok, tok + 1, init->children[0]);
     consume(&tok, tok, ",");
     *rest = skip(tok, "}");
   } else {
@@ -936,7 +1001,7 @@ static void initializer2(Token **rest, Token *tok, Initializer *init) {
   if (equal(tok, "{")) {
     // An initializer for a scalar variable can be surrounded by
     // braces. E.g. `int x = {3};`. Handle that case.
-    initializer2(&tok, tok->next, init);
+    initializer2(&tok, tok + 1, init);
     *rest = skip(tok, "}");
     return;
   }
@@ -950,7 +1015,7 @@ static Type *copy_struct_type(Type *ty) {
   Member head = {};
   Member *cur = &head;
   for (Member *mem = ty->members; mem; mem = mem->next) {
-    Member *m = calloc(1, sizeof(Member));
+    Member *m = arena_alloc(perm_arena, sizeof(Member));
     *m = *mem;
     cur = cur->next = m;
   }
@@ -1097,7 +1162,7 @@ write_gvar_data(Relocation *cur, Initializer *init, Type *ty, char *buf, int off
     return cur;
   }
 
-  Relocation *rel = calloc(1, sizeof(Relocation));
+  Relocation *rel = arena_alloc(perm_arena, sizeof(Relocation));
   rel->offset = offset;
   rel->label = label;
   rel->addend = val;
@@ -1113,7 +1178,7 @@ static void gvar_initializer(Token **rest, Token *tok, Obj *var) {
   Initializer *init = initializer(rest, tok, var->ty, &var->ty);
 
   Relocation head = {};
-  char *buf = calloc(1, var->ty->size);
+  char *buf = arena_alloc(perm_arena, var->ty->size);
   write_gvar_data(&head, init, var->ty, buf, 0);
   var->init_data = buf;
   var->rel = head.next;
@@ -1151,10 +1216,10 @@ static bool is_typename(Token *tok) {
 static Node *stmt(Token **rest, Token *tok) {
   if (equal(tok, "return")) {
     Node *node = new_node(ND_RETURN, tok);
-    if (consume(rest, tok->next, ";"))
+    if (consume(rest, tok + 1, ";"))
       return node;
 
-    Node *exp = expr(&tok, tok->next);
+    Node *exp = expr(&tok, tok + 1);
     *rest = skip(tok, ";");
 
     add_type(exp);
@@ -1164,19 +1229,19 @@ static Node *stmt(Token **rest, Token *tok) {
 
   if (equal(tok, "if")) {
     Node *node = new_node(ND_IF, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, "(");
     node->cond = expr(&tok, tok);
     tok = skip(tok, ")");
     node->then = stmt(&tok, tok);
     if (equal(tok, "else"))
-      node->els = stmt(&tok, tok->next);
+      node->els = stmt(&tok, tok + 1);
     *rest = tok;
     return node;
   }
 
   if (equal(tok, "switch")) {
     Node *node = new_node(ND_SWITCH, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, "(");
     node->cond = expr(&tok, tok);
     tok = skip(tok, ")");
 
@@ -1198,7 +1263,7 @@ static Node *stmt(Token **rest, Token *tok) {
       error_tok(tok, "stray case");
 
     Node *node = new_node(ND_CASE, tok);
-    int val = const_expr(&tok, tok->next);
+    int val = const_expr(&tok, tok + 1);
     tok = skip(tok, ":");
     node->label = new_unique_name();
     node->lhs = stmt(rest, tok);
@@ -1213,7 +1278,7 @@ static Node *stmt(Token **rest, Token *tok) {
       error_tok(tok, "stray default");
 
     Node *node = new_node(ND_CASE, tok);
-    tok = skip(tok->next, ":");
+    tok = skip(tok + 1, ":");
     node->label = new_unique_name();
     node->lhs = stmt(rest, tok);
     current_switch->default_case = node;
@@ -1222,7 +1287,7 @@ static Node *stmt(Token **rest, Token *tok) {
 
   if (equal(tok, "for")) {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, "(");
 
     enter_scope();
 
@@ -1256,7 +1321,7 @@ static Node *stmt(Token **rest, Token *tok) {
 
   if (equal(tok, "while")) {
     Node *node = new_node(ND_FOR, tok);
-    tok = skip(tok->next, "(");
+    tok = skip(tok + 1, "(");
     node->cond = expr(&tok, tok);
     tok = skip(tok, ")");
 
@@ -1280,7 +1345,7 @@ static Node *stmt(Token **rest, Token *tok) {
     brk_label = node->brk_label = new_unique_name();
     cont_label = node->cont_label = new_unique_name();
 
-    node->then = stmt(&tok, tok->next);
+    node->then = stmt(&tok, tok + 1);
 
     brk_label = brk;
     cont_label = cont;
@@ -1295,10 +1360,10 @@ static Node *stmt(Token **rest, Token *tok) {
 
   if (equal(tok, "goto")) {
     Node *node = new_node(ND_GOTO, tok);
-    node->label = get_ident(tok->next);
+    node->label = get_ident(tok + 1);
     node->goto_next = gotos;
     gotos = node;
-    *rest = skip(tok->next->next, ";");
+    *rest = skip(tok + 2, ";");
     return node;
   }
 
@@ -1307,7 +1372,7 @@ static Node *stmt(Token **rest, Token *tok) {
       error_tok(tok, "stray break");
     Node *node = new_node(ND_GOTO, tok);
     node->unique_label = brk_label;
-    *rest = skip(tok->next, ";");
+    *rest = skip(tok + 1, ";");
     return node;
   }
 
@@ -1316,22 +1381,22 @@ static Node *stmt(Token **rest, Token *tok) {
       error_tok(tok, "stray continue");
     Node *node = new_node(ND_GOTO, tok);
     node->unique_label = cont_label;
-    *rest = skip(tok->next, ";");
+    *rest = skip(tok + 1, ";");
     return node;
   }
 
-  if (tok->kind == TK_IDENT && equal(tok->next, ":")) {
+  if (tok->kind == TK_IDENT && equal(tok + 1, ":")) {
     Node *node = new_node(ND_LABEL, tok);
-    node->label = strndup(tok->loc, tok->len);
+    node->label = tok->name;
     node->unique_label = new_unique_name();
-    node->lhs = stmt(rest, tok->next->next);
+    node->lhs = stmt(rest, tok + 2);
     node->goto_next = labels;
     labels = node;
     return node;
   }
 
   if (equal(tok, "{"))
-    return compound_stmt(rest, tok->next);
+    return compound_stmt(rest, tok + 1);
 
   return expr_stmt(rest, tok);
 }
@@ -1345,7 +1410,7 @@ static Node *compound_stmt(Token **rest, Token *tok) {
   enter_scope();
 
   while (!equal(tok, "}")) {
-    if (is_typename(tok) && !equal(tok->next, ":")) {
+    if (is_typename(tok) && !equal(tok + 1, ":")) {
       VarAttr attr = {};
       Type *basety = declspec(&tok, tok, &attr);
 
@@ -1374,14 +1439,14 @@ static Node *compound_stmt(Token **rest, Token *tok) {
   leave_scope();
 
   node->body = head.next;
-  *rest = tok->next;
+  *rest = tok + 1;
   return node;
 }
 
 // expr-stmt = expr? ";"
 static Node *expr_stmt(Token **rest, Token *tok) {
   if (equal(tok, ";")) {
-    *rest = tok->next;
+    *rest = tok + 1;
     return new_node(ND_BLOCK, tok);
   }
 
@@ -1396,7 +1461,7 @@ static Node *expr(Token **rest, Token *tok) {
   Node *node = assign(&tok, tok);
 
   if (equal(tok, ","))
-    return new_binary(ND_COMMA, node, expr(rest, tok->next), tok);
+    return new_binary(ND_COMMA, node, expr(rest, tok + 1), tok);
 
   *rest = tok;
   return node;
@@ -1517,7 +1582,12 @@ static int64_t eval_rval(Node *node, char **label) {
   error_tok(node->tok, "invalid initializer");
 }
 
-static int64_t const_expr(Token **rest, Token *tok) {
+// This is also used by the preprocessor to evaluate #if, which
+// happens before parse() is called.
+int64_t const_expr(Token **rest, Token *tok) {
+  if (!arena)
+    arena = perm_arena;
+
   Node *node = conditional(rest, tok);
   return eval(node);
 }
@@ -1553,37 +1623,37 @@ static Node *assign(Token **rest, Token *tok) {
   Node *node = conditional(&tok, tok);
 
   if (equal(tok, "="))
-    return new_binary(ND_ASSIGN, node, assign(rest, tok->next), tok);
+    return new_binary(ND_ASSIGN, node, assign(rest, tok + 1), tok);
 
   if (equal(tok, "+="))
-    return to_assign(new_add(node, assign(rest, tok->next), tok));
+    return to_assign(new_add(node, assign(rest, tok + 1), tok));
 
   if (equal(tok, "-="))
-    return to_assign(new_sub(node, assign(rest, tok->next), tok));
+    return to_assign(new_sub(node, assign(rest, tok + 1), tok));
 
   if (equal(tok, "*="))
-    return to_assign(new_binary(ND_MUL, node, assign(rest, tok->next), tok));
+    return to_assign(new_binary(ND_MUL, node, assign(rest, tok + 1), tok));
 
   if (equal(tok, "/="))
-    return to_assign(new_binary(ND_DIV, node, assign(rest, tok->next), tok));
+    return to_assign(new_binary(ND_DIV, node, assign(rest, tok + 1), tok));
 
   if (equal(tok, "%="))
-    return to_assign(new_binary(ND_MOD, node, assign(rest, tok->next), tok));
+    return to_assign(new_binary(ND_MOD, node, assign(rest, tok + 1), tok));
 
   if (equal(tok, "&="))
-    return to_assign(new_binary(ND_BITAND, node, assign(rest, tok->next), tok));
+    return to_assign(new_binary(ND_BITAND, node, assign(rest, tok + 1), tok));
 
   if (equal(tok, "|="))
-    return to_assign(new_binary(ND_BITOR, node, assign(rest, tok->next), tok));
+    return to_assign(new_binary(ND_BITOR, node, assign(rest, tok + 1), tok));
 
   if (equal(tok, "^="))
-    return to_assign(new_binary(ND_BITXOR, node, assign(rest, tok->next), tok));
+    return to_assign(new_binary(ND_BITXOR, node, assign(rest, tok + 1), tok));
 
   if (equal(tok, "<<="))
-    return to_assign(new_binary(ND_SHL, node, assign(rest, tok->next), tok));
+    return to_assign(new_binary(ND_SHL, node, assign(rest, tok + 1), tok));
 
   if (equal(tok, ">>="))
-    return to_assign(new_binary(ND_SHR, node, assign(rest, tok->next), tok));
+    return to_assign(new_binary(ND_SHR, node, assign(rest, tok + 1), tok));
 
   *rest = tok;
   return node;
@@ -1600,7 +1670,7 @@ static Node *conditional(Token **rest, Token *tok) {
 
   Node *node = new_node(ND_COND, tok);
   node->cond = cond;
-  node->then = expr(&tok, tok->next);
+  node->then = expr(&tok, tok + 1);
   tok = skip(tok, ":");
   node->els = conditional(rest, tok);
   return node;
@@ -1611,7 +1681,7 @@ static Node *logor(Token **rest, Token *tok) {
   Node *node = logand(&tok, tok);
   while (equal(tok, "||")) {
     Token *start = tok;
-    node = new_binary(ND_LOGOR, node, logand(&tok, tok->next), start);
+    node = new_binary(ND_LOGOR, node, logand(&tok, tok + 1), start);
   }
   *rest = tok;
   return node;
@@ -1622,7 +1692,7 @@ static Node *logand(Token **rest, Token *tok) {
   Node *node = bitor(&tok, tok);
   while (equal(tok, "&&")) {
     Token *start = tok;
-    node = new_binary(ND_LOGAND, node, bitor(&tok, tok->next), start);
+    node = new_binary(ND_LOGAND, node, bitor(&tok, tok + 1), start);
   }
   *rest = tok;
   return node;
@@ -1633,7 +1703,7 @@ static Node *bitor(Token **rest, Token *tok) {
   Node *node = bitxor(&tok, tok);
   while (equal(tok, "|")) {
     Token *start = tok;
-    node = new_binary(ND_BITOR, node, bitxor(&tok, tok->next), start);
+    node = new_binary(ND_BITOR, node, bitxor(&tok, tok + 1), start);
   }
   *rest = tok;
   return node;
@@ -1644,7 +1714,7 @@ static Node *bitxor(Token **rest, Token *tok) {
   Node *node = bitand(&tok, tok);
   while (equal(tok, "^")) {
     Token *start = tok;
-    node = new_binary(ND_BITXOR, node, bitand(&tok, tok->next), start);
+    node = new_binary(ND_BITXOR, node, bitand(&tok, tok + 1), start);
   }
   *rest = tok;
   return node;
@@ -1655,7 +1725,7 @@ static Node *bitand(Token **rest, Token *tok) {
   Node *node = equality(&tok, tok);
   while (equal(tok, "&")) {
     Token *start = tok;
-    node = new_binary(ND_BITAND, node, equality(&tok, tok->next), start);
+    node = new_binary(ND_BITAND, node, equality(&tok, tok + 1), start);
   }
   *rest = tok;
   return node;
@@ -1669,12 +1739,12 @@ static Node *equality(Token **rest, Token *tok) {
     Token *start = tok;
 
     if (equal(tok, "==")) {
-      node = new_binary(ND_EQ, node, relational(&tok, tok->next), start);
+      node = new_binary(ND_EQ, node, relational(&tok, tok + 1), start);
       continue;
     }
 
     if (equal(tok, "!=")) {
-      node = new_binary(ND_NE, node, relational(&tok, tok->next), start);
+      node = new_binary(ND_NE, node, relational(&tok, tok + 1), start);
       continue;
     }
 
@@ -1691,22 +1761,22 @@ static Node *relational(Token **rest, Token *tok) {
     Token *start = tok;
 
     if (equal(tok, "<")) {
-      node = new_binary(ND_LT, node, shift(&tok, tok->next), start);
+      node = new_binary(ND_LT, node, shift(&tok, tok + 1), start);
       continue;
     }
 
     if (equal(tok, "<=")) {
-      node = new_binary(ND_LE, node, shift(&tok, tok->next), start);
+      node = new_binary(ND_LE, node, shift(&tok, tok + 1), start);
       continue;
     }
 
     if (equal(tok, ">")) {
-      node = new_binary(ND_LT, shift(&tok, tok->next), node, start);
+      node = new_binary(ND_LT, shift(&tok, tok + 1), node, start);
       continue;
     }
 
     if (equal(tok, ">=")) {
-      node = new_binary(ND_LE, shift(&tok, tok->next), node, start);
+      node = new_binary(ND_LE, shift(&tok, tok + 1), node, start);
       continue;
     }
 
@@ -1723,12 +1793,12 @@ static Node *shift(Token **rest, Token *tok) {
     Token *start = tok;
 
     if (equal(tok, "<<")) {
-      node = new_binary(ND_SHL, node, add(&tok, tok->next), start);
+      node = new_binary(ND_SHL, node, add(&tok, tok + 1), start);
       continue;
     }
 
     if (equal(tok, ">>")) {
-      node = new_binary(ND_SHR, node, add(&tok, tok->next), start);
+      node = new_binary(ND_SHR, node, add(&tok, tok + 1), start);
       continue;
     }
 
@@ -1801,12 +1871,12 @@ static Node *add(Token **rest, Token *tok) {
     Token *start = tok;
 
     if (equal(tok, "+")) {
-      node = new_add(node, mul(&tok, tok->next), start);
+      node = new_add(node, mul(&tok, tok + 1), start);
       continue;
     }
 
     if (equal(tok, "-")) {
-      node = new_sub(node, mul(&tok, tok->next), start);
+      node = new_sub(node, mul(&tok, tok + 1), start);
       continue;
     }
 
@@ -1823,17 +1893,17 @@ static Node *mul(Token **rest, Token *tok) {
     Token *start = tok;
 
     if (equal(tok, "*")) {
-      node = new_binary(ND_MUL, node, cast(&tok, tok->next), start);
+      node = new_binary(ND_MUL, node, cast(&tok, tok + 1), start);
       continue;
     }
 
     if (equal(tok, "/")) {
-      node = new_binary(ND_DIV, node, cast(&tok, tok->next), start);
+      node = new_binary(ND_DIV, node, cast(&tok, tok + 1), start);
       continue;
     }
 
     if (equal(tok, "%")) {
-      node = new_binary(ND_MOD, node, cast(&tok, tok->next), start);
+      node = new_binary(ND_MOD, node, cast(&tok, tok + 1), start);
       continue;
     }
 
@@ -1844,9 +1914,9 @@ static Node *mul(Token **rest, Token *tok) {
 
 // cast = "(" type-name ")" cast | unary
 static Node *cast(Token **rest, Token *tok) {
-  if (equal(tok, "(") && is_typename(tok->next)) {
+  if (equal(tok, "(") && is_typename(tok + 1)) {
     Token *start = tok;
-    Type *ty = typename(&tok, tok->next);
+    Type *ty = typename(&tok, tok + 1);
     tok = skip(tok, ")");
 
     // compound literal
@@ -1867,30 +1937,30 @@ static Node *cast(Token **rest, Token *tok) {
 //       | postfix
 static Node *unary(Token **rest, Token *tok) {
   if (equal(tok, "+"))
-    return cast(rest, tok->next);
+    return cast(rest, tok + 1);
 
   if (equal(tok, "-"))
-    return new_unary(ND_NEG, cast(rest, tok->next), tok);
+    return new_unary(ND_NEG, cast(rest, tok + 1), tok);
 
   if (equal(tok, "&"))
-    return new_unary(ND_ADDR, cast(rest, tok->next), tok);
+    return new_unary(ND_ADDR, cast(rest, tok + 1), tok);
 
   if (equal(tok, "*"))
-    return new_unary(ND_DEREF, cast(rest, tok->next), tok);
+    return new_unary(ND_DEREF, cast(rest, tok + 1), tok);
 
   if (equal(tok, "!"))
-    return new_unary(ND_NOT, cast(rest, tok->next), tok);
+    return new_unary(ND_NOT, cast(rest, tok + 1), tok);
 
   if (equal(tok, "~"))
-    return new_unary(ND_BITNOT, cast(rest, tok->next), tok);
+    return new_unary(ND_BITNOT, cast(rest, tok + 1), tok);
 
   // Read ++i as i+=1
   if (equal(tok, "++"))
-    return to_assign(new_add(unary(rest, tok->next), new_num(1, tok), tok));
+    return to_assign(new_add(unary(rest, tok + 1), new_num(1, tok), tok));
 
   // Read --i as i-=1
   if (equal(tok, "--"))
-    return to_assign(new_sub(unary(rest, tok->next), new_num(1, tok), tok));
+    return to_assign(new_sub(unary(rest, tok + 1), new_num(1, tok), tok));
 
   return postfix(rest, tok);
 }
@@ -1911,9 +1981,10 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
         tok = skip(tok, ",");
       first = false;
 
-      Member *mem = calloc(1, sizeof(Member));
-      mem->ty = declarator(&tok, tok, basety);
-      mem->name = mem->ty->name;
+      Decl decl = {};
+      Member *mem = arena_alloc(perm_arena, sizeof(Member));
+      mem->ty = declarator(&tok, tok, basety, &decl);
+      mem->name = decl.name;
       mem->idx = idx++;
       mem->align = attr.align ? attr.align : mem->ty->align;
       cur = cur->next = mem;
@@ -1928,7 +1999,7 @@ static void struct_members(Token **rest, Token *tok, Type *ty) {
     ty->is_flexible = true;
   }
 
-  *rest = tok->next;
+  *rest = tok + 1;
   ty->members = head.next;
 }
 
@@ -1938,7 +2009,7 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
   Token *tag = NULL;
   if (tok->kind == TK_IDENT) {
     tag = tok;
-    tok = tok->next;
+    tok++;
   }
 
   if (tag && !equal(tok, "{")) {
@@ -1963,11 +2034,10 @@ static Type *struct_union_decl(Token **rest, Token *tok) {
   if (tag) {
     // If this is a redefinition, overwrite a previous type.
     // Otherwise, register the struct type.
-    for (TagScope *sc = scope->tags; sc; sc = sc->next) {
-      if (equal(tag, sc->name)) {
-        *sc->ty = *ty;
-        return sc->ty;
-      }
+    Type *ty2 = hashmap_get2(&scope->tags, tag->name, tag->len);
+    if (ty2) {
+      *ty2 = *ty;
+      return ty2;
     }
 
     push_tag_scope(tag, ty);
@@ -2021,8 +2091,7 @@ static Type *union_decl(Token **rest, Token *tok) {
 
 static Member *get_struct_member(Type *ty, Token *tok) {
   for (Member *mem = ty->members; mem; mem = mem->next)
-    if (mem->name->len == tok->len &&
-        !strncmp(mem->name->loc, tok->loc, tok->len))
+    if (mem->name->name == tok->name)
       return mem;
   error_tok(tok, "no such member");
 }
@@ -2048,10 +2117,10 @@ static Node *new_inc_dec(Node *node, Token *tok, int addend) {
 // postfix = "(" type-name ")" "{" initializer-list "}"
 //         | primary ("[" expr "]" | "." ident | "->" ident | "++" | "--")*
 static Node *postfix(Token **rest, Token *tok) {
-  if (equal(tok, "(") && is_typename(tok->next)) {
+  if (equal(tok, "(") && is_typename(tok + 1)) {
     // Compound literal
     Token *start = tok;
-    Type *ty = typename(&tok, tok->next);
+    Type *ty = typename(&tok, tok + 1);
     tok = skip(tok, ")");
 
     if (scope->next == NULL) {
@@ -2072,35 +2141,35 @@ static Node *postfix(Token **rest, Token *tok) {
     if (equal(tok, "[")) {
       // x[y] is short for *(x+y)
       Token *start = tok;
-      Node *idx = expr(&tok, tok->next);
+      Node *idx = expr(&tok, tok + 1);
       tok = skip(tok, "]");
       node = new_unary(ND_DEREF, new_add(node, idx, start), start);
       continue;
     }
 
     if (equal(tok, ".")) {
-      node = struct_ref(node, tok->next);
-      tok = tok->next->next;
+      node = struct_ref(node, tok + 1);
+      tok += 2;
       continue;
     }
 
     if (equal(tok, "->")) {
       // x->y is short for (*x).y
       node = new_unary(ND_DEREF, node, tok);
-      node = struct_ref(node, tok->next);
-      tok = tok->next->next;
+      node = struct_ref(node, tok + 1);
+      tok += 2;
       continue;
     }
 
     if (equal(tok, "++")) {
       node = new_inc_dec(node, tok, 1);
-      tok = tok->next;
+      tok++;
       continue;
     }
 
     if (equal(tok, "--")) {
       node = new_inc_dec(node, tok, -1);
-      tok = tok->next;
+      tok++;
       continue;
     }
 
@@ -2112,7 +2181,7 @@ static Node *postfix(Token **rest, Token *tok) {
 // funcall = ident "(" (assign ("," assign)*)? ")"
 static Node *funcall(Token **rest, Token *tok) {
   Token *start = tok;
-  tok = tok->next->next;
+  tok += 2;
 
   VarScope *sc = find_var(start);
   if (!sc)
@@ -2121,7 +2190,7 @@ static Node *funcall(Token **rest, Token *tok) {
     error_tok(start, "not a function");
 
   Type *ty = sc->var->ty;
-  Type *param_ty = ty->params;
+  int nparams = 0;
 
   Node head = {};
   Node *cur = &head;
@@ -2133,26 +2202,26 @@ static Node *funcall(Token **rest, Token *tok) {
     Node *arg = assign(&tok, tok);
     add_type(arg);
 
-    if (!param_ty && !ty->is_variadic)
+    if (nparams == ty->nparams && !ty->is_variadic)
       error_tok(tok, "too many arguments");
 
-    if (param_ty) {
+    if (nparams < ty->nparams) {
+      Type *param_ty = ty->params[nparams++];
       if (param_ty->kind == TY_STRUCT || param_ty->kind == TY_UNION)
         error_tok(arg->tok, "passing struct or union is not supported yet");
       arg = new_cast(arg, param_ty);
-      param_ty = param_ty->next;
     }
 
     cur = cur->next = arg;
   }
 
-  if (param_ty)
+  if (nparams < ty->nparams)
     error_tok(tok, "too few arguments");
 
   *rest = skip(tok, ")");
 
   Node *node = new_node(ND_FUNCALL, start);
-  node->funcname = strndup(start->loc, start->len);
+  node->funcname = start->name;
   node->func_ty = ty;
   node->ty = ty->return_ty;
   node->args = head.next;
@@ -2171,47 +2240,47 @@ static Node *funcall(Token **rest, Token *tok) {
 static Node *primary(Token **rest, Token *tok) {
   Token *start = tok;
 
-  if (equal(tok, "(") && equal(tok->next, "{")) {
+  if (equal(tok, "(") && equal(tok + 1, "{")) {
     // This is a GNU statement expresssion.
     Node *node = new_node(ND_STMT_EXPR, tok);
-    node->body = compound_stmt(&tok, tok->next->next)->body;
+    node->body = compound_stmt(&tok, tok + 2)->body;
     *rest = skip(tok, ")");
     return node;
   }
 
   if (equal(tok, "(")) {
-    Node *node = expr(&tok, tok->next);
+    Node *node = expr(&tok, tok + 1);
     *rest = skip(tok, ")");
     return node;
   }
 
-  if (equal(tok, "sizeof") && equal(tok->next, "(") && is_typename(tok->next->next)) {
-    Type *ty = typename(&tok, tok->next->next);
+  if (equal(tok, "sizeof") && equal(tok + 1, "(") && is_typename(tok + 2)) {
+    Type *ty = typename(&tok, tok + 2);
     *rest = skip(tok, ")");
     return new_ulong(ty->size, start);
   }
 
   if (equal(tok, "sizeof")) {
-    Node *node = unary(rest, tok->next);
+    Node *node = unary(rest, tok + 1);
     add_type(node);
     return new_ulong(node->ty->size, tok);
   }
 
-  if (equal(tok, "_Alignof") && equal(tok->next, "(") && is_typename(tok->next->next)) {
-    Type *ty = typename(&tok, tok->next->next);
+  if (equal(tok, "_Alignof") && equal(tok + 1, "(") && is_typename(tok + 2)) {
+    Type *ty = typename(&tok, tok + 2);
     *rest = skip(tok, ")");
     return new_ulong(ty->align, tok);
   }
 
   if (equal(tok, "_Alignof")) {
-    Node *node = unary(rest, tok->next);
+    Node *node = unary(rest, tok + 1);
     add_type(node);
     return new_ulong(node->ty->align, tok);
   }
 
   if (tok->kind == TK_IDENT) {
     // Function call
-    if (equal(tok->next, "("))
+    if (equal(tok + 1, "("))
       return funcall(rest, tok);
 
     // Variable or enum constant
@@ -2225,27 +2294,29 @@ static Node *primary(Token **rest, Token *tok) {
     else
       node = new_num(sc->enum_val, tok);
 
-    *rest = tok->next;
+    *rest = tok + 1;
     return node;
   }
 
   if (tok->kind == TK_STR) {
-    Obj *var = new_string_literal(tok->str, tok->ty);
-    *rest = tok->next;
+    Literal *lit = tok_literal(tok);
+    Obj *var = new_string_literal(lit->str, lit->ty);
+    *rest = tok + 1;
     return new_var_node(var, tok);
   }
 
   if (tok->kind == TK_NUM) {
+    Literal *lit = tok_literal(tok);
     Node *node;
-    if (is_flonum(tok->ty)) {
+    if (is_flonum(lit->ty)) {
       node = new_node(ND_NUM, tok);
-      node->fval = tok->fval;
+      node->fval = lit->fval;
     } else {
-      node = new_num(tok->val, tok);
+      node = new_num(lit->val, tok);
     }
 
-    node->ty = tok->ty;
-    *rest = tok->next;
+    node->ty = lit->ty;
+    *rest = tok + 1;
     return node;
   }
 
@@ -2260,20 +2331,20 @@ static Token *parse_typedef(Token *tok, Type *basety) {
       tok = skip(tok, ",");
     first = false;
 
-    Type *ty = declarator(&tok, tok, basety);
-    if (!ty->name)
-      error_tok(ty->name_pos, "typedef name omitted");
-    push_scope(get_ident(ty->name))->type_def = ty;
+    Decl decl = {};
+    Type *ty = declarator(&tok, tok, basety, &decl);
+    if (!decl.name)
+      error_tok(decl.name_pos, "typedef name omitted");
+    push_scope(get_ident(decl.name))->type_def = ty;
   }
   return tok;
 }
 
-static void create_param_lvars(Type *param) {
-  if (param) {
-    create_param_lvars(param->next);
-    if (!param->name)
-      error_tok(param->name_pos, "parameter name omitted");
-    new_lvar(get_ident(param->name), param);
+static void create_param_lvars(Type *ty, Decl *params) {
+  for (int i = ty->nparams - 1; i >= 0; i--) {
+    if (!params[i].name)
+      error_tok(params[i].name_pos, "parameter name omitted");
+    new_lvar(get_ident(params[i].name), ty->params[i]);
   }
 }
 
@@ -2285,25 +2356,26 @@ static void create_param_lvars(Type *param) {
 static void resolve_goto_labels(void) {
   for (Node *x = gotos; x; x = x->goto_next) {
     for (Node *y = labels; y; y = y->goto_next) {
-      if (!strcmp(x->label, y->label)) {
+      if (x->label == y->label) {
         x->unique_label = y->unique_label;
         break;
       }
     }
 
     if (x->unique_label == NULL)
-      error_tok(x->tok->next, "use of undeclared label");
+      error_tok(x->tok + 1, "use of undeclared label");
   }
 
   gotos = labels = NULL;
 }
 
 static Token *function(Token *tok, Type *basety, VarAttr *attr) {
-  Type *ty = declarator(&tok, tok, basety);
-  if (!ty->name)
-    error_tok(ty->name_pos, "function name omitted");
+  Decl decl = {};
+  Type *ty = declarator(&tok, tok, basety, &decl);
+  if (!decl.name)
+    error_tok(decl.name_pos, "function name omitted");
 
-  Obj *fn = new_gvar(get_ident(ty->name), ty);
+  Obj *fn = new_gvar(get_ident(decl.name), ty);
   fn->is_function = true;
   fn->is_definition = !consume(&tok, tok, ";");
   fn->is_static = attr->is_static;
@@ -2313,11 +2385,12 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
 
   current_fn = fn;
   locals = NULL;
+  arena = fn->arena = new_arena();
   enter_scope();
   if (ty->is_variadic)
     fn->va_area = new_lvar("__va_area__", array_of(ty_char, 64));
 
-  create_param_lvars(ty->params);
+  create_param_lvars(ty, decl.params);
   fn->params = locals;
 
   tok = skip(tok, "{");
@@ -2325,6 +2398,7 @@ static Token *function(Token *tok, Type *basety, VarAttr *attr) {
   fn->locals = locals;
   leave_scope();
   resolve_goto_labels();
+  arena = perm_arena;
   return tok;
 }
 
@@ -2336,18 +2410,19 @@ static Token *global_variable(Token *tok, Type *basety, VarAttr *attr) {
       tok = skip(tok, ",");
     first = false;
 
-    Type *ty = declarator(&tok, tok, basety);
-    if (!ty->name)
-      error_tok(ty->name_pos, "variable name omitted");
+    Decl decl = {};
+    Type *ty = declarator(&tok, tok, basety, &decl);
+    if (!decl.name)
+      error_tok(decl.name_pos, "variable name omitted");
 
-    Obj *var = new_gvar(get_ident(ty->name), ty);
+    Obj *var = new_gvar(get_ident(decl.name), ty);
     var->is_definition = !attr->is_extern;
     var->is_static = attr->is_static;
     if (attr->align)
       var->align = attr->align;
 
     if (equal(tok, "="))
-      gvar_initializer(&tok, tok->next, var);
+      gvar_initializer(&tok, tok + 1, var);
   }
   return tok;
 }
@@ -2358,33 +2433,165 @@ static bool is_function(Token *tok) {
   if (equal(tok, ";"))
     return false;
 
-  Type dummy = {};
-  Type *ty = declarator(&tok, tok, &dummy);
+  Type *ty = declarator(&tok, tok, ty_void, NULL);
   return ty->kind == TY_FUNC;
 }
 
 // program = (typedef | function-definition | global-variable)*
+// Writes the file scope to a precompiled header. The objects in
+// `globals` are referred to by their position in the list.
+void save_globals(PchWriter *w) {
+  for (Obj *var = globals; var; var = var->next) {
+    if (var->body)
+      error("%s: a function definition cannot be precompiled", var->name);
+
+    pch_write_int(w, 1);
+    pch_add_ref(w, var);
+    pch_write_str(w, var->name);
+    pch_write_type(w, var->ty);
+    pch_write_int(w, var->align);
+    pch_write_int(w, var->is_function);
+    pch_write_int(w, var->is_definition);
+    pch_write_int(w, var->is_static);
+
+    pch_write_int(w, var->init_data != NULL);
+    if (var->init_data)
+      pch_write_bytes(w, var->init_data, var->ty->size);
+
+    for (Relocation *rel = var->rel; rel; rel = rel->next) {
+      pch_write_int(w, 1);
+      pch_write_int(w, rel->offset);
+      pch_write_str(w, rel->label);
+      pch_write_int(w, rel->addend);
+    }
+    pch_write_int(w, 0);
+  }
+  pch_write_int(w, 0);
+
+  for (HashEntry *ent = hashmap_next(&scope->vars, NULL); ent;
+       ent = hashmap_next(&scope->vars, ent)) {
+    VarScope *sc = ent->val;
+    pch_write_int(w, 1);
+    pch_write_str(w, ent->key);
+    pch_write_ref(w, sc->var);
+    pch_write_type(w, sc->type_def);
+    pch_write_type(w, sc->enum_ty);
+    pch_write_int(w, sc->enum_val);
+  }
+  pch_write_int(w, 0);
+
+  for (HashEntry *ent = hashmap_next(&scope->tags, NULL); ent;
+       ent = hashmap_next(&scope->tags, ent)) {
+    pch_write_int(w, 1);
+    pch_write_str(w, ent->key);
+    pch_write_type(w, ent->val);
+  }
+  pch_write_int(w, 0);
+
+  pch_write_int(w, unique_id);
+}
+
+static char *read_name(PchReader *r) {
+  char *s = pch_read_str(r);
+  if (!s)
+    pch_corrupted(r);
+  return intern(s, strlen(s));
+}
+
+// Restores the file scope from a precompiled header. This is done
+// before parse() starts.
+void load_globals(PchReader *r) {
+  Obj head = {};
+  Obj *cur = &head;
+
+  while (pch_read_int(r)) {
+    Obj *var = arena_alloc(perm_arena, sizeof(Obj));
+    pch_push_ref(r, var);
+    var->name = read_name(r);
+    var->ty = pch_read_type(r);
+    if (!var->ty)
+      pch_corrupted(r);
+    var->align = pch_read_int(r);
+    var->is_function = pch_read_int(r);
+    var->is_definition = pch_read_int(r);
+    var->is_static = pch_read_int(r);
+
+    if (pch_read_int(r))
+      var->init_data = pch_read_bytes(r, var->ty->size);
+
+    Relocation head2 = {};
+    Relocation *cur2 = &head2;
+    while (pch_read_int(r)) {
+      Relocation *rel = arena_alloc(perm_arena, sizeof(Relocation));
+      rel->offset = pch_read_int(r);
+      rel->label = read_name(r);
+      rel->addend = pch_read_int(r);
+      cur2 = cur2->next = rel;
+    }
+    var->rel = head2.next;
+    cur = cur->next = var;
+  }
+  cur->next = globals;
+  globals = head.next;
+
+  while (pch_read_int(r)) {
+    char *name = read_name(r);
+    VarScope *sc = arena_alloc(perm_arena, sizeof(VarScope));
+    sc->var = pch_read_ref(r);
+    sc->type_def = pch_read_type(r);
+    sc->enum_ty = pch_read_type(r);
+    sc->enum_val = pch_read_int(r);
+    hashmap_put(&scope->vars, name, sc);
+  }
+
+  while (pch_read_int(r)) {
+    char *name = read_name(r);
+    Type *ty = pch_read_type(r);
+    if (!ty)
+      pch_corrupted(r);
+    hashmap_put(&scope->tags, name, ty);
+  }
+
+  unique_id = pch_read_int(r);
+}
+
+// Records a span for a top-level declaration for -ftrace. It is named
+// after the last object it defined if any.
+static void trace_decl(Token *tok, int64_t start, Obj *last, bool is_typedef) {
+  char *name = is_typedef ? "typedef" : "declaration";
+  if (globals != last)
+    name = globals->name;
+
+  char *loc = NULL;
+  if (tok->file_no)
+    loc = format("%s:%d", get_file(tok->file_no)->name, tok->line_no);
+  trace_event("decl", name, loc, start, timevar_now(), 0);
+}
+
 Obj *parse(Token *tok) {
-  globals = NULL;
+  arena = perm_arena;
 
   while (tok->kind != TK_EOF) {
+    Token *start = tok;
+    int64_t start_time = opt_trace ? timevar_now() : 0;
+    Obj *last = globals;
+
     VarAttr attr = {};
     Type *basety = declspec(&tok, tok, &attr);
 
-    // Typedef
     if (attr.is_typedef) {
+      // Typedef
       tok = parse_typedef(tok, basety);
-      continue;
-    }
-
-    // Function
-    if (is_function(tok)) {
+    } else if (is_function(tok)) {
+      // Function
       tok = function(tok, basety, &attr);
-      continue;
+    } else {
+      // Global variable
+      tok = global_variable(tok, basety, &attr);
     }
 
-    // Global variable
-    tok = global_variable(tok, basety, &attr);
+    if (opt_trace)
+      trace_decl(start, start_time, last, attr.is_typedef);
   }
   return globals;
 }
@@ -0,0 +1,657 @@
+// This file implements precompiled headers.
+//
+// A precompiled header is a snapshot of the compiler's state after
+// a header has been preprocessed and parsed on its own: the files it
+// read, the macros and include guards it left defined, and the
+// declarations in its file scope along with the types they refer to.
+// If the main file of a translation unit begins with an #include of
+// the same header, `-include-pch` restores the snapshot instead of
+// reading and parsing the header again.
+//
+// A snapshot is a stream of variable-length integers and byte
+// strings. An object that may be referenced from more than one
+// place, such as a type, is written once and then referred to by
+// its index. A snapshot is loaded by mapping the file into memory,
+// and file contents, line tables and strings are used in place.
+//
+// Each module saves and restores its own state through the functions
+// in this file (see save_macros() and save_globals()).
+
+#include "chibicc.h"
+
+#define PCH_MAGIC "chibicc-pch"
+#define PCH_VERSION 1
+
+struct PchWriter {
+  char *buf;
+  int64_t len;
+  int64_t cap;
+
+  // Indices of objects written so far, keyed by address
+  HashMap refs;
+  int nrefs;
+
+  File **files; // Input files, indexed by display_no - 1
+  int nfiles;
+  File *last_file;
+};
+
+struct PchReader {
+  char *path;
+  char *p;
+  char *end;
+
+  void **refs;
+  int nrefs;
+  int refs_cap;
+
+  File **files;
+  int nfiles;
+};
+
+// Built-in types are not written but referred to by these indices.
+static Type **builtin_types[] = {
+  &ty_void, &ty_bool, &ty_char, &ty_short, &ty_int, &ty_long,
+  &ty_uchar, &ty_ushort, &ty_uint, &ty_ulong, &ty_float, &ty_double,
+};
+
+#define NBUILTINS (sizeof(builtin_types) / sizeof(*builtin_types))
+
+//
+// Writer
+//
+
+void pch_write_bytes(PchWriter *w, void *p, int64_t len) {
+  if (w->len + len > w->cap) {
+    w->cap = MAX(w->cap * 2, w->len + len);
+    w->buf = realloc(w->buf, w->cap);
+  }
+  memcpy(w->buf + w->len, p, len);
+  w->len += len;
+}
+
+// Pads the stream so that the next item starts at a multiple of `n`.
+static void write_align(PchWriter *w, int n) {
+  static char zero[8];
+  pch_write_bytes(w, zero, align_to(w->len, n) - w->len);
+}
+
+// Integers are written in the LEB128 format after zigzag encoding,
+// so small values of either sign take a single byte.
+void pch_write_int(PchWriter *w, int64_t val) {
+  uint64_t u = ((uint64_t)val << 1) ^ (uint64_t)(val >> 63);
+  do {
+    char c = u & 0x7f;
+    u >>= 7;
+    if (u)
+      c |= 0x80;
+    pch_write_bytes(w, &c, 1);
+  } while (u);
+}
+
+// A string is written with its terminating '\0', so that a reader
+// can use it in place.
+void pch_write_str(PchWriter *w, char *s) {
+  if (!s) {
+    pch_write_int(w, 0);
+    return;
+  }
+
+  int len = strlen(s);
+  pch_write_int(w, len + 1);
+  pch_write_bytes(w, s, len + 1);
+}
+
+static int find_ref(PchWriter *w, void *p) {
+  return (intptr_t)hashmap_get2(&w->refs, (char *)&p, sizeof(p)) - 1;
+}
+
+// Assigns the next index to an object. The reader must call
+// pch_push_ref() at the same point of the stream.
+void pch_add_ref(PchWriter *w, void *p) {
+  char *key = arena_strndup(perm_arena, (char *)&p, sizeof(p));
+  hashmap_put2(&w->refs, key, sizeof(p), (void *)(intptr_t)(++w->nrefs));
+}
+
+void pch_write_ref(PchWriter *w, void *p) {
+  if (!p) {
+    pch_write_int(w, 0);
+    return;
+  }
+
+  int idx = find_ref(w, p);
+  if (idx == -1)
+    error("internal error: unknown object in a precompiled header");
+  pch_write_int(w, idx + 1);
+}
+
+// Files are referred to by their number in .file directives, which is
+// the same in a translation unit that uses the snapshot.
+void pch_write_file(PchWriter *w, int file_no) {
+  if (!file_no) {
+    pch_write_int(w, 0);
+    return;
+  }
+
+  int display_no = get_file(file_no)->display_no;
+  if (!display_no)
+    error("internal error: unused file in a precompiled header");
+  pch_write_int(w, display_no);
+}
+
+// Returns the input file containing a given location, or NULL if the
+// location is in a string the preprocessor has built.
+static File *find_input_file(PchWriter *w, char *loc) {
+  File *f = w->last_file;
+  if (f && f->contents <= loc && loc < f->contents + f->size)
+    return f;
+
+  for (int i = 0; i < w->nfiles; i++) {
+    f = w->files[i];
+    if (f->contents <= loc && loc < f->contents + f->size)
+      return w->last_file = f;
+  }
+  return NULL;
+}
+
+void pch_write_token(PchWriter *w, Token *tok) {
+  pch_write_int(w, tok->kind);
+  pch_write_int(w, tok->at_bol | tok->has_space << 1 | tok->no_expand << 2);
+  pch_write_file(w, tok->file_no);
+  pch_write_int(w, tok->line_no);
+  pch_write_int(w, tok->len);
+
+  // A token is usually in the contents of one of the files, but
+  // tokens the preprocessor has built carry their own spelling.
+  File *file = find_input_file(w, tok->loc);
+  if (file) {
+    pch_write_int(w, file->display_no);
+    pch_write_int(w, tok->loc - file->contents);
+  } else {
+    pch_write_int(w, 0);
+    pch_write_str(w, arena_strndup(perm_arena, tok->loc, tok->len));
+  }
+
+  if (tok->kind == TK_NUM || tok->kind == TK_STR) {
+    Literal *lit = tok_literal(tok);
+    pch_write_int(w, lit->val);
+    pch_write_bytes(w, &lit->fval, sizeof(lit->fval));
+    pch_write_type(w, lit->ty);
+    if (tok->kind == TK_STR)
+      pch_write_bytes(w, lit->str, lit->ty->size);
+  }
+}
+
+static void write_token_ptr(PchWriter *w, Token *tok) {
+  pch_write_int(w, tok != NULL);
+  if (tok)
+    pch_write_token(w, tok);
+}
+
+// Pointer, array and function types are hash-consed (see type.c).
+// Such a type is restored with the same constructor, so that the
+// translation unit using the snapshot shares it.
+static bool is_shared_type(Type *ty) {
+  switch (ty->kind) {
+  case TY_PTR:
+    return pointer_to(ty->base) == ty;
+  case TY_ARRAY:
+    return ty->base->size >= 0 && array_of(ty->base, ty->array_len) == ty;
+  case TY_FUNC:
+    return func_type(ty->return_ty, ty->params, ty->nparams, ty->is_variadic) == ty;
+  default:
+    return false;
+  }
+}
+
+// A type is written as 0 if NULL, 1 followed by its definition if
+// it hasn't been written yet, or its index plus 2 otherwise.
+void pch_write_type(PchWriter *w, Type *ty) {
+  if (!ty) {
+    pch_write_int(w, 0);
+    return;
+  }
+
+  int idx = find_ref(w, ty);
+  if (idx != -1) {
+    pch_write_int(w, idx + 2);
+    return;
+  }
+
+  pch_write_int(w, 1);
+  pch_write_int(w, ty->kind);
+
+  // A shared type gets its index after the types it depends on,
+  // because the reader needs them to construct the type.
+  bool shared = is_shared_type(ty);
+  pch_write_int(w, shared);
+
+  if (shared) {
+    switch (ty->kind) {
+    case TY_PTR:
+      pch_write_type(w, ty->base);
+      break;
+    case TY_ARRAY:
+      pch_write_type(w, ty->base);
+      pch_write_int(w, ty->array_len);
+      break;
+    case TY_FUNC:
+      pch_write_type(w, ty->return_ty);
+      pch_write_int(w, ty->is_variadic);
+      pch_write_int(w, ty->nparams);
+      for (int i = 0; i < ty->nparams; i++)
+        pch_write_type(w, ty->params[i]);
+      break;
+    }
+    pch_add_ref(w, ty);
+    return;
+  }
+
+  // Other types get their index first, as a struct may refer to
+  // itself through its members.
+  pch_add_ref(w, ty);
+  pch_write_int(w, ty->size);
+  pch_write_int(w, ty->align);
+  pch_write_int(w, ty->is_unsigned);
+  pch_write_type(w, ty->base);
+  pch_write_int(w, ty->array_len);
+  pch_write_int(w, ty->is_flexible);
+  pch_write_type(w, ty->return_ty);
+  pch_write_int(w, ty->is_variadic);
+  pch_write_int(w, ty->nparams);
+  for (int i = 0; i < ty->nparams; i++)
+    pch_write_type(w, ty->params[i]);
+
+  for (Member *mem = ty->members; mem; mem = mem->next) {
+    pch_write_int(w, 1);
+    pch_write_type(w, mem->ty);
+    write_token_ptr(w, mem->tok);
+    write_token_ptr(w, mem->name);
+    pch_write_int(w, mem->idx);
+    pch_write_int(w, mem->align);
+    pch_write_int(w, mem->offset);
+  }
+  pch_write_int(w, 0);
+}
+
+static void write_files(PchWriter *w) {
+  File **files = get_input_files();
+  for (w->nfiles = 0; files[w->nfiles]; w->nfiles++);
+  w->files = files;
+
+  pch_write_int(w, w->nfiles);
+  for (int i = 0; i < w->nfiles; i++) {
+    File *file = files[i];
+    struct stat st;
+    if (stat(file->name, &st))
+      error("%s: %s", file->name, strerror(errno));
+
+    pch_write_str(w, file->name);
+    pch_write_int(w, st.st_dev);
+    pch_write_int(w, st.st_ino);
+    pch_write_int(w, st.st_size);
+    pch_write_int(w, st.st_mtim.tv_sec);
+    pch_write_int(w, st.st_mtim.tv_nsec);
+
+    pch_write_int(w, file->size);
+    pch_write_bytes(w, file->contents, file->size);
+    pch_write_bytes(w, "", 1);
+
+    pch_write_int(w, file->nlines);
+    write_align(w, sizeof(int));
+    pch_write_bytes(w, file->lines, file->nlines * sizeof(int));
+  }
+}
+
+// Writes a snapshot of the current translation unit. `macro_hash` is
+// the value of macro_hash() before the header was preprocessed.
+void write_pch(FILE *out, uint64_t macro_hash) {
+  PchWriter w = {};
+  for (int i = 0; i < NBUILTINS; i++)
+    pch_add_ref(&w, *builtin_types[i]);
+
+  pch_write_bytes(&w, PCH_MAGIC, sizeof(PCH_MAGIC));
+  pch_write_int(&w, PCH_VERSION);
+  pch_write_bytes(&w, &macro_hash, sizeof(macro_hash));
+
+  write_files(&w);
+  save_macros(&w);
+  save_globals(&w);
+
+  fwrite(w.buf, 1, w.len, out);
+  if (fflush(out) || ferror(out))
+    error("cannot write a precompiled header: %s", strerror(errno));
+  free(w.buf);
+  hashmap_free(&w.refs);
+}
+
+//
+// Reader
+//
+
+void pch_corrupted(PchReader *r) {
+  error("%s: invalid precompiled header", r->path);
+}
+
+// Returns a pointer to the next `len` bytes of the snapshot.
+void *pch_read_bytes(PchReader *r, int64_t len) {
+  if (len < 0 || r->end - r->p < len)
+    pch_corrupted(r);
+  char *p = r->p;
+  r->p += len;
+  return p;
+}
+
+static void read_align(PchReader *r, int n) {
+  char *p = (char *)(((uintptr_t)r->p + n - 1) / n * n);
+  pch_read_bytes(r, p - r->p);
+}
+
+int64_t pch_read_int(PchReader *r) {
+  uint64_t u = 0;
+  for (int shift = 0;; shift += 7) {
+    if (r->p == r->end || shift > 63)
+      pch_corrupted(r);
+    unsigned char c = *r->p++;
+    u |= (uint64_t)(c & 0x7f) << shift;
+    if (!(c & 0x80))
+      break;
+  }
+  return (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+}
+
+// Reads the number of items that follow. Each item takes at least one
+// byte, which bounds a valid count.
+int pch_read_count(PchReader *r) {
+  int64_t n = pch_read_int(r);
+  if (n < 0 || n > r->end - r->p)
+    pch_corrupted(r);
+  return n;
+}
+
+// Returns a string in the mapped snapshot.
+char *pch_read_str(PchReader *r) {
+  int64_t len = pch_read_int(r);
+  if (len == 0)
+    return NULL;
+
+  char *s = pch_read_bytes(r, len);
+  if (s[len - 1])
+    pch_corrupted(r);
+  return s;
+}
+
+void pch_push_ref(PchReader *r, void *p) {
+  if (r->nrefs == r->refs_cap) {
+    r->refs_cap = r->refs_cap ? r->refs_cap * 2 : 1024;
+    r->refs = realloc(r->refs, r->refs_cap * sizeof(void *));
+  }
+  r->refs[r->nrefs++] = p;
+}
+
+void *pch_read_ref(PchReader *r) {
+  int64_t idx = pch_read_int(r);
+  if (idx == 0)
+    return NULL;
+  if (idx < 0 || idx > r->nrefs)
+    pch_corrupted(r);
+  return r->refs[idx - 1];
+}
+
+// Returns the file number of a file in this process.
+int pch_read_file(PchReader *r) {
+  int64_t idx = pch_read_int(r);
+  if (idx == 0)
+    return 0;
+  if (idx < 0 || idx > r->nfiles)
+    pch_corrupted(r);
+  return r->files[idx - 1]->file_no;
+}
+
+void pch_read_token(PchReader *r, Token *tok) {
+  *tok = (Token){};
+  tok->kind = pch_read_int(r);
+  int flags = pch_read_int(r);
+  tok->at_bol = flags & 1;
+  tok->has_space = flags & 2;
+  tok->no_expand = flags & 4;
+  tok->file_no = pch_read_file(r);
+  tok->line_no = pch_read_int(r);
+  tok->len = pch_read_int(r);
+
+  int64_t idx = pch_read_int(r);
+  if (idx) {
+    if (idx < 0 || idx > r->nfiles)
+      pch_corrupted(r);
+    File *file = r->files[idx - 1];
+    int64_t off = pch_read_int(r);
+    if (off < 0 || off + tok->len > file->size)
+      pch_corrupted(r);
+    tok->loc = file->contents + off;
+  } else {
+    // Keep the spelling where the preprocessor keeps strings it builds.
+    char *s = pch_read_str(r);
+    if (!s || strlen(s) != tok->len)
+      pch_corrupted(r);
+    tok->loc = scratch_string(s);
+  }
+
+  if (tok->kind == TK_IDENT || tok->kind == TK_KEYWORD || tok->kind == TK_PUNCT)
+    tok->name = intern(tok->loc, tok->len);
+
+  if (tok->kind == TK_NUM || tok->kind == TK_STR) {
+    Literal *lit = new_literal(tok);
+    lit->val = pch_read_int(r);
+    memcpy(&lit->fval, pch_read_bytes(r, sizeof(lit->fval)), sizeof(lit->fval));
+    lit->ty = pch_read_type(r);
+    if (!lit->ty)
+      pch_corrupted(r);
+    if (tok->kind == TK_STR)
+      lit->str = pch_read_bytes(r, lit->ty->size);
+  }
+}
+
+static Token *read_token_ptr(PchReader *r) {
+  if (!pch_read_int(r))
+    return NULL;
+  Token *tok = arena_alloc(perm_arena, sizeof(Token));
+  pch_read_token(r, tok);
+  return tok;
+}
+
+static Type *read_type_nonnull(PchReader *r) {
+  Type *ty = pch_read_type(r);
+  if (!ty)
+    pch_corrupted(r);
+  return ty;
+}
+
+Type *pch_read_type(PchReader *r) {
+  int64_t tag = pch_read_int(r);
+  if (tag == 0)
+    return NULL;
+
+  if (tag != 1) {
+    if (tag < 2 || tag - 2 >= r->nrefs)
+      pch_corrupted(r);
+    return r->refs[tag - 2];
+  }
+
+  TypeKind kind = pch_read_int(r);
+  bool shared = pch_read_int(r);
+
+  if (shared) {
+    Type *ty;
+    if (kind == TY_PTR) {
+      ty = pointer_to(read_type_nonnull(r));
+    } else if (kind == TY_ARRAY) {
+      Type *base = read_type_nonnull(r);
+      ty = array_of(base, pch_read_int(r));
+    } else if (kind == TY_FUNC) {
+      Type *return_ty = read_type_nonnull(r);
+      bool is_variadic = pch_read_int(r);
+      int nparams = pch_read_count(r);
+      Type **params = arena_alloc(perm_arena, nparams * sizeof(Type *));
+      for (int i = 0; i < nparams; i++)
+        params[i] = read_type_nonnull(r);
+      ty = func_type(return_ty, params, nparams, is_variadic);
+    } else {
+      pch_corrupted(r);
+    }
+    pch_push_ref(r, ty);
+    return ty;
+  }
+
+  Type *ty = copy_type(&(Type){.kind = kind});
+  pch_push_ref(r, ty);
+  ty->size = pch_read_int(r);
+  ty->align = pch_read_int(r);
+  ty->is_unsigned = pch_read_int(r);
+  ty->base = pch_read_type(r);
+  ty->array_len = pch_read_int(r);
+  ty->is_flexible = pch_read_int(r);
+  ty->return_ty = pch_read_type(r);
+  ty->is_variadic = pch_read_int(r);
+  ty->nparams = pch_read_count(r);
+  if (ty->nparams) {
+    ty->params = arena_alloc(perm_arena, ty->nparams * sizeof(Type *));
+    for (int i = 0; i < ty->nparams; i++)
+      ty->params[i] = read_type_nonnull(r);
+  }
+
+  Member head = {};
+  Member *cur = &head;
+  while (pch_read_int(r)) {
+    Member *mem = arena_alloc(perm_arena, sizeof(Member));
+    mem->ty = read_type_nonnull(r);
+    mem->tok = read_token_ptr(r);
+    mem->name = read_token_ptr(r);
+    mem->idx = pch_read_int(r);
+    mem->align = pch_read_int(r);
+    mem->offset = pch_read_int(r);
+    cur = cur->next = mem;
+  }
+  ty->members = head.next;
+  return ty;
+}
+
+// Reads the file table. Returns false if any of the files has been
+// modified since the snapshot was written. The first file is the
+// precompiled header itself, which must be `header`.
+static bool read_files(PchReader *r, char *header) {
+  int nfiles = pch_read_count(r);
+  if (nfiles < 1)
+    pch_corrupted(r);
+
+  char **names = calloc(nfiles, sizeof(char *));
+  char **contents = calloc(nfiles, sizeof(char *));
+  int *sizes = calloc(nfiles, sizeof(int));
+  int **lines = calloc(nfiles, sizeof(int *));
+  int *nlines = calloc(nfiles, sizeof(int));
+  bool ok = true;
+
+  for (int i = 0; i < nfiles; i++) {
+    names[i] = pch_read_str(r);
+    if (!names[i])
+      pch_corrupted(r);
+    dev_t dev = pch_read_int(r);
+    ino_t ino = pch_read_int(r);
+    off_t size = pch_read_int(r);
+    time_t sec = pch_read_int(r);
+    long nsec = pch_read_int(r);
+
+    sizes[i] = pch_read_int(r);
+    contents[i] = pch_read_bytes(r, sizes[i] + 1);
+
+    nlines[i] = pch_read_int(r);
+    read_align(r, sizeof(int));
+    if (nlines[i] < 1 || nlines[i] > sizes[i] + 1)
+      pch_corrupted(r);
+    lines[i] = pch_read_bytes(r, nlines[i] * sizeof(int));
+
+    struct stat st;
+    char *path = (i == 0) ? header : names[i];
+    if (stat(path, &st) || st.st_dev != dev || st.st_ino != ino ||
+        st.st_size != size || st.st_mtim.tv_sec != sec ||
+        st.st_mtim.tv_nsec != nsec)
+      ok = false;
+  }
+
+  if (ok) {
+    r->files = calloc(nfiles, sizeof(File *));
+    r->nfiles = nfiles;
+
+    // The header keeps the name it is included by, just like a
+    // header that is not precompiled.
+    names[0] = header;
+
+    for (int i = 0; i < nfiles; i++) {
+      File *file = add_file(names[i], contents[i], sizes[i]);
+      file->lines = lines[i];
+      file->nlines = nlines[i];
+      file->lines_cap = nlines[i];
+      add_input_file(file->file_no);
+      r->files[i] = file;
+    }
+  }
+
+  free(names);
+  free(contents);
+  free(sizes);
+  free(lines);
+  free(nlines);
+  return ok;
+}
+
+// Restores a snapshot in place of including `header`. Returns false
+// without changing anything if the snapshot cannot be used because it
+// was written for a different header, a file it depends on has been
+// modified or the macros are not the same.
+bool load_pch(char *path, char *header) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    error("cannot open %s: %s", path, strerror(errno));
+
+  struct stat st;
+  if (fstat(fd, &st))
+    error("%s: %s", path, strerror(errno));
+
+  if (st.st_size == 0)
+    error("%s: invalid precompiled header", path);
+
+  // Map the file privately writable, because a few strings, such as
+  // string literals, are used in place and may be modified later.
+  char *buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED)
+    error("%s: mmap failed: %s", path, strerror(errno));
+
+  PchReader r = {.path = path, .p = buf, .end = buf + st.st_size};
+  char *magic = pch_read_bytes(&r, sizeof(PCH_MAGIC));
+  if (memcmp(magic, PCH_MAGIC, sizeof(PCH_MAGIC)))
+    pch_corrupted(&r);
+
+  uint64_t hash;
+  bool ok = pch_read_int(&r) == PCH_VERSION;
+  if (ok) {
+    memcpy(&hash, pch_read_bytes(&r, sizeof(hash)), sizeof(hash));
+    ok = hash == macro_hash() && read_files(&r, header);
+  }
+
+  if (!ok) {
+    munmap(buf, st.st_size);
+    return false;
+  }
+
+  for (int i = 0; i < NBUILTINS; i++)
+    pch_push_ref(&r, *builtin_types[i]);
+
+  load_macros(&r);
+  load_globals(&r);
+
+  if (r.p != r.end)
+    pch_corrupted(&r);
+  free(r.refs);
+  free(r.files);
+  return true;
+}
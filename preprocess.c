@@ -0,0 +1,1348 @@
+// This file implements the C preprocessor.
+//
+// The preprocessor takes the token array of a source file and returns
+// a new token array in which all directives have been executed and
+// all macros have been expanded.
+//
+// Tokens are read from a stack of contexts. A context is either a
+// source file or the replacement list of a macro being expanded, and
+// the next token is always read from the innermost one. A macro is
+// disabled while its context is on the stack, which is how we prevent
+// a macro from being expanded recursively (C11 6.10.3.4p2). If we see
+// the name of a disabled macro, we output it with `no_expand` set, so
+// that it won't be expanded even if it is rescanned later.
+
+#include "chibicc.h"
+
+typedef struct Macro Macro;
+typedef Token *macro_handler_fn(Token *tok);
+
+struct Macro {
+  char *name;
+  bool is_objlike; // Object-like or function-like
+  char **params;
+  int nparams;
+  char *va_args_name;
+  Token *body;     // Replacement list terminated by TK_EOF
+  macro_handler_fn *handler;
+  bool disabled;   // True while its expansion is being read
+};
+
+// `#if` can be nested, so we use a stack to manage nested `#if`s.
+typedef struct CondIncl CondIncl;
+struct CondIncl {
+  CondIncl *next;
+  enum { IN_THEN, IN_ELIF, IN_ELSE } ctx;
+  Token *tok;
+  bool included;
+};
+
+typedef enum {
+  CTX_FILE,  // Source file
+  CTX_MACRO, // Expansion of a macro
+  CTX_ARG,   // Macro argument or #if expression expanded in isolation
+} ContextKind;
+
+typedef struct Context Context;
+struct Context {
+  Context *next;
+  ContextKind kind;
+  Token *tok;      // Next token to read
+  Macro *macro;    // CTX_MACRO: the macro being expanded, if any
+  char *path;      // CTX_FILE: file path
+  CondIncl *cond;  // CTX_FILE: `cond_incl` when the file was entered
+  int depth;       // CTX_FILE: include depth
+};
+
+// A growable token array. Temporary arrays are allocated from
+// `pp_arena`, and the output array is allocated with malloc().
+typedef struct {
+  Token *data;
+  int len;
+  int cap;
+  bool is_heap;
+} TokenVec;
+
+static HashMap macros;
+
+static CondIncl *cond_incl;
+static Context *ctx;
+
+// Files marked with #pragma once
+static HashMap pragma_once;
+
+// An included file. Files are cached, keyed by absolute path, so
+// that a header included many times is read and tokenized only once.
+// A cache may outlive a translation unit (see server.c), so an entry
+// is validated against the file's stat data once per unit.
+typedef struct {
+  File *file;
+  Token *tok;  // NULL if restored from a precompiled header
+  char *guard; // Include guard macro, or NULL
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+  int checked; // Value of `generation` when last validated
+} CachedFile;
+
+static HashMap file_cache;
+static int generation;
+static char *cwd;
+
+// The first token of the main file, which is valid only while the
+// file is being preprocessed, and the file's include guard
+static Token *main_start;
+static int main_file_no;
+static char *main_guard;
+
+// Contexts and token arrays that are needed only while preprocessing.
+static Arena pp_arena;
+
+static Token *read_token(void);
+
+static void push_token(TokenVec *vec, Token *tok) {
+  if (vec->len == vec->cap) {
+    int cap = vec->cap ? vec->cap * 2 : 16;
+    if (vec->is_heap) {
+      vec->data = realloc(vec->data, sizeof(Token) * cap);
+    } else {
+      Token *data = arena_alloc(&pp_arena, sizeof(Token) * cap);
+      if (vec->len)
+        memcpy(data, vec->data, sizeof(Token) * vec->len);
+      vec->data = data;
+    }
+    vec->cap = cap;
+  }
+  vec->data[vec->len++] = *tok;
+}
+
+// Terminates a token array with an EOF token that has the same
+// location as `tmpl`, which is used in error messages.
+static Token *finish(TokenVec *vec, Token *tmpl) {
+  Token eof = *tmpl;
+  eof.kind = TK_EOF;
+  eof.len = 0;
+  eof.name = NULL;
+  push_token(vec, &eof);
+  return vec->data;
+}
+
+static bool is_hash(Token *tok) {
+  return tok->at_bol && equal(tok, "#");
+}
+
+static bool is_ident(Token *tok) {
+  return tok->kind == TK_IDENT || tok->kind == TK_KEYWORD;
+}
+
+// Some preprocessor directives such as #include allow extraneous
+// tokens before newline. This function skips such tokens.
+static Token *skip_line(Token *tok) {
+  while (!tok->at_bol && tok->kind != TK_EOF)
+    tok++;
+  return tok;
+}
+
+// Returns the tokens up to the end of the line, terminated by EOF.
+static Token *copy_line(Token **rest, Token *tok, Arena *arena) {
+  Token *start = tok;
+  while (!tok->at_bol && tok->kind != TK_EOF)
+    tok++;
+
+  int len = tok - start;
+  Token *line = arena_alloc(arena, sizeof(Token) * (len + 1));
+  memcpy(line, start, sizeof(Token) * len);
+  line[len] = *tok;
+  line[len].kind = TK_EOF;
+  line[len].name = NULL;
+  *rest = tok;
+  return line;
+}
+
+// Tokenizes a string the preprocessor has built. The resulting
+// tokens are attributed to the location of `tmpl`.
+static Token *tokenize_string(char *buf, Token *tmpl) {
+  Token *tok = tokenize_scratch(buf);
+  for (Token *t = tok; t->kind != TK_EOF; t++) {
+    t->at_bol = false;
+    t->file_no = tmpl->file_no;
+    t->line_no = tmpl->line_no;
+  }
+  tok->has_space = tmpl->has_space;
+  return tok;
+}
+
+// `#if` creates a number token for every `defined` and every unknown
+// identifier, so number tokens are built directly rather than by
+// tokenizing their spelling.
+static Token *new_num_token(int val, Token *tmpl) {
+  char buf[20];
+  snprintf(buf, sizeof(buf), "%d", val);
+
+  Token *tok = arena_alloc(&pp_arena, sizeof(Token));
+  *tok = *tmpl;
+  tok->kind = TK_NUM;
+  tok->at_bol = false;
+  tok->no_expand = false;
+  tok->loc = scratch_string(buf);
+  tok->len = strlen(buf);
+  tok->name = NULL;
+  *new_literal(tok) = (Literal){.val = val, .ty = ty_int};
+  return tok;
+}
+
+//
+// Contexts
+//
+
+static Context *push_context(ContextKind kind, Token *tok) {
+  Context *c = arena_alloc(&pp_arena, sizeof(Context));
+  c->kind = kind;
+  c->tok = tok;
+  c->next = ctx;
+  ctx = c;
+  return c;
+}
+
+static void pop_context(void) {
+  if (ctx->macro)
+    ctx->macro->disabled = false;
+  ctx = ctx->next;
+}
+
+// Returns the next token without consuming it. Macro contexts that
+// have been read to the end are popped, so the returned token is an
+// EOF only at the end of a file or an isolated expansion.
+static Token *peek_token(void) {
+  for (;;) {
+    Token *tok = ctx->tok;
+    if (tok->kind != TK_EOF || ctx->kind != CTX_MACRO)
+      return tok;
+    pop_context();
+  }
+}
+
+static Token *read_token(void) {
+  Token *tok = peek_token();
+  if (tok->kind != TK_EOF)
+    ctx->tok++;
+  return tok;
+}
+
+//
+// Macros
+//
+
+static Macro *find_macro(Token *tok) {
+  if (!is_ident(tok) || tok->no_expand)
+    return NULL;
+  return hashmap_get2(&macros, tok->name, tok->len);
+}
+
+static Macro *add_macro(char *name, bool is_objlike, Token *body) {
+  Macro *m = arena_alloc(perm_arena, sizeof(Macro));
+  m->name = name;
+  m->is_objlike = is_objlike;
+  m->body = body;
+  hashmap_put(&macros, name, m);
+  return m;
+}
+
+void undef_macro(char *name) {
+  hashmap_delete(&macros, intern(name, strlen(name)));
+}
+
+static void read_macro_params(Token **rest, Token *tok, Macro *m) {
+  char *params[256];
+  int nparams = 0;
+
+  while (!equal(tok, ")")) {
+    if (nparams)
+      tok = skip(tok, ",");
+
+    if (equal(tok, "...")) {
+      m->va_args_name = intern("__VA_ARGS__", 11);
+      tok = skip(tok + 1, ")");
+      break;
+    }
+
+    if (!is_ident(tok))
+      error_tok(tok, "expected an identifier");
+
+    if (equal(tok + 1, "...")) {
+      m->va_args_name = tok->name;
+      tok = skip(tok + 2, ")");
+      break;
+    }
+
+    if (nparams == sizeof(params) / sizeof(*params))
+      error_tok(tok, "too many macro parameters");
+    params[nparams++] = tok->name;
+    tok++;
+  }
+
+  if (!m->va_args_name)
+    tok = skip(tok, ")");
+
+  m->params = arena_alloc(perm_arena, sizeof(char *) * (nparams + 1));
+  if (nparams)
+    memcpy(m->params, params, sizeof(char *) * nparams);
+  m->nparams = nparams;
+  *rest = tok;
+}
+
+static void read_macro_definition(Token **rest, Token *tok) {
+  if (!is_ident(tok) || tok->at_bol)
+    error_tok(tok, "macro name must be an identifier");
+  char *name = tok->name;
+  tok++;
+
+  if (!tok->has_space && !tok->at_bol && equal(tok, "(")) {
+    // Function-like macro
+    Macro m = {};
+    read_macro_params(&tok, tok + 1, &m);
+
+    Macro *m2 = add_macro(name, false, copy_line(rest, tok, perm_arena));
+    m2->params = m.params;
+    m2->nparams = m.nparams;
+    m2->va_args_name = m.va_args_name;
+  } else {
+    // Object-like macro
+    add_macro(name, true, copy_line(rest, tok, perm_arena));
+  }
+}
+
+// Returns the index of the parameter named by `tok`, or -1 if `tok`
+// is not a parameter. __VA_ARGS__ has index `nparams`.
+static int find_param(Macro *m, Token *tok) {
+  if (m->is_objlike || !is_ident(tok))
+    return -1;
+  for (int i = 0; i < m->nparams; i++)
+    if (m->params[i] == tok->name)
+      return i;
+  if (m->va_args_name && m->va_args_name == tok->name)
+    return m->nparams;
+  return -1;
+}
+
+// Reads the arguments of a function-like macro invocation. The
+// opening parenthesis has already been consumed. The returned
+// arrays are the raw tokens of each argument terminated by EOF.
+static Token **read_macro_args(Macro *m, Token *name) {
+  int nargs = m->nparams + (m->va_args_name ? 1 : 0);
+  Token **args = arena_alloc(&pp_arena, sizeof(Token *) * (nargs + 1));
+  int i = 0;
+  int level = 0;
+  TokenVec arg = {};
+
+  for (;;) {
+    Token *tok = read_token();
+    if (tok->kind == TK_EOF)
+      error_tok(name, "unterminated list invoking macro");
+
+    if (level == 0 && (equal(tok, ")") || equal(tok, ","))) {
+      // Arguments beyond the named parameters are collected as a
+      // single variable argument including commas.
+      if (equal(tok, ",") && m->va_args_name && i == m->nparams) {
+        push_token(&arg, tok);
+        continue;
+      }
+
+      if (i == nargs) {
+        if (i == 0 && arg.len == 0 && equal(tok, ")"))
+          break;
+        error_tok(name, "too many arguments");
+      }
+
+      args[i++] = finish(&arg, tok);
+      arg = (TokenVec){};
+      if (equal(tok, ")"))
+        break;
+      continue;
+    }
+
+    if (equal(tok, "("))
+      level++;
+    else if (equal(tok, ")"))
+      level--;
+    push_token(&arg, tok);
+  }
+
+  // The variable argument may be omitted entirely.
+  if (i == m->nparams && m->va_args_name)
+    args[i++] = finish(&(TokenVec){}, name);
+
+  if (i != nargs)
+    error_tok(name, "too few arguments");
+  return args;
+}
+
+static void preprocess2(TokenVec *out);
+
+// Fully macro-expands a token array in isolation, as is done for
+// a macro argument before it is substituted (C11 6.10.3.1p1).
+static Token *expand_isolated(Token *tok) {
+  Context *saved = ctx;
+  push_context(CTX_ARG, tok);
+
+  TokenVec vec = {};
+  preprocess2(&vec);
+  Token *end = ctx->tok;
+  ctx = saved;
+  return finish(&vec, end);
+}
+
+// Concatenates all tokens in `tok` and returns a new string.
+static char *join_tokens(Token *tok, Token *end) {
+  // Compute the length of the resulting token.
+  int len = 1;
+  for (Token *t = tok; t != end && t->kind != TK_EOF; t++) {
+    if (t != tok && t->has_space)
+      len++;
+    len += t->len;
+  }
+
+  char *buf = arena_alloc(perm_arena, len);
+
+  // Copy token texts.
+  int pos = 0;
+  for (Token *t = tok; t != end && t->kind != TK_EOF; t++) {
+    if (t != tok && t->has_space)
+      buf[pos++] = ' ';
+    memcpy(buf + pos, t->loc, t->len);
+    pos += t->len;
+  }
+  buf[pos] = '\0';
+  return buf;
+}
+
+// Double-quote a given string and returns it.
+static char *quote_string(char *str) {
+  int bufsize = 3;
+  for (int i = 0; str[i]; i++) {
+    if (str[i] == '\\' || str[i] == '"')
+      bufsize++;
+    bufsize++;
+  }
+
+  char *buf = arena_alloc(perm_arena, bufsize);
+
+  int pos = 0;
+  buf[pos++] = '"';
+  for (int i = 0; str[i]; i++) {
+    if (str[i] == '\\' || str[i] == '"')
+      buf[pos++] = '\\';
+    buf[pos++] = str[i];
+  }
+  buf[pos++] = '"';
+  buf[pos++] = '\0';
+  return buf;
+}
+
+// Concatenates all tokens in `arg` and returns a new string token.
+// This function is used for the stringizing operator (#).
+static Token *stringize(Token *hash, Token *arg) {
+  // Create a new string token. We need to set some value to its
+  // source location for error reporting function, so we use a macro
+  // name token as a template.
+  char *s = join_tokens(arg, NULL);
+  return tokenize_string(quote_string(s), hash);
+}
+
+// Concatenate two tokens to create a new token.
+static Token *paste(Token *lhs, Token *rhs) {
+  // Paste the two tokens.
+  char *buf = format("%.*s%.*s", lhs->len, lhs->loc, rhs->len, rhs->loc);
+
+  // Tokenize the resulting string.
+  Token *tok = tokenize_string(buf, lhs);
+  if (tok[1].kind != TK_EOF)
+    error_tok(lhs, "pasting forms '%s', an invalid token", buf);
+  return tok;
+}
+
+static void push_tokens(TokenVec *vec, Token *tok) {
+  for (; tok->kind != TK_EOF; tok++)
+    push_token(vec, tok);
+}
+
+// Replaces func-like macro parameters with given arguments.
+static Token *subst(Macro *m, Token **args, Token *name) {
+  TokenVec vec = {};
+  Token **expanded = NULL;
+  if (args) {
+    int nargs = m->nparams + (m->va_args_name ? 1 : 0);
+    expanded = arena_alloc(&pp_arena, sizeof(Token *) * (nargs + 1));
+  }
+
+  for (Token *tok = m->body; tok->kind != TK_EOF; tok++) {
+    // "#" followed by a parameter is replaced with stringized actuals.
+    if (!m->is_objlike && equal(tok, "#")) {
+      int i = find_param(m, tok + 1);
+      if (i < 0)
+        error_tok(tok + 1, "'#' is not followed by a macro parameter");
+      push_token(&vec, stringize(tok, args[i]));
+      tok++;
+      continue;
+    }
+
+    // [GNU] If __VA_ARGS__ is empty, `,##__VA_ARGS__` is expanded
+    // to the empty token list. Otherwise, its expanded to `,` and
+    // __VA_ARGS__.
+    if (equal(tok, ",") && equal(tok + 1, "##")) {
+      int i = find_param(m, tok + 2);
+      if (i == m->nparams && m->va_args_name) {
+        if (args[i]->kind == TK_EOF) {
+          tok += 2;
+        } else {
+          push_token(&vec, tok);
+          tok++;
+        }
+        continue;
+      }
+    }
+
+    if (equal(tok, "##")) {
+      if (vec.len == 0)
+        error_tok(tok, "'##' cannot appear at start of macro expansion");
+      if (tok[1].kind == TK_EOF)
+        error_tok(tok, "'##' cannot appear at end of macro expansion");
+
+      Token *rhs = tok + 1;
+      int i = find_param(m, rhs);
+      if (i >= 0) {
+        Token *arg = args[i];
+        if (arg->kind != TK_EOF) {
+          vec.data[vec.len - 1] = *paste(&vec.data[vec.len - 1], arg);
+          push_tokens(&vec, arg + 1);
+        }
+      } else {
+        vec.data[vec.len - 1] = *paste(&vec.data[vec.len - 1], rhs);
+      }
+      tok++;
+      continue;
+    }
+
+    int i = find_param(m, tok);
+
+    if (i >= 0 && equal(tok + 1, "##")) {
+      Token *rhs = tok + 2;
+
+      if (args[i]->kind == TK_EOF) {
+        int j = find_param(m, rhs);
+        if (j >= 0)
+          push_tokens(&vec, args[j]);
+        else
+          push_token(&vec, rhs);
+        tok = rhs;
+        continue;
+      }
+
+      push_tokens(&vec, args[i]);
+      continue;
+    }
+
+    // Handle a macro token. Macro arguments are completely macro-expanded
+    // before they are substituted into a macro body.
+    if (i >= 0) {
+      if (!expanded[i])
+        expanded[i] = expand_isolated(args[i]);
+
+      int start = vec.len;
+      push_tokens(&vec, expanded[i]);
+      if (vec.len > start)
+        vec.data[start].has_space = tok->has_space;
+      continue;
+    }
+
+    // Handle a non-macro token.
+    push_token(&vec, tok);
+  }
+
+  // Tokens of an expansion are attributed to the macro invocation.
+  for (int i = 0; i < vec.len; i++) {
+    Token *t = &vec.data[i];
+    t->at_bol = false;
+    t->file_no = name->file_no;
+    t->line_no = name->line_no;
+  }
+  if (vec.len) {
+    vec.data[0].at_bol = name->at_bol;
+    vec.data[0].has_space = name->has_space;
+  }
+
+  return finish(&vec, name);
+}
+
+// If tok is a macro, expand it and return true.
+// Otherwise, do nothing and return false.
+static bool expand_macro(Macro *m, Token *tok) {
+  // Built-in dynamic macro application such as __LINE__
+  if (m->handler) {
+    TokenVec vec = {};
+    push_token(&vec, m->handler(tok));
+    vec.data[0].at_bol = tok->at_bol;
+    push_context(CTX_MACRO, finish(&vec, tok));
+    return true;
+  }
+
+  // Object-like macro application
+  if (m->is_objlike) {
+    push_context(CTX_MACRO, subst(m, NULL, tok))->macro = m;
+    m->disabled = true;
+    return true;
+  }
+
+  // If a funclike macro token is not followed by an argument list,
+  // treat it as a normal identifier.
+  if (!equal(peek_token(), "("))
+    return false;
+  read_token();
+
+  // Function-like macro application
+  Token **args = read_macro_args(m, tok);
+  push_context(CTX_MACRO, subst(m, args, tok))->macro = m;
+  m->disabled = true;
+  return true;
+}
+
+//
+// Conditional inclusion
+//
+
+// Skip until the next `#endif` that closes a conditional.
+static Token *skip_cond_incl2(Token *tok) {
+  while (tok->kind != TK_EOF) {
+    if (is_hash(tok) &&
+        (equal(tok + 1, "if") || equal(tok + 1, "ifdef") ||
+         equal(tok + 1, "ifndef"))) {
+      tok = skip_cond_incl2(tok + 2);
+      continue;
+    }
+    if (is_hash(tok) && equal(tok + 1, "endif"))
+      return tok + 2;
+    tok++;
+  }
+  return tok;
+}
+
+// Skip until next `#else`, `#elif` or `#endif`.
+// Nested `#if` and `#endif` are skipped.
+static Token *skip_cond_incl(Token *tok) {
+  while (tok->kind != TK_EOF) {
+    if (is_hash(tok) &&
+        (equal(tok + 1, "if") || equal(tok + 1, "ifdef") ||
+         equal(tok + 1, "ifndef"))) {
+      tok = skip_cond_incl2(tok + 2);
+      continue;
+    }
+
+    if (is_hash(tok) &&
+        (equal(tok + 1, "elif") || equal(tok + 1, "else") ||
+         equal(tok + 1, "endif")))
+      break;
+    tok++;
+  }
+  return tok;
+}
+
+static CondIncl *push_cond_incl(Token *tok, bool included) {
+  CondIncl *ci = arena_alloc(&pp_arena, sizeof(CondIncl));
+  ci->next = cond_incl;
+  ci->ctx = IN_THEN;
+  ci->tok = tok;
+  ci->included = included;
+  cond_incl = ci;
+  return ci;
+}
+
+// Returns the innermost conditional of the current file.
+static CondIncl *current_cond_incl(void) {
+  return cond_incl == ctx->cond ? NULL : cond_incl;
+}
+
+// Read an #if expression and evaluate it.
+static int64_t eval_const_expr(Token **rest, Token *tok) {
+  Token *start = tok;
+  Token *line = copy_line(rest, tok + 1, &pp_arena);
+
+  // Replace "defined(foo)" or "defined foo" with 1 if "foo" is
+  // defined, or 0 otherwise. This must be done before macro
+  // expansion.
+  TokenVec vec = {};
+  for (Token *t = line; t->kind != TK_EOF; t++) {
+    if (!equal(t, "defined")) {
+      push_token(&vec, t);
+      continue;
+    }
+
+    Token *name = t + 1;
+    bool has_paren = equal(name, "(");
+    if (has_paren)
+      name++;
+    if (!is_ident(name))
+      error_tok(start, "macro name must be an identifier");
+
+    t = name;
+    if (has_paren)
+      t = skip(t + 1, ")") - 1;
+    push_token(&vec, new_num_token(find_macro(name) ? 1 : 0, name));
+  }
+
+  // Macro-expand the expression and replace remaining identifiers
+  // with 0.
+  Token *expr = expand_isolated(finish(&vec, *rest));
+  for (Token *t = expr; t->kind != TK_EOF; t++)
+    if (t->kind == TK_IDENT)
+      *t = *new_num_token(0, t);
+
+  if (expr->kind == TK_EOF)
+    error_tok(start, "no expression");
+
+  Token *rest2;
+  int64_t val = const_expr(&rest2, expr);
+  if (rest2->kind != TK_EOF)
+    error_tok(rest2, "extra token");
+  return val;
+}
+
+//
+// Source file inclusion
+//
+
+static bool file_exists(char *path) {
+  struct stat st;
+  return !stat(path, &st);
+}
+
+static char *search_include_paths(char *filename) {
+  if (filename[0] == '/')
+    return filename;
+
+  for (int i = 0; i < include_paths.len; i++) {
+    char *path = format("%s/%s", include_paths.data[i], filename);
+    if (file_exists(path))
+      return path;
+  }
+  return NULL;
+}
+
+// Returns the directory part of a path, including the trailing slash.
+static char *dirname_of(char *path) {
+  char *slash = strrchr(path, '/');
+  if (!slash)
+    return "";
+  return arena_strndup(perm_arena, path, slash - path + 1);
+}
+
+// Read an #include argument.
+static char *read_include_filename(Token **rest, Token *tok, bool *is_dquote) {
+  // Pattern 1: #include "foo.h"
+  if (tok->kind == TK_STR) {
+    // A double-quoted filename for #include is a special kind of
+    // token, and we don't want to interpret any escape sequences in it.
+    // For example, "\f" in "C:\foo" is not a formfeed character but
+    // just two non-control characters, backslash and f.
+    // So we don't want to use token->str.
+    *is_dquote = true;
+    *rest = skip_line(tok + 1);
+    return arena_strndup(perm_arena, tok->loc + 1, tok->len - 2);
+  }
+
+  // Pattern 2: #include <foo.h>
+  if (equal(tok, "<")) {
+    // Reconstruct a filename from a sequence of tokens between
+    // "<" and ">".
+    Token *start = tok;
+
+    // Find closing ">".
+    for (; !equal(tok, ">"); tok++)
+      if (tok->at_bol || tok->kind == TK_EOF)
+        error_tok(tok, "expected '>'");
+
+    *is_dquote = false;
+    *rest = skip_line(tok + 1);
+    return join_tokens(start + 1, tok);
+  }
+
+  // Pattern 3: #include FOO
+  // In this case FOO must be macro-expanded to either
+  // a single string token or a sequence of "<" ... ">".
+  if (is_ident(tok)) {
+    Token *line = copy_line(rest, tok, &pp_arena);
+    Token *tok2 = expand_isolated(line);
+    Token *rest2;
+    return read_include_filename(&rest2, tok2, is_dquote);
+  }
+
+  error_tok(tok, "expected a filename");
+}
+
+// Detect the following "include guard" pattern.
+//
+//   #ifndef FOO_H
+//   #define FOO_H
+//   ...
+//   #endif
+static char *detect_include_guard(Token *tok) {
+  // Detect the first two lines.
+  if (!is_hash(tok) || !equal(tok + 1, "ifndef"))
+    return NULL;
+  tok += 2;
+
+  if (tok->kind != TK_IDENT)
+    return NULL;
+
+  char *macro = tok->name;
+  tok++;
+
+  if (!is_hash(tok) || !equal(tok + 1, "define") || tok[2].name != macro)
+    return NULL;
+
+  // The #ifndef must have no #else or #elif, and the #endif that
+  // closes it must be at the end of the file.
+  tok = skip_cond_incl(tok);
+  if (!is_hash(tok) || !equal(tok + 1, "endif") || tok[2].kind != TK_EOF)
+    return NULL;
+  return macro;
+}
+
+static char *cache_key(char *path) {
+  if (path[0] == '/')
+    return path;
+  return format("%s/%s", cwd, path);
+}
+
+static bool is_fresh(CachedFile *cf, struct stat *st) {
+  return cf->dev == st->st_dev && cf->ino == st->st_ino &&
+         cf->size == st->st_size &&
+         cf->mtime.tv_sec == st->st_mtim.tv_sec &&
+         cf->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Returns a cached file for a given path if it is still up to date.
+static CachedFile *find_cached_file(char *path, char *key) {
+  CachedFile *cf = hashmap_get(&file_cache, key);
+  if (!cf)
+    return NULL;
+
+  // The cached tokens must have been read through the same path,
+  // because __FILE__ and debug info refer to the path as spelled.
+  if (strcmp(cf->file->name, path))
+    return NULL;
+
+  if (cf->checked != generation) {
+    struct stat st;
+    if (stat(path, &st) || !is_fresh(cf, &st))
+      return NULL;
+    cf->checked = generation;
+  }
+  return cf;
+}
+
+// Reads and tokenizes a file and adds it to the cache. Returns NULL
+// with errno set if the file cannot be read.
+static CachedFile *load_file(char *path, char *key) {
+  // Stat before reading, so that a file modified in between is
+  // considered stale next time.
+  struct stat st;
+  if (stat(path, &st))
+    return NULL;
+
+  Token *tok = tokenize_file(path);
+  if (!tok)
+    return NULL;
+
+  CachedFile *cf = arena_alloc(perm_arena, sizeof(CachedFile));
+  cf->file = get_file(tok->file_no);
+  cf->tok = tok;
+  cf->guard = detect_include_guard(tok);
+  cf->dev = st.st_dev;
+  cf->ino = st.st_ino;
+  cf->size = st.st_size;
+  cf->mtime = st.st_mtim;
+  cf->checked = generation;
+  hashmap_put(&file_cache, key, cf);
+  return cf;
+}
+
+static void include_file(char *path, Token *filename_tok) {
+  // Check for "#pragma once"
+  if (hashmap_get(&pragma_once, path))
+    return;
+
+  char *key = cache_key(path);
+  CachedFile *cf = find_cached_file(path, key);
+
+  // If we read the same file before, and if the file was guarded
+  // by the usual #ifndef ... #endif pattern, we may be able to
+  // skip the file without looking at its tokens.
+  if (cf && cf->guard && cf->file->display_no &&
+      hashmap_get(&macros, cf->guard))
+    return;
+
+  if (ctx->depth >= 200)
+    error_tok(filename_tok, "#include nested too deeply");
+
+  if (!cf || !cf->tok) {
+    cf = load_file(path, key);
+    if (!cf)
+      error_tok(filename_tok, "%s: cannot open file: %s", path, strerror(errno));
+    report_header(path);
+  }
+
+  add_input_file(cf->tok->file_no);
+
+  int depth = ctx->depth;
+  Context *c = push_context(CTX_FILE, cf->tok);
+  c->path = path;
+  c->cond = cond_incl;
+  c->depth = depth + 1;
+}
+
+// Reads a file into the cache unless an up-to-date copy is already
+// there. Relative paths are resolved against the current directory.
+// `path` may be a temporary buffer.
+void preload_file(char *path) {
+  path = format("%s", path);
+  generation++;
+  cwd = getcwd(NULL, 0);
+  char *key = cache_key(path);
+  CachedFile *cf = find_cached_file(path, key);
+  if (!cf || !cf->tok)
+    load_file(path, key);
+  free(cwd);
+  cwd = NULL;
+}
+
+static void include_directive(Token *hash, Token *tok) {
+  bool is_dquote;
+  Token *start = tok;
+  char *filename = read_include_filename(&tok, tok, &is_dquote);
+  ctx->tok = tok;
+
+  char *path = NULL;
+  if (filename[0] != '/' && is_dquote) {
+    path = format("%s%s", dirname_of(ctx->path), filename);
+    if (!file_exists(path))
+      path = NULL;
+  }
+
+  if (!path)
+    path = search_include_paths(filename);
+  if (!path)
+    error_tok(start, "%s: cannot open file", filename);
+
+  // A precompiled header can stand in for the header included at
+  // the very beginning of the main file.
+  if (hash == main_start && opt_include_pch &&
+      load_pch(opt_include_pch, path))
+    return;
+
+  include_file(path, start);
+}
+
+//
+// Directives
+//
+
+// Executes a directive. `hash` is the "#" at the beginning of a
+// line in the current file context, which has already been consumed.
+static void directive(Token *hash) {
+  Token *tok = ctx->tok;
+
+  if (equal(tok, "include")) {
+    include_directive(hash, tok + 1);
+    return;
+  }
+
+  if (equal(tok, "define")) {
+    read_macro_definition(&ctx->tok, tok + 1);
+    return;
+  }
+
+  if (equal(tok, "undef")) {
+    tok++;
+    if (!is_ident(tok) || tok->at_bol)
+      error_tok(tok, "macro name must be an identifier");
+    hashmap_delete2(&macros, tok->name, tok->len);
+    ctx->tok = skip_line(tok + 1);
+    return;
+  }
+
+  if (equal(tok, "if")) {
+    int64_t val = eval_const_expr(&tok, tok);
+    push_cond_incl(hash, val);
+    ctx->tok = val ? tok : skip_cond_incl(tok);
+    return;
+  }
+
+  if (equal(tok, "ifdef") || equal(tok, "ifndef")) {
+    Token *name = tok + 1;
+    if (!is_ident(name) || name->at_bol)
+      error_tok(name, "macro name must be an identifier");
+
+    bool defined = hashmap_get2(&macros, name->name, name->len);
+    if (equal(tok, "ifndef"))
+      defined = !defined;
+
+    push_cond_incl(hash, defined);
+    tok = skip_line(name + 1);
+    ctx->tok = defined ? tok : skip_cond_incl(tok);
+    return;
+  }
+
+  if (equal(tok, "elif")) {
+    CondIncl *ci = current_cond_incl();
+    if (!ci || ci->ctx == IN_ELSE)
+      error_tok(hash, "stray #elif");
+    ci->ctx = IN_ELIF;
+
+    if (!ci->included && eval_const_expr(&tok, tok)) {
+      ci->included = true;
+      ctx->tok = tok;
+    } else {
+      ctx->tok = skip_cond_incl(skip_line(tok + 1));
+    }
+    return;
+  }
+
+  if (equal(tok, "else")) {
+    CondIncl *ci = current_cond_incl();
+    if (!ci || ci->ctx == IN_ELSE)
+      error_tok(hash, "stray #else");
+    ci->ctx = IN_ELSE;
+
+    tok = skip_line(tok + 1);
+    if (ci->included)
+      tok = skip_cond_incl(tok);
+    ctx->tok = tok;
+    return;
+  }
+
+  if (equal(tok, "endif")) {
+    if (!current_cond_incl())
+      error_tok(hash, "stray #endif");
+    cond_incl = cond_incl->next;
+    ctx->tok = skip_line(tok + 1);
+    return;
+  }
+
+  if (equal(tok, "pragma")) {
+    if (equal(tok + 1, "once") && !tok[1].at_bol)
+      hashmap_put(&pragma_once, ctx->path, (void *)1);
+    ctx->tok = skip_line(tok + 1);
+    return;
+  }
+
+  if (equal(tok, "error"))
+    error_tok(tok, "error");
+
+  // `#`-only line is legal. It's called a null directive.
+  if (tok->at_bol || tok->kind == TK_EOF)
+    return;
+
+  error_tok(tok, "invalid preprocessor directive");
+}
+
+// Reads tokens from the context stack, executing directives and
+// expanding macros, and appends them to `out`. Returns at the end
+// of the main file, or at the end of the context at the bottom of
+// an isolated expansion.
+static void preprocess2(TokenVec *out) {
+  // True if a macro at the beginning of a line has expanded to
+  // nothing, so the next token starts the line for -E.
+  bool bol = false;
+
+  for (;;) {
+    Token *tok = peek_token();
+
+    if (tok->kind == TK_EOF) {
+      if (ctx->kind != CTX_FILE || !ctx->next)
+        return;
+
+      // End of an included file
+      if (cond_incl != ctx->cond)
+        error_tok(cond_incl->tok, "unterminated conditional directive");
+      pop_context();
+      continue;
+    }
+    ctx->tok++;
+
+    if (ctx->kind == CTX_FILE && is_hash(tok)) {
+      directive(tok);
+      continue;
+    }
+
+    Macro *m = find_macro(tok);
+    if (m && m->disabled) {
+      Token t = *tok;
+      t.no_expand = true;
+      t.at_bol |= bol;
+      bol = false;
+      push_token(out, &t);
+      continue;
+    }
+
+    // Copy the token before looking for the arguments, which may
+    // pop the context `tok` belongs to.
+    Token t = *tok;
+    if (m && expand_macro(m, &t)) {
+      bol |= t.at_bol;
+      continue;
+    }
+    t.at_bol |= bol;
+    bol = false;
+    push_token(out, &t);
+  }
+}
+
+void define_macro(char *name, char *buf) {
+  Token *tok = tokenize(new_file("<built-in>", 0, buf));
+  add_macro(intern(name, strlen(name)), true, tok);
+}
+
+static Macro *add_builtin(char *name, macro_handler_fn *fn) {
+  Macro *m = add_macro(intern(name, strlen(name)), true, NULL);
+  m->handler = fn;
+  return m;
+}
+
+static Token *file_macro(Token *tmpl) {
+  char *name = "<built-in>";
+  if (tmpl->file_no)
+    name = get_file(tmpl->file_no)->name;
+  return tokenize_string(quote_string(name), tmpl);
+}
+
+static Token *line_macro(Token *tmpl) {
+  return new_num_token(tmpl->line_no, tmpl);
+}
+
+void init_macros(void) {
+  // Define predefined macros
+  define_macro("_LP64", "1");
+  define_macro("__C99_MACRO_WITH_VA_ARGS", "1");
+  define_macro("__ELF__", "1");
+  define_macro("__LP64__", "1");
+  define_macro("__SIZEOF_DOUBLE__", "8");
+  define_macro("__SIZEOF_FLOAT__", "4");
+  define_macro("__SIZEOF_INT__", "4");
+  define_macro("__SIZEOF_LONG_LONG__", "8");
+  define_macro("__SIZEOF_LONG__", "8");
+  define_macro("__SIZEOF_POINTER__", "8");
+  define_macro("__SIZEOF_SHORT__", "2");
+  define_macro("__STDC_HOSTED__", "1");
+  define_macro("__STDC_NO_ATOMICS__", "1");
+  define_macro("__STDC_NO_COMPLEX__", "1");
+  define_macro("__STDC_NO_THREADS__", "1");
+  define_macro("__STDC_NO_VLA__", "1");
+  define_macro("__STDC_UTF_16__", "1");
+  define_macro("__STDC_UTF_32__", "1");
+  define_macro("__STDC_VERSION__", "201112L");
+  define_macro("__STDC__", "1");
+  define_macro("__chibicc__", "1");
+  define_macro("__gnu_linux__", "1");
+  define_macro("__linux", "1");
+  define_macro("__linux__", "1");
+  define_macro("__loongarch64", "1");
+  define_macro("__loongarch__", "1");
+  define_macro("__loongarch_grlen", "64");
+  define_macro("__unix", "1");
+  define_macro("__unix__", "1");
+  define_macro("linux", "1");
+  define_macro("unix", "1");
+
+  add_builtin("__FILE__", file_macro);
+  add_builtin("__LINE__", line_macro);
+}
+
+//
+// Precompiled headers
+//
+
+static uint64_t hash_tokens(uint64_t h, Token *tok) {
+  for (; tok->kind != TK_EOF; tok++)
+    h = (h * 31 + fnv_hash(tok->loc, tok->len)) * 2 + tok->has_space;
+  return h;
+}
+
+// Returns a hash value of the macros defined by the user. A snapshot
+// of a header is only valid if the header sees the same macros.
+uint64_t macro_hash(void) {
+  uint64_t hash = 0;
+
+  for (HashEntry *ent = hashmap_next(&macros, NULL); ent;
+       ent = hashmap_next(&macros, ent)) {
+    Macro *m = ent->val;
+    if (m->handler)
+      continue;
+
+    uint64_t h = fnv_hash(m->name, strlen(m->name)) * 2 + m->is_objlike;
+    for (int i = 0; i < m->nparams; i++)
+      h = h * 31 + fnv_hash(m->params[i], strlen(m->params[i]));
+    if (m->va_args_name)
+      h = h * 31 + fnv_hash(m->va_args_name, strlen(m->va_args_name));
+
+    // Macros are visited in no particular order, so combine them
+    // with a commutative operation.
+    hash += hash_tokens(h, m->body);
+  }
+  return hash;
+}
+
+void save_macros(PchWriter *w) {
+  for (HashEntry *ent = hashmap_next(&macros, NULL); ent;
+       ent = hashmap_next(&macros, ent)) {
+    Macro *m = ent->val;
+    if (m->handler)
+      continue;
+
+    pch_write_int(w, 1);
+    pch_write_str(w, m->name);
+    pch_write_int(w, m->is_objlike);
+    pch_write_int(w, m->nparams);
+    for (int i = 0; i < m->nparams; i++)
+      pch_write_str(w, m->params[i]);
+    pch_write_str(w, m->va_args_name);
+
+    int len = 0;
+    while (m->body[len].kind != TK_EOF)
+      len++;
+    pch_write_int(w, len + 1);
+    for (int i = 0; i <= len; i++)
+      pch_write_token(w, &m->body[i]);
+  }
+  pch_write_int(w, 0);
+
+  for (HashEntry *ent = hashmap_next(&pragma_once, NULL); ent;
+       ent = hashmap_next(&pragma_once, ent)) {
+    pch_write_int(w, 1);
+    pch_write_str(w, ent->key);
+  }
+  pch_write_int(w, 0);
+
+  // Include guards let a translation unit using the snapshot skip
+  // these files without reading them.
+  if (main_guard) {
+    pch_write_int(w, 1);
+    pch_write_file(w, main_file_no);
+    pch_write_str(w, main_guard);
+  }
+
+  for (HashEntry *ent = hashmap_next(&file_cache, NULL); ent;
+       ent = hashmap_next(&file_cache, ent)) {
+    CachedFile *cf = ent->val;
+    if (cf->guard && cf->file->display_no) {
+      pch_write_int(w, 1);
+      pch_write_file(w, cf->file->file_no);
+      pch_write_str(w, cf->guard);
+    }
+  }
+  pch_write_int(w, 0);
+}
+
+static char *read_name(PchReader *r) {
+  char *s = pch_read_str(r);
+  return s ? intern(s, strlen(s)) : NULL;
+}
+
+// Replaces the user-defined macros with those of a snapshot.
+void load_macros(PchReader *r) {
+  for (HashEntry *ent = hashmap_next(&macros, NULL); ent;
+       ent = hashmap_next(&macros, ent))
+    if (!((Macro *)ent->val)->handler)
+      hashmap_delete(&macros, ent->key);
+
+  while (pch_read_int(r)) {
+    char *name = read_name(r);
+    if (!name)
+      pch_corrupted(r);
+    bool is_objlike = pch_read_int(r);
+    int nparams = pch_read_count(r);
+
+    char **params = arena_alloc(perm_arena, sizeof(char *) * (nparams + 1));
+    for (int i = 0; i < nparams; i++)
+      params[i] = read_name(r);
+    char *va_args_name = read_name(r);
+
+    int len = pch_read_count(r);
+    if (len < 1)
+      pch_corrupted(r);
+    Token *body = arena_alloc(perm_arena, sizeof(Token) * len);
+    for (int i = 0; i < len; i++)
+      pch_read_token(r, &body[i]);
+    if (body[len - 1].kind != TK_EOF)
+      pch_corrupted(r);
+
+    Macro *m = add_macro(name, is_objlike, body);
+    m->params = params;
+    m->nparams = nparams;
+    m->va_args_name = va_args_name;
+  }
+
+  while (pch_read_int(r)) {
+    char *path = pch_read_str(r);
+    if (!path)
+      pch_corrupted(r);
+    hashmap_put(&pragma_once, path, (void *)1);
+  }
+
+  while (pch_read_int(r)) {
+    int file_no = pch_read_file(r);
+    if (!file_no)
+      pch_corrupted(r);
+    File *file = get_file(file_no);
+    CachedFile *cf = arena_alloc(perm_arena, sizeof(CachedFile));
+    cf->file = file;
+    cf->guard = read_name(r);
+
+    // The snapshot has checked that the file is up to date.
+    struct stat st;
+    if (stat(file->name, &st))
+      continue;
+    cf->dev = st.st_dev;
+    cf->ino = st.st_ino;
+    cf->size = st.st_size;
+    cf->mtime = st.st_mtim;
+    cf->checked = generation;
+    hashmap_put(&file_cache, cache_key(file->name), cf);
+  }
+}
+
+// Entry point function of the preprocessor.
+Token *preprocess(Token *tok) {
+  char *path = "-";
+  if (tok->file_no) {
+    path = get_file(tok->file_no)->name;
+    add_input_file(tok->file_no);
+  }
+
+  generation++;
+  cwd = getcwd(NULL, 0);
+  if (!cwd)
+    error("getcwd failed: %s", strerror(errno));
+
+  main_start = tok;
+  main_file_no = tok->file_no;
+  main_guard = detect_include_guard(tok);
+
+  Context *c = push_context(CTX_FILE, tok);
+  c->path = path;
+
+  TokenVec out = {.is_heap = true};
+  preprocess2(&out);
+
+  if (cond_incl)
+    error_tok(cond_incl->tok, "unterminated conditional directive");
+
+  push_token(&out, ctx->tok);
+  ctx = NULL;
+  main_start = NULL;
+  free(cwd);
+  cwd = NULL;
+  arena_release(&pp_arena);
+  count_mem(MEM_TOKEN, out.len, sizeof(Token) * out.len);
+  return realloc(out.data, sizeof(Token) * out.len);
+}
@@ -0,0 +1,551 @@
+// This file implements a linear-scan register allocator (Poletto and
+// Sarkar, "Linear Scan Register Allocation", 1999).
+//
+// codegen.c lowers a function to machine instructions that operate on
+// an unlimited number of virtual registers. We compute the live
+// interval of each virtual register, which is the range of positions
+// from its first definition to its last use, widened to the basic
+// blocks it is live across. Intervals are then visited in order of
+// their start, and each is given a register that is free at that
+// point. Only if none is free, the interval that ends last is spilled
+// to a stack slot.
+//
+// Calls clobber the temporaries, so values that are live across a call
+// get callee-saved registers ($s0-$s8), which the prologue saves.
+// Other values prefer the temporaries ($t0-$t6). $t7 and $t8 are not
+// allocated; they hold spilled values while they are being used.
+
+#include "chibicc.h"
+#include <limits.h>
+
+#define SCRATCH1 19 // $t7
+#define SCRATCH2 20 // $t8
+
+// Allocatable registers in the order of preference
+static int temp_regs[] = {12, 13, 14, 15, 16, 17, 18};
+static int saved_regs[] = {23, 24, 25, 26, 27, 28, 29, 30, 31};
+
+#define NUM_REGS (sizeof(temp_regs) / sizeof(*temp_regs) + \
+                  sizeof(saved_regs) / sizeof(*saved_regs))
+
+typedef struct {
+  int first; // Index of the first instruction
+  int last;  // Index of the last instruction
+  int succ[2];
+  uint64_t *use; // Global registers read before written
+  uint64_t *def;
+  uint64_t *in;  // Global registers live on entry
+  uint64_t *out; // Global registers live on exit
+} Block;
+
+typedef struct {
+  char *sym;
+  int no;
+  int block;
+} LabelEntry;
+
+typedef struct {
+  MFunc *mf;
+  Block *blocks;
+  int nblocks;
+  LabelEntry *labels;
+  int labels_cap;
+
+  // Indexed by virtual register number - FIRST_VREG
+  int *start;    // Live interval, in positions
+  int *end;
+  int *gidx;     // Index in the bitsets, or -1 if local to a block
+  int *def_block;
+  int *loc;      // Assigned register, or ~slot if spilled
+  int nglobals;
+} RA;
+
+// Each instruction has two positions: it reads its operands at 2i and
+// writes its result at 2i+1. So an instruction can write to the
+// register of an operand whose interval ends there.
+static int use_pos(int i) { return i * 2; }
+static int def_pos(int i) { return i * 2 + 1; }
+
+static bool is_vreg(int r) {
+  return r >= FIRST_VREG;
+}
+
+// Stores pointers to the registers `mi` reads to `uses` and returns
+// their number.
+static int get_uses(MInsn *mi, int **uses) {
+  switch (mi->kind) {
+  case MI_RRR:
+    uses[0] = &mi->rj;
+    uses[1] = &mi->rk;
+    return 2;
+  case MI_RRI:
+  case MI_RR:
+  case MI_MOVE:
+  case MI_LOAD:
+  case MI_BZ:
+    uses[0] = &mi->rj;
+    return 1;
+  case MI_STORE:
+  case MI_BR:
+    uses[0] = &mi->rd;
+    uses[1] = &mi->rj;
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+// Returns a pointer to the register `mi` writes, or NULL.
+static int *get_def(MInsn *mi) {
+  switch (mi->kind) {
+  case MI_RRR:
+  case MI_RRI:
+  case MI_RR:
+  case MI_LI:
+  case MI_LA:
+  case MI_MOVE:
+  case MI_LOAD:
+    return &mi->rd;
+  default:
+    return NULL;
+  }
+}
+
+static bool is_jump(MInsn *mi) {
+  return mi->kind == MI_JUMP || mi->kind == MI_BZ || mi->kind == MI_BR ||
+         mi->kind == MI_RET;
+}
+
+static uint32_t hash_label(char *sym, int no) {
+  uint32_t hash = 2166136261 ^ no;
+  for (char *p = sym; *p; p++)
+    hash = (hash ^ (unsigned char)*p) * 16777619;
+  return hash;
+}
+
+static LabelEntry *find_label(RA *ra, char *sym, int no) {
+  uint32_t mask = ra->labels_cap - 1;
+  for (uint32_t i = hash_label(sym, no) & mask;; i = (i + 1) & mask) {
+    LabelEntry *ent = &ra->labels[i];
+    if (!ent->sym || (ent->no == no && !strcmp(ent->sym, sym)))
+      return ent;
+  }
+}
+
+// Splits the instructions into basic blocks and links them.
+static void build_cfg(RA *ra) {
+  MFunc *mf = ra->mf;
+
+  int nlabels = 0;
+  int nblocks = 1;
+  for (int i = 0; i < mf->ninsns; i++) {
+    if (mf->insns[i].kind == MI_LABEL)
+      nlabels++;
+    if (mf->insns[i].kind == MI_LABEL || is_jump(&mf->insns[i]))
+      nblocks++;
+  }
+
+  ra->labels_cap = 16;
+  while (ra->labels_cap < nlabels * 2)
+    ra->labels_cap *= 2;
+  ra->labels = calloc(ra->labels_cap, sizeof(LabelEntry));
+  ra->blocks = calloc(nblocks, sizeof(Block));
+
+  bool leader = true;
+  for (int i = 0; i < mf->ninsns; i++) {
+    MInsn *mi = &mf->insns[i];
+    if (leader || mi->kind == MI_LABEL) {
+      ra->blocks[ra->nblocks++].first = i;
+      leader = false;
+    }
+    ra->blocks[ra->nblocks - 1].last = i;
+
+    if (mi->kind == MI_LABEL) {
+      LabelEntry *ent = find_label(ra, mi->sym, mi->label_no);
+      *ent = (LabelEntry){mi->sym, mi->label_no, ra->nblocks - 1};
+    }
+    if (is_jump(mi))
+      leader = true;
+  }
+
+  for (int i = 0; i < ra->nblocks; i++) {
+    Block *bb = &ra->blocks[i];
+    MInsn *mi = &mf->insns[bb->last];
+    bb->succ[0] = bb->succ[1] = -1;
+
+    if (mi->kind == MI_JUMP || mi->kind == MI_BZ || mi->kind == MI_BR) {
+      LabelEntry *ent = find_label(ra, mi->sym, mi->label_no);
+      assert(ent->sym);
+      bb->succ[0] = ent->block;
+    }
+    if (mi->kind != MI_JUMP && mi->kind != MI_RET && i + 1 < ra->nblocks)
+      bb->succ[1] = i + 1;
+  }
+}
+
+static void set_bit(uint64_t *set, int i) {
+  set[i / 64] |= 1ULL << (i % 64);
+}
+
+static bool get_bit(uint64_t *set, int i) {
+  return set[i / 64] & (1ULL << (i % 64));
+}
+
+// Computes the first and last positions of the virtual registers
+// within blocks, and finds the ones that are live across blocks.
+static void scan_local(RA *ra) {
+  MFunc *mf = ra->mf;
+
+  for (int i = 0; i < mf->nvregs; i++) {
+    ra->start[i] = INT_MAX;
+    ra->end[i] = -1;
+    ra->gidx[i] = -1;
+    ra->def_block[i] = -1;
+  }
+
+  for (int b = 0; b < ra->nblocks; b++) {
+    for (int i = ra->blocks[b].first; i <= ra->blocks[b].last; i++) {
+      MInsn *mi = &mf->insns[i];
+      int *uses[2];
+      int nuses = get_uses(mi, uses);
+
+      for (int j = 0; j < nuses; j++) {
+        int r = *uses[j];
+        assert(r != NO_REG);
+        if (!is_vreg(r))
+          continue;
+        r -= FIRST_VREG;
+        ra->start[r] = MIN(ra->start[r], use_pos(i));
+        ra->end[r] = MAX(ra->end[r], use_pos(i));
+        if (ra->def_block[r] != b && ra->gidx[r] == -1)
+          ra->gidx[r] = ra->nglobals++;
+      }
+
+      int *def = get_def(mi);
+      if (def && is_vreg(*def)) {
+        int r = *def - FIRST_VREG;
+        ra->start[r] = MIN(ra->start[r], def_pos(i));
+        ra->end[r] = MAX(ra->end[r], def_pos(i));
+        ra->def_block[r] = b;
+      }
+    }
+  }
+}
+
+// Computes the liveness of the registers that are live across blocks
+// and extends their intervals over the blocks they are live in.
+static void scan_global(RA *ra) {
+  MFunc *mf = ra->mf;
+  int nwords = (ra->nglobals + 63) / 64;
+  uint64_t *sets = calloc((size_t)ra->nblocks * nwords * 4, sizeof(uint64_t));
+
+  for (int b = 0; b < ra->nblocks; b++) {
+    Block *bb = &ra->blocks[b];
+    bb->use = sets + (size_t)b * nwords * 4;
+    bb->def = bb->use + nwords;
+    bb->in = bb->def + nwords;
+    bb->out = bb->in + nwords;
+
+    for (int i = bb->first; i <= bb->last; i++) {
+      MInsn *mi = &mf->insns[i];
+      int *uses[2];
+      int nuses = get_uses(mi, uses);
+      for (int j = 0; j < nuses; j++) {
+        if (!is_vreg(*uses[j]))
+          continue;
+        int g = ra->gidx[*uses[j] - FIRST_VREG];
+        if (g != -1 && !get_bit(bb->def, g))
+          set_bit(bb->use, g);
+      }
+
+      int *def = get_def(mi);
+      if (def && is_vreg(*def)) {
+        int g = ra->gidx[*def - FIRST_VREG];
+        if (g != -1)
+          set_bit(bb->def, g);
+      }
+    }
+  }
+
+  // in = use | (out - def), out = union of in of successors
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (int b = ra->nblocks - 1; b >= 0; b--) {
+      Block *bb = &ra->blocks[b];
+      for (int w = 0; w < nwords; w++) {
+        uint64_t out = 0;
+        for (int s = 0; s < 2; s++)
+          if (bb->succ[s] != -1)
+            out |= ra->blocks[bb->succ[s]].in[w];
+        uint64_t in = bb->use[w] | (out & ~bb->def[w]);
+        if (out != bb->out[w] || in != bb->in[w])
+          changed = true;
+        bb->out[w] = out;
+        bb->in[w] = in;
+      }
+    }
+  }
+
+  int *vregs = calloc(ra->nglobals, sizeof(int));
+  for (int i = 0; i < mf->nvregs; i++)
+    if (ra->gidx[i] != -1)
+      vregs[ra->gidx[i]] = i;
+
+  for (int b = 0; b < ra->nblocks; b++) {
+    Block *bb = &ra->blocks[b];
+    for (int g = 0; g < ra->nglobals; g++) {
+      int r = vregs[g];
+      if (get_bit(bb->in, g)) {
+        ra->start[r] = MIN(ra->start[r], use_pos(bb->first));
+        ra->end[r] = MAX(ra->end[r], use_pos(bb->first));
+      }
+      if (get_bit(bb->out, g)) {
+        ra->start[r] = MIN(ra->start[r], def_pos(bb->last));
+        ra->end[r] = MAX(ra->end[r], def_pos(bb->last));
+      }
+    }
+  }
+
+  free(vregs);
+  free(sets);
+}
+
+static bool is_saved_reg(int r) {
+  return r >= REG_S0;
+}
+
+// Assigns registers to intervals in order of their start.
+static void linear_scan(RA *ra) {
+  MFunc *mf = ra->mf;
+
+  // calls[i] is the number of calls before instruction i.
+  int *calls = calloc(mf->ninsns + 1, sizeof(int));
+  for (int i = 0; i < mf->ninsns; i++)
+    calls[i + 1] = calls[i] + (mf->insns[i].kind == MI_CALL);
+
+  // Sort the intervals by start. Positions are small integers, so
+  // counting sort is enough.
+  int npos = def_pos(mf->ninsns) + 1;
+  int *pos = calloc(npos + 1, sizeof(int));
+  for (int i = 0; i < mf->nvregs; i++)
+    if (ra->end[i] != -1)
+      pos[ra->start[i] + 1]++;
+  for (int i = 0; i < npos; i++)
+    pos[i + 1] += pos[i];
+
+  int n = pos[npos];
+  int *order = calloc(n + 1, sizeof(int));
+  for (int i = 0; i < mf->nvregs; i++)
+    if (ra->end[i] != -1)
+      order[pos[ra->start[i]]++] = i;
+  free(pos);
+
+  // Active intervals, sorted by end
+  int active[NUM_REGS];
+  int nactive = 0;
+  uint32_t free_regs = 0;
+  for (int i = 0; i < sizeof(temp_regs) / sizeof(*temp_regs); i++)
+    free_regs |= 1u << temp_regs[i];
+  for (int i = 0; i < sizeof(saved_regs) / sizeof(*saved_regs); i++)
+    free_regs |= 1u << saved_regs[i];
+
+  for (int i = 0; i < n; i++) {
+    int r = order[i];
+    int start = ra->start[r];
+    int end = ra->end[r];
+
+    // Expire intervals that ended before this one starts.
+    int k = 0;
+    while (k < nactive && ra->end[active[k]] < start)
+      free_regs |= 1u << ra->loc[active[k++]];
+    memmove(active, active + k, (nactive - k) * sizeof(int));
+    nactive -= k;
+
+    // A value is live across a call at instruction c if it is
+    // written before c and read after it.
+    int first = start / 2 + 1;
+    int last = end / 2 - 1;
+    bool across_call = first <= last && calls[last + 1] - calls[first] > 0;
+
+    int reg = -1;
+    if (!across_call)
+      for (int j = 0; j < sizeof(temp_regs) / sizeof(*temp_regs); j++)
+        if (free_regs & (1u << temp_regs[j]))
+          { reg = temp_regs[j]; break; }
+    if (reg == -1)
+      for (int j = 0; j < sizeof(saved_regs) / sizeof(*saved_regs); j++)
+        if (free_regs & (1u << saved_regs[j]))
+          { reg = saved_regs[j]; break; }
+
+    if (reg == -1) {
+      // Spill the interval that ends last, which is either this one
+      // or an active one whose register this one can use.
+      int victim = -1;
+      for (int j = nactive - 1; j >= 0; j--) {
+        if (!across_call || is_saved_reg(ra->loc[active[j]])) {
+          victim = j;
+          break;
+        }
+      }
+
+      if (victim == -1 || ra->end[active[victim]] <= end) {
+        ra->loc[r] = ~mf->nslots++;
+        continue;
+      }
+
+      reg = ra->loc[active[victim]];
+      ra->loc[active[victim]] = ~mf->nslots++;
+      memmove(active + victim, active + victim + 1,
+              (nactive - victim - 1) * sizeof(int));
+      nactive--;
+    } else {
+      free_regs &= ~(1u << reg);
+    }
+
+    ra->loc[r] = reg;
+    if (is_saved_reg(reg))
+      mf->saved |= 1u << reg;
+
+    int j = nactive++;
+    while (j > 0 && ra->end[active[j - 1]] > end) {
+      active[j] = active[j - 1];
+      j--;
+    }
+    active[j] = r;
+  }
+
+  free(order);
+  free(calls);
+}
+
+// Output of rewrite()
+static _Thread_local MInsn *out_insns;
+static _Thread_local int out_len;
+static _Thread_local int out_cap;
+
+static MInsn *add_insn(MInsn mi) {
+  if (out_len == out_cap) {
+    out_cap *= 2;
+    out_insns = realloc(out_insns, sizeof(MInsn) * out_cap);
+  }
+  out_insns[out_len] = mi;
+  return &out_insns[out_len++];
+}
+
+// Emits a load or a store of `reg` at $fp + offset. `tmp` is used to
+// compute the address if the offset doesn't fit in an immediate.
+static void add_frame_access(MInsnKind kind, int reg, int offset, int tmp) {
+  int base = REG_FP;
+  if (offset < -2048 || 2047 < offset) {
+    add_insn((MInsn){.kind = MI_LI, .op = "li.d", .rd = tmp, .imm = offset});
+    add_insn((MInsn){.kind = MI_RRR, .op = "add.d", .rd = tmp, .rj = tmp,
+                     .rk = REG_FP});
+    base = tmp;
+    offset = 0;
+  }
+  add_insn((MInsn){.kind = kind, .op = kind == MI_LOAD ? "ld.d" : "st.d",
+                   .rd = reg, .rj = base, .imm = offset, .is_spill = true});
+}
+
+static int slot_offset(MFunc *mf, int slot) {
+  return mf->slot_base - (slot + 1) * 8;
+}
+
+// Replaces virtual registers with the assigned ones and inserts code
+// to load and store spilled values.
+static void rewrite(RA *ra) {
+  MFunc *mf = ra->mf;
+
+  // Without spill code, instructions are never added, so they are
+  // rewritten in place.
+  out_len = 0;
+  if (mf->nslots) {
+    out_cap = mf->ninsns + mf->ninsns / 4 + 16;
+    out_insns = malloc(sizeof(MInsn) * out_cap);
+  } else {
+    out_cap = mf->cap;
+    out_insns = mf->insns;
+  }
+
+  for (int i = 0; i < mf->ninsns; i++) {
+    MInsn mi = mf->insns[i];
+
+    int *uses[2];
+    int nuses = get_uses(&mi, uses);
+    int reloaded = NO_REG;
+
+    for (int j = 0; j < nuses; j++) {
+      int r = *uses[j];
+      if (!is_vreg(r))
+        continue;
+
+      int loc = ra->loc[r - FIRST_VREG];
+      if (loc >= 0) {
+        *uses[j] = loc;
+        continue;
+      }
+
+      // Use $t7 for the first spilled operand and $t8 for the second,
+      // unless both are the same.
+      if (r == reloaded) {
+        *uses[j] = SCRATCH1;
+        continue;
+      }
+      int tmp = reloaded == NO_REG ? SCRATCH1 : SCRATCH2;
+      add_frame_access(MI_LOAD, tmp, slot_offset(mf, ~loc), tmp);
+      reloaded = r;
+      *uses[j] = tmp;
+    }
+
+    int *def = get_def(&mi);
+    int spill_slot = -1;
+    if (def && is_vreg(*def)) {
+      int loc = ra->loc[*def - FIRST_VREG];
+      if (loc >= 0) {
+        *def = loc;
+      } else {
+        *def = SCRATCH1;
+        spill_slot = ~loc;
+      }
+    }
+
+    // Moves between the same register are no-ops.
+    if (mi.kind == MI_MOVE && mi.rd == mi.rj)
+      continue;
+
+    add_insn(mi);
+    if (spill_slot != -1)
+      add_frame_access(MI_STORE, SCRATCH1, slot_offset(mf, spill_slot),
+                       SCRATCH2);
+  }
+
+  if (out_insns != mf->insns)
+    free(mf->insns);
+  mf->insns = out_insns;
+  mf->ninsns = out_len;
+  mf->cap = out_cap;
+}
+
+void regalloc(MFunc *mf) {
+  RA ra = {mf};
+  mf->nslots = 0;
+  mf->saved = 0;
+
+  int n = mf->nvregs;
+  ra.start = calloc(n * 5 + 1, sizeof(int));
+  ra.end = ra.start + n;
+  ra.gidx = ra.end + n;
+  ra.def_block = ra.gidx + n;
+  ra.loc = ra.def_block + n;
+
+  build_cfg(&ra);
+  scan_local(&ra);
+  if (ra.nglobals)
+    scan_global(&ra);
+  linear_scan(&ra);
+  rewrite(&ra);
+
+  free(ra.start);
+  free(ra.blocks);
+  free(ra.labels);
+}
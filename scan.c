@@ -0,0 +1,107 @@
+// This file contains the character-class scanners used by the
+// tokenizer to skip over runs of whitespace, comment bodies and
+// identifiers.
+//
+// On x86-64 we look at 16 bytes at a time with SSE2. Each scanner
+// computes a bitmask of "stop" bytes in a block and returns the
+// position of the first one. Every stop set contains '\0', so a
+// scanner never runs past the end of the input.
+//
+// Blocks are loaded from 16-byte aligned addresses. Such a load
+// never crosses a page boundary, so it is safe to read a few bytes
+// beyond the terminating '\0', although it is still an out-of-bounds
+// access as far as AddressSanitizer is concerned.
+
+#include "chibicc.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+#if defined(__GNUC__) || defined(__clang__)
+#define NO_ASAN __attribute__((no_sanitize_address))
+#else
+#define NO_ASAN
+#endif
+
+static int eq(__m128i v, char c) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
+
+// Returns a bitmask of bytes in the range [lo, hi]. Bytes >= 0x80
+// compare as negative, so they never match a range of ASCII chars.
+static int range(__m128i v, char lo, char hi) {
+  __m128i ge = _mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1));
+  __m128i le = _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1));
+  return _mm_movemask_epi8(_mm_and_si128(ge, le));
+}
+
+// ' ', '\t', '\v', '\f' and '\r'
+static int blank_mask(__m128i v) {
+  return eq(v, ' ') | (range(v, '\t', '\r') & ~eq(v, '\n'));
+}
+
+// [0-9A-Za-z_]
+static int ident_mask(__m128i v) {
+  __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  return range(lower, 'a', 'z') | range(v, '0', '9') | eq(v, '_');
+}
+
+static int comment_stop_mask(__m128i v) {
+  return eq(v, '*') | eq(v, '\n') | eq(v, '\0');
+}
+
+static int newline_mask(__m128i v) {
+  return eq(v, '\n') | eq(v, '\0');
+}
+
+// Returns the first byte at or after p for which `stop` is set.
+NO_ASAN static char *scan(char *p, int (*stop)(__m128i)) {
+  int off = (uintptr_t)p & 15;
+  char *q = p - off;
+  unsigned mask = stop(_mm_load_si128((__m128i *)q)) & (0xffff << off);
+
+  while (!mask) {
+    q += 16;
+    mask = stop(_mm_load_si128((__m128i *)q));
+  }
+  return q + __builtin_ctz(mask);
+}
+
+static int not_blank(__m128i v) { return ~blank_mask(v) & 0xffff; }
+static int not_ident(__m128i v) { return ~ident_mask(v) & 0xffff; }
+
+NO_ASAN char *skip_blanks(char *p) { return scan(p, not_blank); }
+NO_ASAN char *skip_ident(char *p) { return scan(p, not_ident); }
+NO_ASAN char *find_comment_stop(char *p) { return scan(p, comment_stop_mask); }
+NO_ASAN char *find_newline(char *p) { return scan(p, newline_mask); }
+
+#else
+
+// Portable fallback
+
+char *skip_blanks(char *p) {
+  while (*p == ' ' || *p == '\t' || *p == '\v' || *p == '\f' || *p == '\r')
+    p++;
+  return p;
+}
+
+char *skip_ident(char *p) {
+  while (('a' <= *p && *p <= 'z') || ('A' <= *p && *p <= 'Z') ||
+         ('0' <= *p && *p <= '9') || *p == '_')
+    p++;
+  return p;
+}
+
+char *find_comment_stop(char *p) {
+  while (*p && *p != '*' && *p != '\n')
+    p++;
+  return p;
+}
+
+char *find_newline(char *p) {
+  while (*p && *p != '\n')
+    p++;
+  return p;
+}
+
+#endif
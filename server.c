@@ -0,0 +1,383 @@
+// This file implements a compile server and its client.
+//
+// Every compiler process has to read and tokenize the same system
+// headers again. With `--server <socket>`, chibicc keeps running and
+// accepts compile requests on a Unix domain socket instead.
+// `--connect <socket> <args>...` is a thin client that sends its
+// arguments, current directory and standard file descriptors to the
+// server and exits with the status of the compilation.
+//
+// Each request is compiled by a fork of the server, so it starts with
+// the server's state already warm: interned identifiers, tokenized
+// headers along with their include guards, and the predefined macros.
+// A crash in a compilation cannot take the server down either.
+//
+// A fork cannot update its parent's memory, so a child reports the
+// paths of the headers it had to read to the server through a pipe,
+// and the server reads them too, so that the next request finds them
+// in the cache. Once every process of a request has exited, the pipe
+// reaches end-of-file, and the server sends the exit status to the
+// client.
+
+// For struct ucred
+#define _GNU_SOURCE
+#include "chibicc.h"
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Upper limit of the size of a request
+#define MAX_REQUEST (1024 * 1024)
+
+typedef struct {
+  int conn;    // Connection to the client
+  int report;  // Read end of the child's report pipe
+  pid_t pid;
+  char *cwd;   // Working directory of the client
+  char buf[PIPE_BUF];
+  int buflen;
+} Request;
+
+// Write end of the report pipe if this process compiles a request
+static int report_fd = -1;
+
+// Tells the server that a header has been read, so that the server
+// can cache it for later requests. Each path is written by a single
+// write() no longer than PIPE_BUF, which is atomic, so records from
+// parallel jobs of the same request are not interleaved.
+void report_header(char *path) {
+  if (report_fd == -1)
+    return;
+
+  int len = strlen(path) + 1;
+  if (len <= PIPE_BUF)
+    write(report_fd, path, len);
+}
+
+static void init_addr(struct sockaddr_un *addr, char *path) {
+  *addr = (struct sockaddr_un){.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr->sun_path))
+    error("socket path too long: %s", path);
+  strcpy(addr->sun_path, path);
+}
+
+static bool read_full(int fd, void *buf, int len) {
+  for (char *p = buf; len > 0;) {
+    ssize_t n = read(fd, p, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool write_full(int fd, void *buf, int len) {
+  for (char *p = buf; len > 0;) {
+    ssize_t n = write(fd, p, len);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+//
+// Client
+//
+
+// A request consists of a message carrying the client's stdin, stdout
+// and stderr along with the length of the payload, followed by the
+// payload itself, which is the working directory and the arguments,
+// each terminated by '\0'.
+int run_client(char *path, int argc, char **argv) {
+  struct sockaddr_un addr;
+  init_addr(&addr, path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+    error("cannot connect to %s: %s", path, strerror(errno));
+
+  char *cwd = getcwd(NULL, 0);
+  if (!cwd)
+    error("getcwd failed: %s", strerror(errno));
+
+  int len = strlen(cwd) + 1;
+  for (int i = 0; i < argc; i++)
+    len += strlen(argv[i]) + 1;
+  if (len > MAX_REQUEST)
+    error("too many arguments");
+
+  char *payload = malloc(len);
+  char *p = stpcpy(payload, cwd) + 1;
+  for (int i = 0; i < argc; i++)
+    p = stpcpy(p, argv[i]) + 1;
+
+  int fds[] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+  char cbuf[CMSG_SPACE(sizeof(fds))] = {};
+  struct iovec iov = {.iov_base = &len, .iov_len = sizeof(len)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cbuf,
+    .msg_controllen = sizeof(cbuf),
+  };
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+  if (sendmsg(fd, &msg, 0) != sizeof(len) || !write_full(fd, payload, len))
+    error("cannot send a request to %s: %s", path, strerror(errno));
+
+  int status;
+  if (!read_full(fd, &status, sizeof(status)))
+    error("%s: connection closed by server", path);
+
+  if (WIFSIGNALED(status)) {
+    fprintf(stderr, "compiler killed by signal %d\n", WTERMSIG(status));
+    return 1;
+  }
+  return WEXITSTATUS(status);
+}
+
+//
+// Server
+//
+
+static Request **reqs;
+static int nreqs;
+
+// Receives a request and returns its arguments. `fds` receives the
+// client's standard file descriptors.
+static char **recv_request(int conn, int *fds, char **cwd, int *argc) {
+  int len;
+  char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+  struct iovec iov = {.iov_base = &len, .iov_len = sizeof(len)};
+  struct msghdr msg = {
+    .msg_iov = &iov,
+    .msg_iovlen = 1,
+    .msg_control = cbuf,
+    .msg_controllen = sizeof(cbuf),
+  };
+
+  if (recvmsg(conn, &msg, 0) != sizeof(len))
+    return NULL;
+
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * 3))
+    return NULL;
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * 3);
+
+  char *payload = NULL;
+  if (len < 1 || len > MAX_REQUEST || !(payload = malloc(len)) ||
+      !read_full(conn, payload, len) || payload[len - 1]) {
+    for (int i = 0; i < 3; i++)
+      close(fds[i]);
+    free(payload);
+    return NULL;
+  }
+
+  *cwd = payload;
+  char *end = payload + len;
+  char *p = payload + strlen(payload) + 1;
+
+  // argv[0] is the program name, and argv[argc] is NULL.
+  char **argv = calloc(len + 2, sizeof(char *));
+  argv[0] = "chibicc";
+  *argc = 1;
+  for (; p < end; p += strlen(p) + 1)
+    argv[(*argc)++] = p;
+  return argv;
+}
+
+// Compiles a request in a child process. Never returns.
+static void serve_request(int listen_fd, int *fds, char *cwd, int argc,
+                          char **argv, int report) {
+  close(listen_fd);
+  for (int i = 0; i < nreqs; i++) {
+    close(reqs[i]->conn);
+    close(reqs[i]->report);
+  }
+
+  for (int i = 0; i < 3; i++) {
+    dup2(fds[i], i);
+    close(fds[i]);
+  }
+  signal(SIGPIPE, SIG_DFL);
+  report_fd = report;
+
+  if (chdir(cwd))
+    error("cannot change directory to %s: %s", cwd, strerror(errno));
+  exit(run_driver(argc, argv));
+}
+
+// A request runs with the server's privileges, so only the user
+// running the server may send one.
+static bool is_trusted_peer(int conn) {
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    return false;
+  return cred.uid == getuid();
+}
+
+static void accept_request(int listen_fd) {
+  int conn = accept(listen_fd, NULL, NULL);
+  if (conn == -1)
+    return;
+
+  if (!is_trusted_peer(conn)) {
+    close(conn);
+    return;
+  }
+
+  int fds[3];
+  char *cwd;
+  int argc;
+  char **argv = recv_request(conn, fds, &cwd, &argc);
+  if (!argv) {
+    close(conn);
+    return;
+  }
+
+  int pipefd[2];
+  if (pipe(pipefd))
+    error("pipe failed: %s", strerror(errno));
+
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid == -1)
+    error("fork failed: %s", strerror(errno));
+
+  if (pid == 0) {
+    close(pipefd[0]);
+    serve_request(listen_fd, fds, cwd, argc, argv, pipefd[1]);
+  }
+
+  for (int i = 0; i < 3; i++)
+    close(fds[i]);
+  close(pipefd[1]);
+  free(argv);
+
+  Request *req = calloc(1, sizeof(Request));
+  req->conn = conn;
+  req->report = pipefd[0];
+  req->pid = pid;
+  req->cwd = cwd;
+
+  reqs = realloc(reqs, sizeof(Request *) * (nreqs + 1));
+  reqs[nreqs++] = req;
+}
+
+// Reads reported header paths and caches them. Paths are relative to
+// the client's working directory.
+static void read_reports(Request *req, int server_cwd) {
+  if (chdir(req->cwd))
+    return;
+
+  char *p = req->buf;
+  char *end = req->buf + req->buflen;
+  for (char *nul; (nul = memchr(p, '\0', end - p)); p = nul + 1)
+    preload_file(p);
+
+  req->buflen = end - p;
+  memmove(req->buf, p, req->buflen);
+  fchdir(server_cwd);
+}
+
+static void finish_request(int idx) {
+  Request *req = reqs[idx];
+
+  int status;
+  while (waitpid(req->pid, &status, 0) == -1)
+    if (errno != EINTR)
+      error("waitpid failed: %s", strerror(errno));
+
+  // The client may have gone away. SIGPIPE is ignored, so that
+  // doesn't kill the server.
+  write_full(req->conn, &status, sizeof(status));
+
+  close(req->conn);
+  close(req->report);
+  free(req->cwd);
+  free(req);
+  reqs[idx] = reqs[--nreqs];
+}
+
+int run_server(char *path) {
+  struct sockaddr_un addr;
+  init_addr(&addr, path);
+
+  // Remove a socket left behind by a previous server.
+  struct stat st;
+  if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+    unlink(path);
+
+  // Create the socket accessible only to the owner regardless of the
+  // umask.
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd == -1)
+    error("cannot listen on %s: %s", path, strerror(errno));
+
+  mode_t mask = umask(077);
+  int r = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+
+  if (r || chmod(path, 0600) || listen(listen_fd, 64))
+    error("cannot listen on %s: %s", path, strerror(errno));
+
+  int server_cwd = open(".", O_RDONLY | O_DIRECTORY);
+  if (server_cwd == -1)
+    error("cannot open the current directory: %s", strerror(errno));
+
+  signal(SIGPIPE, SIG_IGN);
+
+  struct pollfd *pfds = NULL;
+
+  for (;;) {
+    pfds = realloc(pfds, sizeof(struct pollfd) * (nreqs + 1));
+    pfds[0] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+    for (int i = 0; i < nreqs; i++)
+      pfds[i + 1] = (struct pollfd){.fd = reqs[i]->report, .events = POLLIN};
+
+    int n = nreqs;
+    if (poll(pfds, n + 1, -1) == -1) {
+      if (errno == EINTR)
+        continue;
+      error("poll failed: %s", strerror(errno));
+    }
+
+    // Go backwards because finish_request() moves the last request
+    // into the slot of a finished one.
+    for (int i = n - 1; i >= 0; i--) {
+      if (!pfds[i + 1].revents)
+        continue;
+
+      Request *req = reqs[i];
+      ssize_t len = read(req->report, req->buf + req->buflen,
+                         sizeof(req->buf) - req->buflen);
+      if (len > 0) {
+        req->buflen += len;
+        read_reports(req, server_cwd);
+      } else if (len == 0 || errno != EINTR) {
+        finish_request(i);
+      }
+    }
+
+    if (pfds[0].revents & POLLIN)
+      accept_request(listen_fd);
+  }
+}
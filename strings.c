@@ -1,15 +1,33 @@
 #include "chibicc.h"
 
+void strarray_push(StringArray *arr, char *s) {
+  if (!arr->data) {
+    arr->data = calloc(8, sizeof(char *));
+    arr->capacity = 8;
+  }
+
+  if (arr->capacity == arr->len) {
+    arr->data = realloc(arr->data, sizeof(char *) * arr->capacity * 2);
+    arr->capacity *= 2;
+    for (int i = arr->len; i < arr->capacity; i++)
+      arr->data[i] = NULL;
+  }
+
+  arr->data[arr->len++] = s;
+}
+
 // Takes a printf-style format string and returns a formatted string.
 char *format(char *fmt, ...) {
-  char *buf;
-  size_t buflen;
-  FILE *out = open_memstream(&buf, &buflen);
-
-  va_list ap;
+  va_list ap, ap2;
   va_start(ap, fmt);
-  vfprintf(out, fmt, ap);
+  va_copy(ap2, ap);
+
+  int len = vsnprintf(NULL, 0, fmt, ap);
+  char *buf = arena_alloc(perm_arena, len + 1);
+  count_mem(MEM_STRING, 1, len + 1);
+  vsnprintf(buf, len + 1, fmt, ap2);
+
+  va_end(ap2);
   va_end(ap);
-  fclose(out);
   return buf;
 }
\ No newline at end of file
@@ -16,6 +16,7 @@ int main() {
   ASSERT(1, 42==42);
   ASSERT(1, 0!=1);
   ASSERT(0, 42!=42);
+  ASSERT(1, 42!=41);
 
   ASSERT(1, 0<1);
   ASSERT(0, 1<1);
@@ -22,4 +22,165 @@ check -o
 ./chibicc --help 2>&1 | grep -q chibicc
 check --help
 
+# -E
+echo foo > $tmp/out.c
+echo "#include \"$tmp/out.c\"" > $tmp/e.c
+./chibicc -E $tmp/e.c | grep -q foo
+check -E
+
+./chibicc -E -o $tmp/out $tmp/e.c
+cat $tmp/out | grep -q foo
+check '-E and -o'
+
+printf '#define T x\n#define E\n#define ONE 1\nint\nT;\nONE\nONE\nE\nint y;\n' > $tmp/e2.c
+[ "`./chibicc -E $tmp/e2.c`" = "`printf 'int\nx;\n1\n1\nint y;'`" ]
+check '-E keeps line breaks around macros'
+
+# -I
+mkdir $tmp/dir
+echo foo > $tmp/dir/i-option-test
+echo "#include \"i-option-test\"" > $tmp/i.c
+./chibicc -I$tmp/dir -E $tmp/i.c | grep -q foo
+check -I
+./chibicc -I $tmp/dir -E $tmp/i.c | grep -q foo
+check -I
+
+# -D
+echo foo > $tmp/d.c
+./chibicc -Dfoo -E $tmp/d.c | grep -q 1
+check -D
+
+# -D
+echo foo > $tmp/d.c
+./chibicc -Dfoo=bar -E $tmp/d.c | grep -q bar
+check -D
+
+# -U
+echo foo > $tmp/u.c
+./chibicc -Dfoo=bar -Ufoo -E $tmp/u.c | grep -q foo
+check -U
+
+# Redefining a macro whose hash bucket follows a deleted one must not
+# leave a stale definition behind for #undef to expose.
+for i in `seq 300`; do echo "#define H$i 1"; done > $tmp/hm.c
+for i in `seq 1 2 300`; do echo "#undef H$i"; done >> $tmp/hm.c
+for i in `seq 2 2 300`; do echo "#define H$i 2"; echo "#undef H$i"; done >> $tmp/hm.c
+for i in `seq 300`; do echo "H$i"; done >> $tmp/hm.c
+! ./chibicc -E $tmp/hm.c | grep -q '^[0-9]'
+check '#undef after redefinition'
+
+# Multiple input files
+chibicc=$PWD/chibicc
+echo 'int x;' > $tmp/m1.c
+echo 'int y;' > $tmp/m2.c
+(cd $tmp; $chibicc -j2 m1.c m2.c)
+[ -f $tmp/m1.s ] && [ -f $tmp/m2.s ]
+check 'multiple files'
+
+./chibicc -o $tmp/out $tmp/m1.c $tmp/m2.c 2>&1 | grep -q 'cannot specify'
+check 'multiple files and -o'
+
+# Errors are reported in the order of the input files
+echo 'int a = x1;' > $tmp/e1.c
+echo 'int b = x2;' > $tmp/e2.c
+(cd $tmp; $chibicc -j2 e1.c m1.c e2.c 2>&1 | grep -o '^e[12]' | tr -d '\n') | grep -q '^e1e2$'
+check 'error order'
+
+# Functions generated in parallel are output in the same order
+./chibicc -j1 -o $tmp/j1.s test/control.c
+./chibicc -j4 -o $tmp/j4.s test/control.c
+cmp -s $tmp/j1.s $tmp/j4.s
+check 'parallel codegen'
+
+# Precompiled header
+echo '#ifndef P_H
+#define P_H
+#define SQ(x) ((x) * (x))
+struct pt { struct pt *next; int x; };
+typedef struct pt Pt;
+enum { P_ONE = 1 };
+int pcount = 3;
+#endif' > $tmp/p.h
+echo '#include "p.h"
+int f(Pt *p) { return SQ(p->x) + P_ONE + pcount; }' > $tmp/p.c
+./chibicc -emit-pch -o $tmp/p.pch $tmp/p.h
+./chibicc -o $tmp/p1.s $tmp/p.c
+./chibicc -include-pch $tmp/p.pch -o $tmp/p2.s $tmp/p.c
+cmp -s $tmp/p1.s $tmp/p2.s
+check 'precompiled header'
+
+echo 'int main() {}' > $tmp/p2.c
+./chibicc -emit-pch -o $tmp/p2.pch $tmp/p2.c 2>&1 | grep -q 'cannot be precompiled'
+check 'precompiled header with a definition'
+
+echo '#define SQ(x) 0' >> $tmp/p.h
+./chibicc -include-pch $tmp/p.pch -o $tmp/p3.s $tmp/p.c
+! cmp -s $tmp/p1.s $tmp/p3.s
+check 'precompiled header out of date'
+
+# Compile server
+./chibicc --server $tmp/sock 2> /dev/null &
+server=$!
+for i in `seq 50`; do [ -S $tmp/sock ] && break; sleep 0.1; done
+./chibicc -Itest -o $tmp/s1.s test/macro.c
+./chibicc --connect $tmp/sock -Itest -o $tmp/s2.s test/macro.c
+./chibicc --connect $tmp/sock -Itest -o $tmp/s3.s test/macro.c
+cmp -s $tmp/s1.s $tmp/s2.s && cmp -s $tmp/s1.s $tmp/s3.s
+check 'server'
+
+echo '#define H 1' > $tmp/h.h
+echo '#include "h.h"
+int h = H;' > $tmp/h.c
+(cd $tmp; $chibicc --connect sock -o h1.s h.c)
+echo '#define H 22' > $tmp/h.h
+(cd $tmp; $chibicc --connect sock -o h2.s h.c)
+grep -q 22 $tmp/h2.s
+check 'server with modified header'
+
+! ./chibicc --connect $tmp/sock $tmp/e1.c 2> $tmp/err && grep -q x1 $tmp/err
+check 'server errors'
+
+[ `stat -c %a $tmp/sock` = 600 ]
+check 'server socket mode'
+kill $server
+
+# Compilation cache
+./chibicc -Itest -fcache-dir=$tmp/cache -o $tmp/c1.s test/macro.c
+./chibicc -Itest -fcache-dir=$tmp/cache -o $tmp/c2.s test/macro.c
+cmp -s $tmp/s1.s $tmp/c1.s && cmp -s $tmp/s1.s $tmp/c2.s &&
+  [ `find $tmp/cache -name '*.s' | wc -l` -eq 1 ]
+check 'compilation cache'
+
+echo 'int c = H;' >> $tmp/h.c
+(cd $tmp; $chibicc -fcache-dir=cache -o h3.s h.c)
+grep -q 22 $tmp/h3.s && grep -q 'c:' $tmp/h3.s &&
+  [ `find $tmp/cache -name '*.s' | wc -l` -eq 2 ]
+check 'compilation cache miss'
+
+# -ftime-report
+echo 'int slow_fn() { return 0; }' > $tmp/t.c
+./chibicc -ftime-report -o $tmp/t.s $tmp/t.c 2> $tmp/err
+grep -q 'TOTAL' $tmp/err && grep -q 'slow_fn' $tmp/err
+check -ftime-report
+
+./chibicc -ftrace=$tmp/t.json -o $tmp/t.s $tmp/t.c
+grep -q traceEvents $tmp/t.json && grep -q '"name":"slow_fn"' $tmp/t.json &&
+  tail -1 $tmp/t.json | grep -q ']}'
+check -ftrace
+
+./chibicc -fmem-report -o $tmp/t.s $tmp/t.c 2> $tmp/err
+grep -q 'nodes' $tmp/err && grep -q 'peak RSS' $tmp/err
+check -fmem-report
+
+./chibicc -fcodegen-stats -o $tmp/t.s $tmp/t.c 2> $tmp/err
+grep -q 'TOTAL' $tmp/err && grep -q 'slow_fn' $tmp/err
+check -fcodegen-stats
+
+# -emit-ir
+echo 'int f(int x) { if (x < 3) return x + 1; return 0; }' > $tmp/ir.c
+./chibicc -emit-ir -o $tmp/ir.ir $tmp/ir.c
+grep -q '^function f(x)$' $tmp/ir.ir && grep -q '= lt i32 %' $tmp/ir.ir &&
+  grep -q '^  br %.*, bb1, bb2$' $tmp/ir.ir && grep -q '^bb2:  ; preds: bb0$' $tmp/ir.ir
+check -emit-ir
+
 echo OK
\ No newline at end of file
@@ -0,0 +1 @@
+int include2 = 7;
@@ -0,0 +1,6 @@
+#ifndef INCLUDE3_H
+#define INCLUDE3_H
+
+int include3 = 3;
+
+#endif
@@ -0,0 +1,3 @@
+#pragma once
+
+int include4 = 4;
@@ -0,0 +1,10 @@
+#ifndef INCLUDE5_H
+#define INCLUDE5_H
+
+int include5 = 5;
+
+#else
+
+int include5_again = 6;
+
+#endif
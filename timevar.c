@@ -0,0 +1,275 @@
+// This file measures how long each phase of a compilation takes.
+//
+// With -ftime-report, a summary is printed to stderr. Phases nest:
+// for example, the preprocessor reads and tokenizes header files.
+// Time is charged to the innermost phase only, so that the times add
+// up to the total. Along with the time, the peak RSS at the end of
+// each phase is shown. The time of the code generator is also broken
+// down by function to find functions that are expensive to compile.
+//
+// With -ftrace=<file>, the phases, top-level declarations and
+// functions are written as spans in the Chrome trace event format,
+// which can be viewed with Perfetto or chrome://tracing. Each job of
+// a parallel build appends its events to the same file through the
+// driver (see run_jobs()).
+
+#include "chibicc.h"
+#include <sys/resource.h>
+#include <time.h>
+
+// Upper limit of the number of functions listed
+#define MAX_FUNCS 20
+
+bool opt_time_report;
+char *opt_trace;
+
+// True if either of the above is given
+bool timevar_enabled;
+
+static char *timevar_names[] = {
+  [TV_READ_FILE] = "read file",
+  [TV_TOKENIZE] = "tokenize",
+  [TV_PREPROCESS] = "preprocess",
+  [TV_PARSE] = "parse",
+  [TV_LVAR_OFFSETS] = "assign lvar offsets",
+  [TV_EMIT_DATA] = "emit data",
+  [TV_EMIT_TEXT] = "emit text",
+};
+
+static int64_t elapsed[NUM_TIMEVARS];
+static TimeVar stack[NUM_TIMEVARS];
+static int64_t stack_start[NUM_TIMEVARS];
+static long peak_rss[NUM_TIMEVARS];
+static int depth;
+static int64_t start_time;
+static int64_t last_time;
+
+typedef struct {
+  char *name;
+  int64_t time;
+} FuncTime;
+
+static FuncTime *funcs;
+static int nfuncs;
+static int funcs_cap;
+
+// A span in the trace
+typedef struct {
+  char *cat;
+  char *name;
+  char *loc;
+  int64_t start;
+  int64_t end;
+  int tid;
+} TraceEvent;
+
+static TraceEvent *events;
+static int nevents;
+static int events_cap;
+static int max_tid;
+
+// Returns the current time in nanoseconds.
+int64_t timevar_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Returns the peak RSS of this process so far in kilobytes.
+static long get_peak_rss(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru))
+    return 0;
+  return ru.ru_maxrss;
+}
+
+void timevar_start(void) {
+  timevar_enabled = opt_time_report || opt_trace;
+  if (timevar_enabled)
+    start_time = last_time = timevar_now();
+}
+
+// Charges the time since the last push or pop to the current phase.
+static int64_t charge(void) {
+  int64_t now = timevar_now();
+  if (depth)
+    elapsed[stack[depth - 1]] += now - last_time;
+  last_time = now;
+  return now;
+}
+
+void timevar_push(TimeVar tv) {
+  if (!timevar_enabled)
+    return;
+  int64_t now = charge();
+  assert(depth < NUM_TIMEVARS);
+  stack_start[depth] = now;
+  stack[depth++] = tv;
+}
+
+void timevar_pop(TimeVar tv) {
+  if (!timevar_enabled)
+    return;
+  int64_t now = charge();
+  assert(depth > 0 && stack[depth - 1] == tv);
+  depth--;
+  if (opt_time_report)
+    peak_rss[tv] = MAX(peak_rss[tv], get_peak_rss());
+  trace_event("phase", timevar_names[tv], NULL, stack_start[depth], now, 0);
+}
+
+// Records a span for -ftrace. `loc` is an optional source location.
+// Events are recorded by the main thread only; `tid` tells which
+// thread did the work.
+void trace_event(char *cat, char *name, char *loc, int64_t start,
+                 int64_t end, int tid) {
+  if (!opt_trace)
+    return;
+  if (nevents == events_cap) {
+    events_cap = events_cap ? events_cap * 2 : 1024;
+    events = realloc(events, sizeof(TraceEvent) * events_cap);
+  }
+  events[nevents++] = (TraceEvent){cat, name, loc, start, end, tid};
+  max_tid = MAX(max_tid, tid);
+}
+
+// Records the time it took to generate code for a function.
+void timevar_function(char *name, int64_t start, int64_t end, int tid) {
+  if (nfuncs == funcs_cap) {
+    funcs_cap = funcs_cap ? funcs_cap * 2 : 1024;
+    funcs = realloc(funcs, sizeof(FuncTime) * funcs_cap);
+  }
+  funcs[nfuncs++] = (FuncTime){name, end - start};
+  trace_event("function", name, NULL, start, end, tid);
+}
+
+static int cmp_timevar(const void *a, const void *b) {
+  int64_t x = elapsed[*(TimeVar *)a];
+  int64_t y = elapsed[*(TimeVar *)b];
+  return (x < y) - (x > y);
+}
+
+static int cmp_func(const void *a, const void *b) {
+  int64_t x = ((FuncTime *)a)->time;
+  int64_t y = ((FuncTime *)b)->time;
+  return (x < y) - (x > y);
+}
+
+// Prints a line of the report. `rss` is omitted if zero.
+static void print_time(char *name, int64_t time, int64_t total, double unit,
+                       long rss) {
+  fprintf(stderr, " %-20s: %8.3f (%3d%%)", name, time / unit,
+          total ? (int)(time * 100 / total) : 0);
+  if (rss)
+    fprintf(stderr, " %10ld KB", rss);
+  fprintf(stderr, "\n");
+}
+
+// Prints the phases and the functions that took the most time,
+// slowest first.
+static void print_time_report(char *input, int64_t total) {
+  int64_t other = total;
+
+  TimeVar order[NUM_TIMEVARS];
+  for (int i = 0; i < NUM_TIMEVARS; i++) {
+    order[i] = i;
+    other -= elapsed[i];
+  }
+  qsort(order, NUM_TIMEVARS, sizeof(TimeVar), cmp_timevar);
+
+  fprintf(stderr, "\nExecution times for %s (seconds, peak RSS)\n", input);
+  for (int i = 0; i < NUM_TIMEVARS; i++)
+    print_time(timevar_names[order[i]], elapsed[order[i]], total, 1e9,
+               peak_rss[order[i]]);
+  print_time("other", other, total, 1e9, 0);
+  print_time("TOTAL", total, total, 1e9, get_peak_rss());
+
+  if (nfuncs == 0)
+    return;
+
+  // Functions may be generated in parallel, so their times are
+  // relative to the sum rather than to the total.
+  int64_t sum = 0;
+  for (int i = 0; i < nfuncs; i++)
+    sum += funcs[i].time;
+  qsort(funcs, nfuncs, sizeof(FuncTime), cmp_func);
+
+  fprintf(stderr, "\nCode generation times of %d functions (milliseconds)\n", nfuncs);
+  for (int i = 0; i < nfuncs && i < MAX_FUNCS; i++)
+    print_time(funcs[i].name, funcs[i].time, sum, 1e6, 0);
+  if (nfuncs > MAX_FUNCS)
+    fprintf(stderr, " ... %d more\n", nfuncs - MAX_FUNCS);
+}
+
+static void write_json_str(FILE *out, char *s) {
+  fputc('"', out);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(out, "\\%c", *s);
+    else if ((unsigned char)*s < 0x20)
+      fprintf(out, "\\u%04x", *s);
+    else
+      fputc(*s, out);
+  }
+  fputc('"', out);
+}
+
+static void write_metadata(FILE *out, char *kind, int tid, char *name) {
+  fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+          "\"args\":{\"name\":", kind, getpid(), tid);
+  write_json_str(out, name);
+  fprintf(out, "}}");
+}
+
+// Writes the recorded events. Each event is preceded by a comma, so
+// the events of multiple compilations can be concatenated between
+// open_trace() and close_trace().
+static void write_trace(FILE *out, char *input) {
+  write_metadata(out, "thread_name", 0, input);
+  for (int i = 1; i <= max_tid; i++)
+    write_metadata(out, "thread_name", i, format("codegen %d", i));
+
+  for (int i = 0; i < nevents; i++) {
+    TraceEvent *ev = &events[i];
+    fprintf(out, ",\n{\"cat\":\"%s\",\"name\":", ev->cat);
+    write_json_str(out, ev->name);
+    fprintf(out, ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+            ev->start / 1e3, (ev->end - ev->start) / 1e3, getpid(), ev->tid);
+    if (ev->loc) {
+      fprintf(out, ",\"args\":{\"loc\":");
+      write_json_str(out, ev->loc);
+      fprintf(out, "}");
+    }
+    fprintf(out, "}");
+  }
+}
+
+// Reports the measurements of a compilation. `trace` is where the
+// events go if -ftrace is given.
+void timevar_finish(char *input, FILE *trace) {
+  if (!timevar_enabled)
+    return;
+
+  int64_t now = timevar_now();
+  trace_event("compile", input, NULL, start_time, now, 0);
+
+  if (opt_time_report)
+    print_time_report(input, now - start_time);
+  if (trace)
+    write_trace(trace, input);
+}
+
+FILE *open_trace(char *path) {
+  FILE *out = fopen(path, "w");
+  if (!out)
+    error("cannot open output file: %s: %s", path, strerror(errno));
+  fprintf(out, "{\"traceEvents\":[\n");
+  fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+          "\"args\":{\"name\":\"chibicc\"}}", getpid());
+  return out;
+}
+
+void close_trace(FILE *out) {
+  fprintf(out, "\n]}\n");
+  fclose(out);
+}
@@ -1,10 +1,50 @@
 #include "chibicc.h"
 
-// Input filename
-static char *current_filename;
-
-// Input string
-static char *current_input;
+// Input file
+static File *current_file;
+
+// A list of all files read from disk, indexed by file number - 1
+static File **files;
+static int nfiles;
+static int files_cap;
+
+// Files used by the current translation unit, in the order in which
+// they were first used. The assembler refers to a file by its index
+// in this list (File's display_no) rather than by its file number,
+// so the output doesn't depend on which files this process has read
+// for other translation units.
+static File **input_files;
+static int ninput_files;
+
+// A list of all source buffers, including ones the preprocessor
+// creates. Used to find the file a location belongs to.
+static File **all_files;
+static int nall_files;
+static int all_files_cap;
+
+// True if the current position is at the beginning of a line
+static bool at_bol;
+
+// True if the current position follows a space character
+static bool has_space;
+
+// Tokens of the input, and values of its literals
+static Token *tokens;
+static int ntokens;
+static int tokens_cap;
+
+static Literal *literals;
+static int nliterals;
+static int literals_cap;
+
+// Offsets in the current file at which a line joined to the previous
+// one by a backslash-newline begins. They are added to the line table
+// as the tokenizer passes them, so that tokens keep the line numbers
+// they have in the file.
+static int *splices;
+static int nsplices;
+static int splices_cap;
+static int next_splice;
 
 // Reports an error and exit.
 void error(char *fmt, ...) {
@@ -15,22 +55,81 @@ void error(char *fmt, ...) {
   exit(1);
 }
 
+static void push_line(File *file, int off) {
+  if (file->nlines == file->lines_cap) {
+    int cap = file->lines_cap ? file->lines_cap * 2 : 16;
+    count_mem(MEM_FILE, 0, (cap - file->lines_cap) * sizeof(int));
+    file->lines_cap = cap;
+    file->lines = realloc(file->lines, cap * sizeof(int));
+  }
+  file->lines[file->nlines++] = off;
+}
+
+// Records the lines joined to the previous ones that begin before `p`,
+// or at `p` if `inclusive` is true.
+static void add_splices(char *p, bool inclusive) {
+  int off = p - current_file->contents + inclusive;
+  while (next_splice < nsplices && splices[next_splice] < off)
+    push_line(current_file, splices[next_splice++]);
+}
+
+// Records the beginning of a line. Lines are recorded as the
+// tokenizer goes, so the number of entries is also the current line
+// number.
+static void add_line(char *p) {
+  add_splices(p, false);
+  push_line(current_file, p - current_file->contents);
+}
+
+// Returns the file containing a given location.
+static File *find_file(char *loc) {
+  for (int i = nall_files - 1; i >= 0; i--) {
+    File *file = all_files[i];
+    if (file->contents <= loc && loc <= file->contents + file->size)
+      return file;
+  }
+  unreachable();
+}
+
+// Returns the line number of a given location by binary search.
+static int find_line(File *file, char *loc) {
+  int off = loc - file->contents;
+  int lo = 0;
+  int hi = file->nlines - 1;
+
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (file->lines[mid] <= off)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return lo + 1;
+}
+
 // Reports an error message in the following format.
 //
 // foo.c:10: x = y + 1;
 //               ^ <error message here>
-static void verror_at(int line_no, char *loc, char *fmt, va_list ap) {
+static void verror_at(char *loc, Token *tok, char *fmt, va_list ap) {
   // Find a line containing `loc`.
-  char *line = loc;
-  while (current_input < line && line[-1] != '\n')
-    line--;
-
+  File *file = find_file(loc);
+  int line_no = find_line(file, loc);
+  char *line = file->contents + file->lines[line_no - 1];
   char *end = loc;
-  while (*end != '\n')
+  while (*end && *end != '\n')
     end++;
 
+  // A token the preprocessor has built is reported at the place
+  // it was made rather than in the scratch buffer.
+  char *name = file->name;
+  if (!file->file_no && tok && tok->file_no) {
+    name = get_file(tok->file_no)->name;
+    line_no = tok->line_no;
+  }
+
   // Print out the line.
-  int indent = fprintf(stderr, "%s:%d: ", current_filename, line_no);
+  int indent = fprintf(stderr, "%s:%d: ", name, line_no);
   fprintf(stderr, "%.*s\n", (int)(end - line), line);
 
   // Show the error message.
@@ -43,54 +142,126 @@ static void verror_at(int line_no, char *loc, char *fmt, va_list ap) {
 }
 
 void error_at(char *loc, char *fmt, ...) {
-  int line_no = 1;
-  for (char *p = current_input; p < loc; p++)
-    if (*p == '\n')
-      line_no++;
-
   va_list ap;
   va_start(ap, fmt);
-  verror_at(line_no, loc, fmt, ap);
+  verror_at(loc, NULL, fmt, ap);
   exit(1);
 }
 
 void error_tok(Token *tok, char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  verror_at(tok->line_no, tok->loc, fmt, ap);
+  verror_at(tok->loc, tok, fmt, ap);
   exit(1);
 }
 
+// Returns the canonical copy of a given string. Interned strings
+// can be compared by pointer.
+char *intern(char *p, int len) {
+  static HashMap symbols;
+
+  char *s = hashmap_get2(&symbols, p, len);
+  if (!s) {
+    s = arena_strndup(perm_arena, p, len);
+    hashmap_put2(&symbols, s, len, s);
+  }
+  return s;
+}
+
+// Returns the interned copy of a string literal.
+//
+// The parser calls equal() with string literals many times per
+// token. Since the address of a string literal never changes, we
+// cache the interned copies in a small open-addressing table keyed
+// by address, so that we don't have to hash the literal on every call.
+static char *intern_literal(char *str) {
+  static struct {
+    char *lit;
+    char *sym;
+  } cache[4096];
+
+  int cap = sizeof(cache) / sizeof(*cache);
+  uint64_t hash = (uintptr_t)str * 0x9e3779b97f4a7c15;
+
+  for (int i = 0; i < 8; i++) {
+    int idx = ((hash >> 40) + i) % cap;
+    if (cache[idx].lit == str)
+      return cache[idx].sym;
+
+    if (!cache[idx].lit) {
+      cache[idx].lit = str;
+      cache[idx].sym = intern(str, strlen(str));
+      return cache[idx].sym;
+    }
+  }
+
+  // The cache is too crowded. This shouldn't happen in practice.
+  return intern(str, strlen(str));
+}
+
 // Consumes the current token if it matches `op`.
 bool equal(Token *tok, char *op) {
-  return memcmp(tok->loc, op, tok->len) == 0 && op[tok->len] == '\0';
+  return tok->name == intern_literal(op);
 }
 
 // Ensure that the current token is `op`.
 Token *skip(Token *tok, char *op) {
   if (!equal(tok, op))
     error_tok(tok, "expected '%s'", op);
-  return tok->next;
+  return tok + 1;
 }
 
 bool consume(Token **rest, Token *tok, char *str) {
   if (equal(tok, str)) {
-    *rest = tok->next;
+    *rest = tok + 1;
     return true;
   }
   *rest = tok;
   return false;
 }
 
-// Create a new token.
+Literal *tok_literal(Token *tok) {
+  return &literals[tok->lit];
+}
+
+// Create a new token at the end of the token array. The returned
+// pointer is valid only until the next call of this function.
 static Token *new_token(TokenKind kind, char *start, char *end) {
-  Token *tok = calloc(1, sizeof(Token));
-  tok->kind = kind;
-  tok->loc = start;
-  tok->len = end - start;
+  if (ntokens == tokens_cap) {
+    tokens_cap = tokens_cap ? tokens_cap * 2 : 1024;
+    tokens = realloc(tokens, tokens_cap * sizeof(Token));
+  }
+
+  if (next_splice < nsplices)
+    add_splices(start, true);
+
+  Token *tok = &tokens[ntokens++];
+  *tok = (Token){
+    .kind = kind,
+    .at_bol = at_bol,
+    .has_space = has_space,
+    .file_no = current_file->file_no,
+    .loc = start,
+    .len = end - start,
+    .line_no = current_file->nlines,
+  };
+  at_bol = has_space = false;
   return tok;
 }
 
+// Allocates a literal value for a given token.
+Literal *new_literal(Token *tok) {
+  if (nliterals == literals_cap) {
+    literals_cap = literals_cap ? literals_cap * 2 : 1024;
+    literals = realloc(literals, literals_cap * sizeof(Literal));
+  }
+
+  tok->lit = nliterals;
+  Literal *lit = &literals[nliterals++];
+  *lit = (Literal){};
+  return lit;
+}
+
 static bool startswith(char *p, char *q) {
   return strncmp(p, q, strlen(q)) == 0;
 }
@@ -100,11 +271,6 @@ static bool is_ident1(char c) {
   return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_';
 }
 
-// Returns true if c is valid as a non-first character of an identifier.
-static bool is_ident2(char c) {
-  return is_ident1(c) || ('0' <= c && c <= '9');
-}
-
 static int from_hex(char c) {
   if ('0' <= c && c <= '9')
     return c - '0';
@@ -114,34 +280,81 @@ static int from_hex(char c) {
 }
 
 // Read a punctuator token from p and returns its length.
+//
+// Multi-letter punctuators are recognized by looking at the following
+// characters, so each character is examined at most once.
 static int read_punct(char *p) {
-  static char *kw[] = {
-    "<<=", ">>=", "...", "==", "!=", "<=", ">=", "->", "+=",
-    "-=", "*=", "/=", "++", "--", "%=", "&=", "|=", "^=", "&&",
-    "||", "<<", ">>",
-  };
-
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (startswith(p, kw[i]))
-      return strlen(kw[i]);
-
+  switch (*p) {
+  case '<':
+  case '>':
+    if (p[1] == *p)
+      return (p[2] == '=') ? 3 : 2; // <<= >>= << >>
+    return (p[1] == '=') ? 2 : 1;   // <= >=
+  case '.':
+    return (p[1] == '.' && p[2] == '.') ? 3 : 1;
+  case '#':
+    return (p[1] == '#') ? 2 : 1;
+  case '-':
+    return (p[1] == '>' || p[1] == '-' || p[1] == '=') ? 2 : 1;
+  case '+':
+  case '&':
+  case '|':
+    return (p[1] == *p || p[1] == '=') ? 2 : 1; // ++ && || += &= |=
+  case '=':
+  case '!':
+  case '*':
+  case '/':
+  case '%':
+  case '^':
+    return (p[1] == '=') ? 2 : 1;
+  }
   return ispunct(*p) ? 1 : 0;
 }
 
-static bool is_keyword(Token *tok) {
-  static char *kw[] = {
-    "return", "if", "else", "for", "while", "int", "sizeof", "char",
-    "struct", "union", "short", "long", "void", "typedef", "_Bool",
-    "enum", "static", "goto", "break", "continue", "switch", "case",
-    "default", "extern", "_Alignof", "_Alignas", "do", "signed",
-    "unsigned", "const", "volatile", "auto", "register", "restrict",
-    "__restrict", "__restrict__", "_Noreturn",
-  };
-
-  for (int i = 0; i < sizeof(kw) / sizeof(*kw); i++)
-    if (equal(tok, kw[i]))
-      return true;
+// Returns true if a given identifier is a keyword.
+//
+// Candidates are selected by the first letter, so that we compare
+// an identifier with at most a handful of keywords of the same length.
+static bool is_keyword(char *p, int len) {
+#define KW(s) (len == sizeof(s) - 1 && !memcmp(p, s, len))
+  switch (*p) {
+  case '_':
+    return KW("_Bool") || KW("_Alignof") || KW("_Alignas") ||
+           KW("_Noreturn") || KW("__restrict") || KW("__restrict__");
+  case 'a':
+    return KW("auto");
+  case 'b':
+    return KW("break");
+  case 'c':
+    return KW("char") || KW("case") || KW("const") || KW("continue");
+  case 'd':
+    return KW("do") || KW("default");
+  case 'e':
+    return KW("else") || KW("enum") || KW("extern");
+  case 'f':
+    return KW("for");
+  case 'g':
+    return KW("goto");
+  case 'i':
+    return KW("if") || KW("int");
+  case 'l':
+    return KW("long");
+  case 'r':
+    return KW("return") || KW("register") || KW("restrict");
+  case 's':
+    return KW("short") || KW("sizeof") || KW("struct") || KW("static") ||
+           KW("switch") || KW("signed");
+  case 't':
+    return KW("typedef");
+  case 'u':
+    return KW("union") || KW("unsigned");
+  case 'v':
+    return KW("void") || KW("volatile");
+  case 'w':
+    return KW("while");
+  }
   return false;
+#undef KW
 }
 
 static int read_escaped_char(char **new_pos, char *p) {
@@ -211,7 +424,7 @@ static char *string_literal_end(char *p) {
 
 static Token *read_string_literal(char *start) {
   char *end = string_literal_end(start + 1);
-  char *buf = calloc(1, end - start);
+  char *buf = arena_alloc(perm_arena, end - start);
   int len = 0;
 
   for (char *p = start + 1; p < end;) {
@@ -222,8 +435,9 @@ static Token *read_string_literal(char *start) {
   }
 
   Token *tok = new_token(TK_STR, start, end + 1);
-  tok->ty = array_of(ty_char, len + 1);
-  tok->str = buf;
+  Literal *lit = new_literal(tok);
+  lit->ty = array_of(ty_char, len + 1);
+  lit->str = buf;
   return tok;
 }
 
@@ -243,8 +457,9 @@ static Token *read_char_literal(char *start) {
     error_at(p, "unclosed char literal");
 
   Token *tok = new_token(TK_NUM, start, end + 1);
-  tok->val = c;
-  tok->ty = ty_int;
+  Literal *lit = new_literal(tok);
+  lit->val = c;
+  lit->ty = ty_int;
   return tok;
 }
 
@@ -318,15 +533,16 @@ static Token *read_int_literal(char *start) {
   }
 
   Token *tok = new_token(TK_NUM, start, p);
-  tok->val = val;
-  tok->ty = ty;
+  Literal *lit = new_literal(tok);
+  lit->val = val;
+  lit->ty = ty;
   return tok;
 }
 
 static Token *read_number(char *start) {
   // Try to parse as an integer constant.
   Token *tok = read_int_literal(start);
-  if (!strchr(".eEfF", start[tok->len]))
+  if (!start[tok->len] || !strchr(".eEfF", start[tok->len]))
     return tok;
 
   // If it's not an integer, it must be a floating point constant.
@@ -344,150 +560,351 @@ static Token *read_number(char *start) {
     ty = ty_double;
   }
 
-  tok = new_token(TK_NUM, start, end);
-  tok->fval = val;
-  tok->ty = ty;
+  // Reuse the token and the literal we have just created.
+  tok->len = end - start;
+  *tok_literal(tok) = (Literal){.fval = val, .ty = ty};
   return tok;
 }
 
-static void convert_keywords(Token *tok) {
-  for (Token *t = tok; t->kind != TK_EOF; t = t->next)
-    if (is_keyword(t))
-      t->kind = TK_KEYWORD;
-}
-
-// Initialize line info for all tokens.
-static void add_line_numbers(Token *tok) {
-  char *p = current_input;
-  int n = 1;
-
-  do {
-    if (p == tok->loc) {
-      tok->line_no = n;
-      tok = tok->next;
-    }
-    if (*p == '\n')
-      n++;
-  } while (*p++);
-}
+// Tokenizes a string in `file` from `p` to the end of the string.
+static Token *tokenize_text(File *file, char *p) {
+  current_file = file;
+  at_bol = true;
+  has_space = false;
 
-// Tokenize a given string and returns new tokens.
-static Token *tokenize(char *filename, char *p) {
-  current_filename = filename;
-  current_input = p;
-  Token head = {};
-  Token *cur = &head;
+  ntokens = 0;
+  tokens_cap = 0;
+  tokens = NULL;
 
   while (*p) {
     // Skip line comments.
     if (startswith(p, "//")) {
-      p += 2;
-      while (*p != '\n')
-        p++;
+      p = find_newline(p + 2);
+      has_space = true;
       continue;
     }
 
     // Skip block comments.
     if (startswith(p, "/*")) {
-      char *q = strstr(p + 2, "*/");
-      if (!q)
-        error_at(p, "unclosed block comment");
+      char *q = p + 2;
+      for (;;) {
+        q = find_comment_stop(q);
+        if (*q == '\0')
+          error_at(p, "unclosed block comment");
+        if (q[0] == '*' && q[1] == '/')
+          break;
+        if (*q == '\n')
+          add_line(q + 1);
+        q++;
+      }
       p = q + 2;
+      has_space = true;
       continue;
     }
 
     // Skip whitespace characters.
+    if (*p == '\n') {
+      add_line(++p);
+      at_bol = true;
+      has_space = false;
+      continue;
+    }
+
     if (isspace(*p)) {
-      p++;
+      p = skip_blanks(p);
+      has_space = true;
       continue;
     }
 
     // Numeric literal
     if (isdigit(*p) || (*p == '.' && isdigit(p[1]))) {
-      cur = cur->next = read_number(p);
-      p += cur->len;
+      p += read_number(p)->len;
       continue;
     }
 
     // String literal
     if (*p == '"') {
-      cur = cur->next = read_string_literal(p);
-      p += cur->len;
+      p += read_string_literal(p)->len;
       continue;
     }
 
     // Character literal
     if (*p == '\'') {
-      cur = cur->next = read_char_literal(p);
-      p += cur->len;
+      p += read_char_literal(p)->len;
       continue;
     }
 
     // Identifier or keyword
     if (is_ident1(*p)) {
       char *start = p;
-      do {
-        p++;
-      } while (is_ident2(*p));
-      cur = cur->next = new_token(TK_IDENT, start, p);
+      p = skip_ident(p + 1);
+
+      TokenKind kind = is_keyword(start, p - start) ? TK_KEYWORD : TK_IDENT;
+      Token *tok = new_token(kind, start, p);
+      tok->name = intern(start, p - start);
       continue;
     }
 
     // Punctuators
     int punct_len = read_punct(p);
     if (punct_len) {
-      cur = cur->next = new_token(TK_PUNCT, p, p + punct_len);
-      p += cur->len;
+      Token *tok = new_token(TK_PUNCT, p, p + punct_len);
+      tok->name = intern(p, punct_len);
+      p += punct_len;
       continue;
     }
 
     error_at(p, "invalid token");
   }
 
-  cur = cur->next = new_token(TK_EOF, p, p);
-  add_line_numbers(head.next);
-  convert_keywords(head.next);
-  return head.next;
+  new_token(TK_EOF, p, p);
+  count_mem(MEM_TOKEN, ntokens, ntokens * sizeof(Token));
+  return realloc(tokens, ntokens * sizeof(Token));
+}
+
+// Tokenize a given file and returns new tokens.
+Token *tokenize(File *file) {
+  current_file = file;
+  file->nlines = 0;
+  next_splice = 0;
+  add_line(file->contents);
+  return tokenize_text(file, file->contents);
+}
+
+// Reads the entire contents of a file descriptor into a single
+// buffer. This is used for stdin and other files we cannot map.
+static char *read_fd(int fd, char *path, int *size) {
+  size_t cap = 64 * 1024;
+  size_t len = 0;
+  char *buf = malloc(cap);
+
+  for (;;) {
+    // Leave room for the trailing "\n\0".
+    if (len + 2 >= cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+
+    ssize_t n = read(fd, buf + len, cap - len - 2);
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      error("cannot read %s: %s", path, strerror(errno));
+    }
+    len += n;
+  }
+
+  // Make sure that the last line is properly terminated with '\n'.
+  if (len == 0 || buf[len - 1] != '\n')
+    buf[len++] = '\n';
+  buf[len] = '\0';
+  *size = len;
+  return buf;
+}
+
+// Maps a regular file to memory without copying it.
+//
+// The tokenizer needs the input to end with "\n\0". The kernel fills
+// the rest of the last page after the end of a file with zeros, so
+// if there's room for two more bytes there, we get the terminator
+// for free. Otherwise, NULL is returned and the caller reads the file.
+static char *map_file(int fd, size_t size, int *len) {
+  size_t pagesz = sysconf(_SC_PAGESIZE);
+  size_t room = align_to(size, pagesz) - size;
+  if (size == 0 || room < 2)
+    return NULL;
+
+  char *buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (buf == MAP_FAILED)
+    return NULL;
+
+  if (buf[size - 1] != '\n') {
+    // Append '\n' to the last page. Since the mapping is private,
+    // only a copy of the page is modified, not the file.
+    char *page = buf + (size - 1) / pagesz * pagesz;
+    if (mprotect(page, pagesz, PROT_READ | PROT_WRITE)) {
+      munmap(buf, size);
+      return NULL;
+    }
+    buf[size++] = '\n';
+  }
+  *len = size;
+  return buf;
+}
+
+// Removes backslash-newline pairs, which join a line with the next
+// one, and records where the joined lines begin in `splices`. Returns
+// NULL if there are none, which is the common case.
+static char *remove_backslash_newline(char *p, int *size) {
+  char *end = p + *size;
+  char *q = p;
+  while ((q = memchr(q, '\\', end - q)) && q[1] != '\n')
+    q++;
+  if (!q)
+    return NULL;
+
+  char *buf = malloc(*size + 2);
+  int n = q - p;
+  memcpy(buf, p, n);
+
+  while (q < end) {
+    if (q[0] == '\\' && q[1] == '\n') {
+      if (nsplices == splices_cap) {
+        splices_cap = splices_cap ? splices_cap * 2 : 64;
+        splices = realloc(splices, sizeof(int) * splices_cap);
+      }
+      splices[nsplices++] = n;
+      q += 2;
+    } else {
+      buf[n++] = *q++;
+    }
+  }
+
+  // The file may have ended with a backslash-newline.
+  if (n == 0 || buf[n - 1] != '\n')
+    buf[n++] = '\n';
+  buf[n] = '\0';
+  *size = n;
+  return buf;
 }
 
 // Returns the contents of a given file.
-static char *read_file(char *path) {
-  FILE *fp;
+static char *read_file(char *path, int *size) {
+  int fd;
 
   if (strcmp(path, "-") == 0) {
     // By convention, read from stdin if a given filename is "-".
-    fp = stdin;
+    fd = STDIN_FILENO;
   } else {
-    fp = fopen(path, "r");
-    if (!fp)
-      error("cannot open %s: %s", path, strerror(errno));
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+      return NULL;
   }
 
-  char *buf;
-  size_t buflen;
-  FILE *out = open_memstream(&buf, &buflen);
+  // Map a regular file if possible. stdin may also be a regular
+  // file if it is redirected.
+  struct stat st;
+  char *buf = NULL;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+    buf = map_file(fd, st.st_size, size);
+  bool mapped = buf;
+  if (!buf)
+    buf = read_fd(fd, path, size);
+
+  if (fd != STDIN_FILENO)
+    close(fd);
+
+  char *joined = remove_backslash_newline(buf, size);
+  if (!joined)
+    return buf;
+
+  if (mapped)
+    munmap(buf, st.st_size);
+  else
+    free(buf);
+  return joined;
+}
+
+static File *alloc_file(char *name, int file_no, char *contents, int size) {
+  File *file = arena_alloc(perm_arena, sizeof(File));
+  file->name = name;
+  file->file_no = file_no;
+  file->contents = contents;
+  file->size = size;
 
-  // Read the entire file.
-  for (;;) {
-    char buf2[4096];
-    int n = fread(buf2, 1, sizeof(buf2), fp);
-    if (n == 0)
-      break;
-    fwrite(buf2, 1, n, out);
+  if (nall_files == all_files_cap) {
+    all_files_cap = all_files_cap ? all_files_cap * 2 : 16;
+    all_files = realloc(all_files, sizeof(File *) * all_files_cap);
   }
+  all_files[nall_files++] = file;
+  count_mem(MEM_FILE, 1, sizeof(File));
+  return file;
+}
 
-  if (fp != stdin)
-    fclose(fp);
+// Creates a source buffer that is not an input file, such as the
+// definition of a predefined macro. Its tokens report `file_no` as
+// their file.
+File *new_file(char *name, int file_no, char *contents) {
+  return alloc_file(name, file_no, contents, strlen(contents));
+}
 
-  // Make sure that the last line is properly terminated with '\n'.
-  fflush(out);
-  if (buflen == 0 || buf[buflen - 1] != '\n')
-    fputc('\n', out);
-  fputc('\0', out);
-  fclose(out);
-  return buf;
+// Copies a string the preprocessor has built, such as the spelling of
+// a pasted token, to a scratch buffer so that error messages can find
+// it. The strings share a few large buffers rather than having a File
+// each; every string starts a line of its own.
+char *scratch_string(char *s) {
+  static File *scratch;
+  static int used;
+
+  int len = strlen(s) + 1;
+  if (!scratch || used + len > scratch->size) {
+    int size = MAX(len, 64 * 1024);
+    scratch = alloc_file("<scratch>", 0, arena_alloc(perm_arena, size), size);
+    count_mem(MEM_FILE, 0, size);
+    used = 0;
+  }
+
+  char *p = scratch->contents + used;
+  memcpy(p, s, len);
+  used += len;
+
+  current_file = scratch;
+  add_line(p);
+  return p;
+}
+
+// Tokenizes a string the preprocessor has built.
+Token *tokenize_scratch(char *s) {
+  char *p = scratch_string(s);
+  return tokenize_text(current_file, p);
+}
+
+// Registers a file read from disk and gives it a file number.
+File *add_file(char *name, char *contents, int size) {
+  File *file = alloc_file(name, nfiles + 1, contents, size);
+  if (nfiles == files_cap) {
+    files_cap = files_cap ? files_cap * 2 : 16;
+    files = realloc(files, sizeof(File *) * files_cap);
+  }
+  files[nfiles++] = file;
+  return file;
+}
+
+File *get_file(int file_no) {
+  return files[file_no - 1];
+}
+
+// Adds a file to the input files of the current translation unit
+// unless it is already there.
+void add_input_file(int file_no) {
+  File *file = get_file(file_no);
+  if (file->display_no)
+    return;
+
+  input_files = realloc(input_files, sizeof(File *) * (ninput_files + 2));
+  input_files[ninput_files++] = file;
+  input_files[ninput_files] = NULL;
+  file->display_no = ninput_files;
 }
 
+File **get_input_files(void) {
+  return input_files;
+}
+
+// Returns NULL if the file cannot be opened.
 Token *tokenize_file(char *path) {
-  return tokenize(path, read_file(path));
-}
\ No newline at end of file
+  int size;
+  timevar_push(TV_READ_FILE);
+  char *p = read_file(path, &size);
+  timevar_pop(TV_READ_FILE);
+  if (!p)
+    return NULL;
+
+  timevar_push(TV_TOKENIZE);
+  Token *tok = tokenize(add_file(path, p, size));
+  nsplices = 0;
+  timevar_pop(TV_TOKENIZE);
+  return tok;
+}
@@ -17,7 +17,8 @@ Type *ty_float = &(Type){TY_FLOAT, 4, 4};
 Type *ty_double = &(Type){TY_DOUBLE, 8, 8};
 
 static Type *new_type(TypeKind kind, int size, int align) {
-  Type *ty = calloc(1, sizeof(Type));
+  Type *ty = arena_alloc(perm_arena, sizeof(Type));
+  count_mem(MEM_TYPE, 1, sizeof(Type));
   ty->kind = kind;
   ty->size = size;
   ty->align = align;
@@ -35,29 +36,104 @@ bool is_flonum(Type *ty) {
 }
 
 Type *copy_type(Type *ty) {
-  Type *ret = calloc(1, sizeof(Type));
+  Type *ret = arena_alloc(perm_arena, sizeof(Type));
+  count_mem(MEM_TYPE, 1, sizeof(Type));
   *ret = *ty;
   return ret;
 }
 
+// Pointer, array and function types are hash-consed so that there is
+// only one Type object for each distinct derived type. A key consists
+// of the kind, the base type, the array length or the number of
+// parameters, and the parameter types if any.
+typedef struct {
+  TypeKind kind;
+  int len;
+  bool is_variadic;
+  Type *base;
+  Type *params[];
+} TypeKey;
+
+static HashMap derived_types;
+
+// Buffer for lookup keys
+static TypeKey *key_buf;
+static int key_cap;
+
+static TypeKey *new_key(TypeKind kind, Type *base, int len, int nparams) {
+  int size = sizeof(TypeKey) + nparams * sizeof(Type *);
+  if (key_cap < size) {
+    key_cap = size * 2;
+    key_buf = realloc(key_buf, key_cap);
+  }
+
+  // Clear padding bytes as well, as they are part of the key.
+  memset(key_buf, 0, size);
+  key_buf->kind = kind;
+  key_buf->base = base;
+  key_buf->len = len;
+  return key_buf;
+}
+
+static Type *find_type(TypeKey *key, int keylen) {
+  return hashmap_get2(&derived_types, (char *)key, keylen);
+}
+
+static void add_derived_type(TypeKey *key, int keylen, Type *ty) {
+  char *key2 = arena_strndup(perm_arena, (char *)key, keylen);
+  hashmap_put2(&derived_types, key2, keylen, ty);
+}
+
 Type *pointer_to(Type *base) {
-  Type *ty = new_type(TY_PTR, 8, 8);
+  TypeKey *key = new_key(TY_PTR, base, 0, 0);
+  Type *ty = find_type(key, sizeof(TypeKey));
+  if (ty)
+    return ty;
+
+  ty = new_type(TY_PTR, 8, 8);
   ty->base = base;
   ty->is_unsigned = true;
+  add_derived_type(key, sizeof(TypeKey), ty);
   return ty;
 }
 
-Type *func_type(Type *return_ty) {
-  Type *ty = calloc(1, sizeof(Type));
-  ty->kind = TY_FUNC;
+Type *func_type(Type *return_ty, Type **params, int nparams, bool is_variadic) {
+  TypeKey *key = new_key(TY_FUNC, return_ty, nparams, nparams);
+  key->is_variadic = is_variadic;
+  if (nparams > 0)
+    memcpy(key->params, params, nparams * sizeof(Type *));
+
+  int keylen = sizeof(TypeKey) + nparams * sizeof(Type *);
+  Type *ty = find_type(key, keylen);
+  if (ty)
+    return ty;
+
+  ty = new_type(TY_FUNC, 0, 0);
   ty->return_ty = return_ty;
+  ty->nparams = nparams;
+  if (nparams > 0) {
+    ty->params = arena_alloc(perm_arena, nparams * sizeof(Type *));
+    count_mem(MEM_TYPE, 0, nparams * sizeof(Type *));
+    memcpy(ty->params, params, nparams * sizeof(Type *));
+  }
+  ty->is_variadic = is_variadic;
+  add_derived_type(key, keylen, ty);
   return ty;
 }
 
 Type *array_of(Type *base, int len) {
-  Type *ty = new_type(TY_ARRAY, base->size * len, base->align);
+  // The size of an array of incomplete struct would change once
+  // the struct is completed, so don't share such a type.
+  TypeKey *key = new_key(TY_ARRAY, base, len, 0);
+  Type *ty = (base->size < 0) ? NULL : find_type(key, sizeof(TypeKey));
+  if (ty)
+    return ty;
+
+  ty = new_type(TY_ARRAY, base->size * len, base->align);
   ty->base = base;
   ty->array_len = len;
+  if (base->size >= 0)
+    add_derived_type(key, sizeof(TypeKey), ty);
   return ty;
 }
 
@@ -103,18 +179,57 @@ void add_type(Node *node) {
   if (!node || node->ty)
     return;
 
-  add_type(node->lhs);
-  add_type(node->rhs);
-  add_type(node->cond);
-  add_type(node->then);
-  add_type(node->els);
-  add_type(node->init);
-  add_type(node->inc);
-
-  for (Node *n = node->body; n; n = n->next)
-    add_type(n);
-  for (Node *n = node->args; n; n = n->next)
-    add_type(n);
+  // Visit the children. Which fields are valid depends on the kind.
+  switch (node->kind) {
+  case ND_NULL_EXPR:
+  case ND_NUM:
+  case ND_VAR:
+  case ND_MEMZERO:
+  case ND_GOTO:
+    break;
+  case ND_IF:
+  case ND_COND:
+    add_type(node->cond);
+    add_type(node->then);
+    add_type(node->els);
+    break;
+  case ND_FOR:
+    add_type(node->cond);
+    add_type(node->then);
+    add_type(node->init);
+    add_type(node->inc);
+    break;
+  case ND_DO:
+  case ND_SWITCH:
+    add_type(node->cond);
+    add_type(node->then);
+    break;
+  case ND_BLOCK:
+  case ND_STMT_EXPR:
+    for (Node *n = node->body; n; n = n->next)
+      add_type(n);
+    break;
+  case ND_FUNCALL:
+    for (Node *n = node->args; n; n = n->next)
+      add_type(n);
+    break;
+  case ND_NEG:
+  case ND_ADDR:
+  case ND_DEREF:
+  case ND_NOT:
+  case ND_BITNOT:
+  case ND_RETURN:
+  case ND_EXPR_STMT:
+  case ND_CAST:
+  case ND_MEMBER:
+  case ND_CASE:
+  case ND_LABEL:
+    add_type(node->lhs);
+    break;
+  default:
+    add_type(node->lhs);
+    add_type(node->rhs);
+  }
 
   switch (node->kind) {
   case ND_NUM: